@@ -26,8 +26,8 @@
  * - JSON "null" values are represented as lightuserdata since Lua
  *   tables cannot contain "nil". Compare with cjson.null.
  * - Invalid UTF-8 characters are not detected and will be passed
- *   untouched. If required, UTF-8 error checking should be done
- *   outside this library.
+ *   untouched by default. Strict UTF-8 checking can be enabled with
+ *   cjson.refuse_invalid_utf8().
  * - Javascript comments are not part of the JSON spec, and are not
  *   currently supported.
  *
@@ -37,17 +37,59 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef DISABLE_THREADS
+#include <pthread.h>
+#endif
+
+/* Vector kernels require a compiler which supports per function target
+ * attributes (GCC 5+ or Clang). Build with -DDISABLE_SIMD to use the
+ * scalar kernels only. */
+#if !defined(DISABLE_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define JSON_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 #include "strbuf.h"
+#include "lua_cjson.h"
 
 #ifdef MISSING_ISINF
 #define isinf(x) (!isnan(x) && isnan((x) - (x)))
 #endif
 
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+#define lua_objlen(l, i) lua_rawlen(l, i)
+#endif
+
+/* Lua 5.3+ has a separate integer subtype. JSON integers which fit are
+ * decoded as Lua integers, and Lua integers are encoded exactly. */
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503
+#define JSON_INTEGERS
+#define JSON_INTEGER_MIN LUA_MININTEGER
+#define JSON_INTEGER_MAX LUA_MAXINTEGER
+#else
+#define JSON_INTEGER_MIN INT64_MIN
+#define JSON_INTEGER_MAX INT64_MAX
+#endif
+
 #define DEFAULT_SPARSE_CONVERT 0
 #define DEFAULT_SPARSE_RATIO 2
 #define DEFAULT_SPARSE_SAFE 10
@@ -55,6 +97,35 @@
 #define DEFAULT_ENCODE_REFUSE_BADNUM 1
 #define DEFAULT_DECODE_REFUSE_BADNUM 0
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
+#define DEFAULT_ENCODE_REFUSE_BADUTF8 0
+#define DEFAULT_ENCODE_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_DECODE_REFUSE_BADUTF8 0
+#define DEFAULT_DECODE_MAX_DEPTH 1000
+
+#define DEFAULT_DECODE_THREADS 1
+#define DEFAULT_DECODE_PARALLEL_MIN (1024 * 1024)
+#define DEFAULT_DECODE_PACKED_ARRAYS 0
+#define DEFAULT_DECODE_PACKED_MIN 16
+#define DEFAULT_DECODE_CACHE_SIZE 64
+
+/* Decoding reserves Lua stack space for this many nested levels at once */
+#define DECODE_STACK_RESERVE 16
+
+/* Limits for parallel decoding of large arrays */
+#define DECODE_MAX_THREADS 64
+#define DECODE_PARALLEL_MIN_RANGE (256 * 1024)
+
+/* Canonical encoding hashes output in blocks of at least this size */
+#define JSON_DIGEST_BLOCK 4096
+
+#define JSON_RANGES_MT "cjson.ranges"
+#define JSON_ASYNC_MT "cjson.async"
+#define JSON_SHARED_MT "cjson.shared"
+#define JSON_PACKED_MT "cjson.packed"
+#define JSON_STEP_MT "cjson.step"
+#define JSON_TEMPLATE_MT "cjson.template"
+#define MSGPACK_TAPE_MT "cjson.msgpack_tape"
+#define JSON_CONFIG_KEY "cjson.config"
 
 typedef enum {
     T_OBJ_BEGIN,
@@ -91,6 +162,60 @@ static const char *json_token_type_name[] = {
     NULL
 };
 
+/* Array or object currently being decoded */
+typedef struct {
+    json_token_type_t type;     /* T_ARR_BEGIN or T_OBJ_BEGIN */
+    int index;                  /* Array elements stored so far */
+    int length;                 /* Total elements (tape containers) */
+    int node;                   /* Decode template node, or -1 */
+    int field;                  /* Template field expected next, or
+                                 * array element node */
+} json_container_t;
+
+/* Counters returned by cjson.stats() */
+typedef struct {
+    uint64_t decode_documents;
+    uint64_t decode_bytes;
+    uint64_t decode_tables;         /* Lua tables created */
+    uint64_t decode_escapes;        /* Escape sequences in strings */
+    uint64_t decode_numbers;        /* Numbers converted with strtod() */
+    uint64_t decode_cache_hits;     /* cjson.decode_cached() */
+    uint64_t decode_cache_misses;
+    uint64_t encode_documents;
+    uint64_t encode_bytes;
+    uint64_t encode_escaped_strings;    /* Strings requiring escapes */
+    uint64_t encode_numbers;        /* Numbers formatted with printf() */
+    uint64_t encode_buffer_reallocs;
+    uint64_t encode_buffer_peak;    /* Largest encoding buffer size */
+} json_stats_t;
+
+/* Streaming XXH64 state */
+typedef struct {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;             /* Bytes consumed */
+    char buffer[32];            /* Partial stripe */
+    size_t buffered;
+} json_xxh64_t;
+
+/* JSON text previously decoded by cjson.decode_cached() */
+typedef struct {
+    uint64_t hash;
+    size_t len;
+    char *text;
+    struct json_shared_doc *doc;
+    uint64_t used;              /* Tick of the last lookup */
+} json_cache_entry_t;
+
+/* Object key counted by cjson.analyze() */
+typedef struct {
+    uint64_t hash;
+    int index;          /* First occurrence of the key */
+    int offset;         /* Decoded key within the key names buffer */
+    int length;
+    int count;
+} json_key_count_t;
+
 typedef struct {
     json_token_type_t ch2token[256];
     char escape2char[256];  /* Decoding */
@@ -99,7 +224,9 @@ typedef struct {
     char *char2escape[256]; /* Encoding */
 #endif
     strbuf_t encode_buf;
+    int encode_buf_reallocs;    /* Before the current call */
     char number_fmt[8];     /* "%.XXg\0" */
+    double number_integer_limit;        /* 10^encode_number_precision */
     int current_depth;
 
     int encode_sparse_convert;
@@ -108,28 +235,229 @@ typedef struct {
     int encode_max_depth;
     int encode_refuse_badnum;
     int decode_refuse_badnum;
+    int encode_refuse_badutf8;
+    int decode_refuse_badutf8;
     int encode_keep_buffer;
     int encode_number_precision;
+    int encode_canonical;       /* Current call: sort keys, hash output */
+    json_xxh64_t encode_digest;
+    int encode_digest_pos;      /* Output bytes hashed */
+
+    /* decode_max_depth entries. Decoders take the stack while they
+     * run (see json_take_stack()), as a __gc metamethod may decode or
+     * change decode_max_depth() during a decode. */
+    json_container_t *decode_stack;
+    int decode_max_depth;
+    int decode_threads;
+    int decode_parallel_min;
+    int decode_packed_arrays;
+    int decode_packed_min;
+
+    json_cache_entry_t *decode_cache;   /* decode_cache_size entries */
+    int decode_cache_size;
+    int decode_cache_count;
+    uint64_t decode_cache_tick;
+
+    json_key_count_t *analyze_keys;     /* JSON_ANALYZE_KEY_SLOTS entries */
+    strbuf_t *analyze_names;    /* Decoded keys in analyze_keys */
+    strbuf_t *analyze_tmp;      /* Unescaped strings, kept between calls */
+
+    json_stats_t stats;
 } json_config_t;
 
+/* Expected array or object, see cjson.template() */
+typedef struct {
+    json_token_type_t type;     /* T_ARR_BEGIN or T_OBJ_BEGIN */
+    int size;                   /* Fields, or expected array length */
+    int fields;                 /* Index of the first field */
+    int element;                /* Array element node, or -1 */
+} json_template_node_t;
+
+typedef struct {
+    const char *key;            /* Held by the template's key table */
+    size_t key_len;
+    int node;                   /* Value node, or -1 */
+} json_template_field_t;
+
+typedef struct {
+    int ref;                    /* Key table in the registry */
+    int node_count;
+    int field_count;
+    json_template_field_t *fields;
+    json_template_node_t *nodes;        /* Node 0 is the root */
+} json_template_t;
+
+/* Parser position, see json_next_event() */
+typedef enum {
+    JSON_PARSE_VALUE,           /* Expecting a value */
+    JSON_PARSE_HELD,            /* First token of a value already read */
+    JSON_PARSE_FIRST,           /* After "[" or "{" */
+    JSON_PARSE_COLON,           /* After an object key */
+    JSON_PARSE_NEXT             /* After a complete value */
+} json_parse_state_t;
+
+typedef enum {
+    JSON_EVENT_VALUE,           /* String, number, boolean or null */
+    JSON_EVENT_OPEN,            /* Array or object pushed on the stack */
+    JSON_EVENT_KEY,             /* Object key string */
+    JSON_EVENT_CLOSE,           /* Array or object removed from the stack */
+    JSON_EVENT_ERROR            /* Unexpected token, see json->error */
+} json_event_t;
+
 typedef struct {
     const char *data;
+    int len;          /* Length of data, excluding the NULL terminator */
     int index;
     strbuf_t *tmp;    /* Temporary storage for strings */
     json_config_t *cfg;
+    json_container_t *stack;    /* Open arrays/objects */
+    int stack_size;             /* Taken from the configuration, else 0 */
+    int depth;
+    int reserved_depth;         /* Depth with Lua stack space reserved */
+    json_parse_state_t state;
+    const char *error;          /* Expected token after JSON_EVENT_ERROR */
+
+    /* Limits for the current call, see json_decode_limits() */
+    int max_depth;
+    int elements;               /* Values remaining */
+    int string_bytes;           /* String bytes remaining */
+
+    /* Statistics, added to the configuration by the Lua thread */
+    int escapes;
+    int numbers;
+    int tables;
+
+    /* cjson.decode_with() */
+    json_template_t *tmpl;      /* NULL for other decoders */
+    int tmpl_keys;              /* Stack index of the key table */
+    int next_node;              /* Node for the next container */
 } json_parse_t;
 
+/* Optional limits passed to cjson.decode() */
+typedef struct {
+    int bytes;
+    int depth;
+    int elements;
+    int string_bytes;
+} json_limits_t;
+
 typedef struct {
     json_token_type_t type;
     int index;
     union {
         const char *string;
         double number;
+        int64_t integer;
         int boolean;
     } value;
     int string_len;
+    int integer;                /* T_NUMBER: value.integer is set */
 } json_token_t;
 
+typedef enum {
+    TAPE_NULL,
+    TAPE_FALSE,
+    TAPE_TRUE,
+    TAPE_NUMBER,
+    TAPE_STRING,
+    TAPE_ARRAY,
+    TAPE_OBJECT,
+    TAPE_INTEGER
+} json_tape_type_t;
+
+typedef struct {
+    json_tape_type_t type;
+    int length;                 /* String: bytes, Array: elements,
+                                 * Object: key/value pairs */
+    union {
+        double number;
+        int64_t integer;
+        int offset;             /* String: offset into the arena */
+        int next;               /* Array/Object: node after the container */
+    } value;
+} json_tape_node_t;
+
+typedef struct {
+    json_tape_node_t *nodes;
+    int count;
+    int size;
+    strbuf_t strings;           /* String arena */
+} json_tape_t;
+
+/* A range of top level array elements decoded by a single thread */
+typedef struct {
+    json_parse_t json;          /* Private tokeniser state */
+    json_tape_t tape;           /* Elements within the range */
+    int elements;
+    int end;                    /* Index of the comma ending the range,
+                                 * -1 for the final range */
+    const char *error;          /* Expected token when parsing failed */
+#ifndef DISABLE_THREADS
+    pthread_t thread;
+    int started;
+#endif
+} json_range_t;
+
+typedef struct {
+    int count;
+    json_range_t range[1];
+} json_ranges_t;
+
+/* Handle returned by cjson.encode_async() */
+typedef struct {
+    json_tape_t tape;           /* Captured Lua value */
+    strbuf_t output;            /* JSON text */
+    char number_fmt[8];
+    int done;
+    int failed;                 /* Worker ran out of memory */
+#ifndef DISABLE_THREADS
+    pthread_t thread;
+    pthread_mutex_t lock;       /* Protects "done" */
+    int started;
+    int lock_init;
+#endif
+} json_async_t;
+
+/* A parsed document shared by all Lua states in the process */
+typedef struct json_shared_doc {
+    struct json_shared_doc *next;
+    char *name;
+    size_t name_len;
+    int refcount;
+    json_tape_t tape;
+    int *first;                 /* Array/Object node: first child slot */
+    int *children;              /* Array: element nodes, Object: key nodes
+                                 * sorted by key, see json_shared_index() */
+} json_shared_doc_t;
+
+/* Proxy userdata for a shared array or object */
+typedef struct {
+    json_shared_doc_t *doc;
+    int node;
+} json_shared_t;
+
+typedef enum {
+    STEP_RUNNING,
+    STEP_DONE,
+    STEP_FAILED
+} json_step_status_t;
+
+/* Time sliced decoder or encoder returned by cjson.decoder() and
+ * cjson.encoder() */
+typedef struct {
+    json_config_t *cfg;
+    int ref;                    /* Registry reference to the state table */
+    int encoding;
+    json_step_status_t status;
+    json_container_t *stack;    /* Open arrays/objects */
+    int depth;
+    int max_depth;
+    json_parse_t json;          /* Decoder: tokeniser state */
+    int json_len;
+    strbuf_t output;            /* Encoder: JSON text */
+    int started;                /* Encoder: top level value fetched */
+} json_step_t;
+
 static const char *char2escape[256] = {
     "\\u0000", "\\u0001", "\\u0002", "\\u0003",
     "\\u0004", "\\u0005", "\\u0006", "\\u0007",
@@ -169,22 +497,19 @@ static const char *char2escape[256] = {
     NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
 };
 
-static int json_config_key;
-
 /* ===== CONFIGURATION ===== */
 
+/* Each module function holds its json_config_t as the first upvalue.
+ * Module tables created by cjson.new() have independent settings and
+ * buffers. */
 static json_config_t *json_fetch_config(lua_State *l)
 {
     json_config_t *cfg;
 
-    lua_pushlightuserdata(l, &json_config_key);
-    lua_gettable(l, LUA_REGISTRYINDEX);
-    cfg = lua_touserdata(l, -1);
+    cfg = lua_touserdata(l, lua_upvalueindex(1));
     if (!cfg)
         luaL_error(l, "BUG: Unable to fetch CJSON configuration");
 
-    lua_pop(l, 1);
-
     return cfg;
 }
 
@@ -248,10 +573,120 @@ static int json_cfg_encode_max_depth(lua_State *l)
     return 1;
 }
 
+/* Configures the maximum number of nested arrays/objects allowed when
+ * decoding */
+static int json_cfg_decode_max_depth(lua_State *l)
+{
+    json_config_t *cfg;
+    json_container_t *stack;
+    int depth;
+
+    json_verify_arg_count(l, 1);
+    cfg = json_fetch_config(l);
+
+    if (lua_gettop(l)) {
+        depth = luaL_checkinteger(l, 1);
+        luaL_argcheck(l, depth > 0, 1, "expected positive integer");
+        stack = realloc(cfg->decode_stack, depth * sizeof(*stack));
+        if (!stack)
+            luaL_error(l, "Out of memory");
+        cfg->decode_stack = stack;
+        cfg->decode_max_depth = depth;
+    }
+
+    lua_pushinteger(l, cfg->decode_max_depth);
+
+    return 1;
+}
+
+/* Configures parallel decoding of large top level arrays:
+ * threads: Maximum threads per decode. 1 disables parallel decoding.
+ * min_size: Only decode JSON text at least this long in parallel */
+static int json_cfg_decode_threads(lua_State *l)
+{
+    json_config_t *cfg;
+    int val;
+
+    json_verify_arg_count(l, 2);
+    cfg = json_fetch_config(l);
+
+    switch (lua_gettop(l)) {
+    case 2:
+        val = luaL_checkinteger(l, 2);
+        luaL_argcheck(l, val >= 0, 2, "expected integer >= 0");
+        cfg->decode_parallel_min = val;
+    case 1:
+        val = luaL_checkinteger(l, 1);
+        luaL_argcheck(l, 1 <= val && val <= DECODE_MAX_THREADS, 1,
+                      "expected integer between 1 and 64");
+#ifdef DISABLE_THREADS
+        luaL_argcheck(l, val == 1, 1, "threads are not supported");
+#endif
+        cfg->decode_threads = val;
+    }
+
+    lua_pushinteger(l, cfg->decode_threads);
+    lua_pushinteger(l, cfg->decode_parallel_min);
+
+    return 2;
+}
+
+/* Configures decoding arrays of numbers into packed userdata:
+ * enable: Pack arrays which only contain numbers?
+ * min_length: Shorter arrays are decoded as tables */
+static int json_cfg_decode_packed_arrays(lua_State *l)
+{
+    json_config_t *cfg;
+    int val;
+
+    json_verify_arg_count(l, 2);
+    cfg = json_fetch_config(l);
+
+    switch (lua_gettop(l)) {
+    case 2:
+        val = luaL_checkinteger(l, 2);
+        luaL_argcheck(l, val > 0, 2, "expected positive integer");
+        cfg->decode_packed_min = val;
+    case 1:
+        luaL_checktype(l, 1, LUA_TBOOLEAN);
+        cfg->decode_packed_arrays = lua_toboolean(l, 1);
+    }
+
+    lua_pushboolean(l, cfg->decode_packed_arrays);
+    lua_pushinteger(l, cfg->decode_packed_min);
+
+    return 2;
+}
+
+static void json_decode_cache_free(json_config_t *cfg);
+
+/* Configures the number of documents kept by cjson.decode_cached().
+ * Changing the size empties the cache. */
+static int json_cfg_decode_cache_size(lua_State *l)
+{
+    json_config_t *cfg;
+    int size;
+
+    json_verify_arg_count(l, 1);
+    cfg = json_fetch_config(l);
+
+    if (lua_gettop(l)) {
+        size = luaL_checkinteger(l, 1);
+        luaL_argcheck(l, size >= 0, 1, "expected non-negative integer");
+        json_decode_cache_free(cfg);
+        cfg->decode_cache_size = size;
+    }
+
+    lua_pushinteger(l, cfg->decode_cache_size);
+
+    return 1;
+}
+
 static void json_set_number_precision(json_config_t *cfg, int prec)
 {
     cfg->encode_number_precision = prec;
     sprintf(cfg->number_fmt, "%%.%dg", prec);
+    cfg->number_integer_limit = pow(10, prec);
 }
 
 /* Configures number precision when converting doubles to text */
@@ -337,32 +772,109 @@ static int json_cfg_refuse_invalid_numbers(lua_State *l)
     return 1;
 }
 
+/* When enabled, rejects strings which are not valid UTF-8 */
+static int json_cfg_refuse_invalid_utf8(lua_State *l)
+{
+    static const char *options_enc_dec[] = { "none", "encode", "decode",
+                                             "both", NULL };
+    json_config_t *cfg;
+
+    json_verify_arg_count(l, 1);
+    cfg = json_fetch_config(l);
+
+    json_enum_option(l, options_enc_dec,
+                     &cfg->encode_refuse_badutf8,
+                     &cfg->decode_refuse_badutf8);
+
+    return 1;
+}
+
+/* Returns a table of the counters in json_stats_t */
+static int json_stats(lua_State *l)
+{
+    json_config_t *cfg;
+    json_stats_t *stats;
+
+    json_verify_arg_count(l, 0);
+    cfg = json_fetch_config(l);
+    stats = &cfg->stats;
+
+    lua_createtable(l, 0, 13);
+
+#define PUSH_STAT(name) \
+    lua_pushnumber(l, (lua_Number)stats->name); \
+    lua_setfield(l, -2, #name)
+
+    PUSH_STAT(decode_documents);
+    PUSH_STAT(decode_bytes);
+    PUSH_STAT(decode_tables);
+    PUSH_STAT(decode_escapes);
+    PUSH_STAT(decode_numbers);
+    PUSH_STAT(decode_cache_hits);
+    PUSH_STAT(decode_cache_misses);
+    PUSH_STAT(encode_documents);
+    PUSH_STAT(encode_bytes);
+    PUSH_STAT(encode_escaped_strings);
+    PUSH_STAT(encode_numbers);
+    PUSH_STAT(encode_buffer_reallocs);
+    PUSH_STAT(encode_buffer_peak);
+
+#undef PUSH_STAT
+
+    return 1;
+}
+
+static int json_reset_stats(lua_State *l)
+{
+    json_config_t *cfg;
+
+    json_verify_arg_count(l, 0);
+    cfg = json_fetch_config(l);
+
+    memset(&cfg->stats, 0, sizeof(cfg->stats));
+
+    return 0;
+}
+
 static int json_destroy_config(lua_State *l)
 {
     json_config_t *cfg;
 
     cfg = lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
         strbuf_free(&cfg->encode_buf);
+        free(cfg->decode_stack);
+        json_decode_cache_free(cfg);
+        free(cfg->analyze_keys);
+        if (cfg->analyze_names)
+            strbuf_free(cfg->analyze_names);
+        if (cfg->analyze_tmp)
+            strbuf_free(cfg->analyze_tmp);
+    }
     cfg = NULL;
 
     return 0;
 }
 
-static void json_create_config(lua_State *l)
+/* Set the default configuration and lookup tables. The encoding buffer
+ * and decoding stack are not allocated. */
+static void json_init_config(json_config_t *cfg)
 {
-    json_config_t *cfg;
     int i;
 
-    cfg = lua_newuserdata(l, sizeof(*cfg));
-
-    /* Create GC method to clean up strbuf */
-    lua_newtable(l);
-    lua_pushcfunction(l, json_destroy_config);
-    lua_setfield(l, -2, "__gc");
-    lua_setmetatable(l, -2);
-
-    strbuf_init(&cfg->encode_buf, 0);
+    cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
+    cfg->decode_threads = DEFAULT_DECODE_THREADS;
+    cfg->decode_parallel_min = DEFAULT_DECODE_PARALLEL_MIN;
+    cfg->decode_packed_arrays = DEFAULT_DECODE_PACKED_ARRAYS;
+    cfg->decode_packed_min = DEFAULT_DECODE_PACKED_MIN;
+    cfg->decode_cache = NULL;
+    cfg->decode_cache_size = DEFAULT_DECODE_CACHE_SIZE;
+    cfg->decode_cache_count = 0;
+    cfg->decode_cache_tick = 0;
+    cfg->analyze_keys = NULL;
+    cfg->analyze_names = NULL;
+    cfg->analyze_tmp = NULL;
+    memset(&cfg->stats, 0, sizeof(cfg->stats));
 
     cfg->encode_sparse_convert = DEFAULT_SPARSE_CONVERT;
     cfg->encode_sparse_ratio = DEFAULT_SPARSE_RATIO;
@@ -370,7 +882,10 @@ static void json_create_config(lua_State *l)
     cfg->encode_max_depth = DEFAULT_MAX_DEPTH;
     cfg->encode_refuse_badnum = DEFAULT_ENCODE_REFUSE_BADNUM;
     cfg->decode_refuse_badnum = DEFAULT_DECODE_REFUSE_BADNUM;
+    cfg->encode_refuse_badutf8 = DEFAULT_ENCODE_REFUSE_BADUTF8;
+    cfg->decode_refuse_badutf8 = DEFAULT_DECODE_REFUSE_BADUTF8;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
+    cfg->encode_canonical = 0;
     json_set_number_precision(cfg, 14);
 
     /* Decoding init */
@@ -445,841 +960,7162 @@ static void json_create_config(lua_State *l)
 #endif
 }
 
-/* ===== ENCODING ===== */
-
-static void json_encode_exception(lua_State *l, json_config_t *cfg, int lindex,
-                                  const char *reason)
+static void json_create_config(lua_State *l)
 {
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(&cfg->encode_buf);
-    luaL_error(l, "Cannot serialise %s: %s",
-                  lua_typename(l, lua_type(l, lindex)), reason);
+    json_config_t *cfg;
+
+    cfg = lua_newuserdata(l, sizeof(*cfg));
+
+    /* Create GC method to clean up strbuf */
+    lua_newtable(l);
+    lua_pushcfunction(l, json_destroy_config);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+
+    strbuf_init(&cfg->encode_buf, 0);
+    json_init_config(cfg);
+
+    cfg->decode_stack = malloc(cfg->decode_max_depth *
+                               sizeof(*cfg->decode_stack));
+    if (!cfg->decode_stack)
+        luaL_error(l, "Out of memory");
 }
 
-/* json_append_string args:
- * - lua_State
- * - JSON strbuf
- * - String (Lua stack index)
+/* ===== CPU KERNELS ===== */
+
+/* Hot loops are implemented once for each instruction set, and the best
+ * version supported by the CPU is selected when the module is first
+ * loaded. cjson.features() reports the selection, and may restrict it
+ * to a lower level for testing.
  *
- * Returns nothing. Doesn't remove string from Lua stack */
-static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
+ * Every kernel accepts "len" bytes of input and never reads past them.
+ * Vector implementations pass any remainder to the scalar version, or
+ * to AVX2 from AVX-512. Calling legacy SSE code from AVX code is
+ * avoided since the transition is slow on many CPUs. */
+
+typedef enum {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_SSE42,
+    KERNEL_AVX2,
+    KERNEL_AVX512
+} json_kernel_level_t;
+
+static const char *json_kernel_level_name[] = {
+    "scalar", "sse2", "sse4.2", "avx2", "avx512"
+};
+
+typedef struct {
+    /* Returns the number of leading JSON whitespace characters */
+    size_t (*skip_whitespace)(const char *str, size_t len);
+    /* Returns the offset of the first quote, backslash or NULL, or of
+     * the first non-ASCII byte when stop_utf8 is set */
+    size_t (*scan_string)(const char *str, size_t len, int stop_utf8);
+    /* Returns the offset of the first character in char2escape */
+    size_t (*scan_escape)(const char *str, size_t len);
+    /* Converts up to 16 leading decimal digits, returns the count */
+    int (*parse_digits)(const char *str, size_t len, uint64_t *value);
+    /* Returns the offset of the first JSON whitespace or quote, or
+     * structural character ({}[],:) when stop_structural is set */
+    size_t (*scan_text)(const char *str, size_t len, int stop_structural);
+
+    json_kernel_level_t level;  /* Highest level allowed */
+    json_kernel_level_t whitespace_level;
+    json_kernel_level_t string_level;
+    json_kernel_level_t escape_level;
+    json_kernel_level_t digits_level;
+    json_kernel_level_t text_level;
+} json_kernels_t;
+
+static size_t json_skip_whitespace_scalar(const char *str, size_t len)
 {
-    const char *escstr;
-    int i;
-    const char *str;
-    size_t len;
+    size_t i;
 
-    str = lua_tolstring(l, lindex, &len);
+    for (i = 0; i < len; i++) {
+        if (str[i] != ' ' && str[i] != '\t' && str[i] != '\n' &&
+            str[i] != '\r')
+            break;
+    }
 
-    /* Worst case is len * 6 (all unicode escapes).
-     * This buffer is reused constantly for small strings
-     * If there are any excess pages, they won't be hit anyway.
-     * This gains ~5% speedup. */
-    strbuf_ensure_empty_length(json, len * 6 + 2);
+    return i;
+}
+
+static size_t json_scan_string_scalar(const char *str, size_t len,
+                                      int stop_utf8)
+{
+    unsigned char ch;
+    size_t i;
 
-    strbuf_append_char_unsafe(json, '\"');
     for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(json, escstr);
-        else
-            strbuf_append_char_unsafe(json, str[i]);
+        ch = str[i];
+        if (ch == '"' || ch == '\\' || !ch || (ch & 0x80 && stop_utf8))
+            break;
     }
-    strbuf_append_char_unsafe(json, '\"');
+
+    return i;
 }
 
-/* Find the size of the array on the top of the Lua stack
- * -1   object (not a pure array)
- * >=0  elements in array
- */
-static int lua_array_length(lua_State *l, json_config_t *cfg)
+static size_t json_scan_escape_scalar(const char *str, size_t len)
 {
-    double k;
-    int max;
-    int items;
+    size_t i;
 
-    max = 0;
-    items = 0;
+    for (i = 0; i < len; i++) {
+        if (char2escape[(unsigned char)str[i]])
+            break;
+    }
 
-    lua_pushnil(l);
-    /* table, startkey */
-    while (lua_next(l, -2) != 0) {
-        /* table, key, value */
-        if (lua_type(l, -2) == LUA_TNUMBER &&
-            (k = lua_tonumber(l, -2))) {
-            /* Integer >= 1 ? */
-            if (floor(k) == k && k >= 1) {
-                if (k > max)
-                    max = k;
-                items++;
-                lua_pop(l, 1);
-                continue;
-            }
-        }
+    return i;
+}
 
-        /* Must not be an array (non integer key) */
-        lua_pop(l, 2);
-        return -1;
+static int json_parse_digits_scalar(const char *str, size_t len,
+                                    uint64_t *value)
+{
+    uint64_t result = 0;
+    int i;
+
+    for (i = 0; i < len && i < 16; i++) {
+        if (str[i] < '0' || '9' < str[i])
+            break;
+        result = result * 10 + (str[i] - '0');
     }
+    *value = result;
 
-    /* Encode excessively sparse arrays as objects (if enabled) */
-    if (cfg->encode_sparse_ratio > 0 &&
-        max > items * cfg->encode_sparse_ratio &&
-        max > cfg->encode_sparse_safe) {
-        if (!cfg->encode_sparse_convert)
-            json_encode_exception(l, cfg, -1, "excessively sparse array");
+    return i;
+}
 
-        return -1;
+static size_t json_scan_text_scalar(const char *str, size_t len,
+                                    int stop_structural)
+{
+    unsigned char ch;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        ch = str[i];
+        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' ||
+            ch == '"')
+            break;
+        /* (ch | 0x20) folds '[' and ']' onto '{' and '}' */
+        if (stop_structural && ((ch | 0x20) == '{' || (ch | 0x20) == '}' ||
+                                ch == ',' || ch == ':'))
+            break;
     }
 
-    return max;
+    return i;
 }
 
-static void json_encode_descend(lua_State *l, json_config_t *cfg)
+#ifdef JSON_X86_KERNELS
+__attribute__((target("sse2")))
+static size_t json_skip_whitespace_sse2(const char *str, size_t len)
 {
-    cfg->current_depth++;
-
-    if (cfg->current_depth > cfg->encode_max_depth) {
-        if (!cfg->encode_keep_buffer)
-            strbuf_free(&cfg->encode_buf);
-        luaL_error(l, "Cannot serialise, excessive nesting (%d)",
-                   cfg->current_depth);
+    __m128i v, ws;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)&str[i]);
+        ws = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
-}
 
-static void json_append_data(lua_State *l, json_config_t *cfg, strbuf_t *json);
+    return i + json_skip_whitespace_scalar(&str[i], len - i);
+}
 
-/* json_append_array args:
- * - lua_State
- * - JSON strbuf
- * - Size of passwd Lua array (top of stack) */
-static void json_append_array(lua_State *l, json_config_t *cfg, strbuf_t *json,
-                              int array_length)
+__attribute__((target("avx2")))
+static size_t json_skip_whitespace_avx2(const char *str, size_t len)
 {
-    int comma, i;
+    __m256i v, ws;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)&str[i]);
+        ws = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        mask = ~(unsigned)_mm256_movemask_epi8(ws);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
 
-    json_encode_descend(l, cfg);
+    return i + json_skip_whitespace_scalar(&str[i], len - i);
+}
 
-    strbuf_append_char(json, '[');
+__attribute__((target("sse2")))
+static size_t json_scan_string_sse2(const char *str, size_t len,
+                                    int stop_utf8)
+{
+    __m128i v, stop;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)&str[i]);
+        stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+            _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        mask = _mm_movemask_epi8(stop);
+        if (stop_utf8)
+            mask |= _mm_movemask_epi8(v);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
 
-    comma = 0;
-    for (i = 1; i <= array_length; i++) {
-        if (comma)
-            strbuf_append_char(json, ',');
-        else
-            comma = 1;
+    return i + json_scan_string_scalar(&str[i], len - i, stop_utf8);
+}
 
-        lua_rawgeti(l, -1, i);
-        json_append_data(l, cfg, json);
-        lua_pop(l, 1);
+__attribute__((target("avx2")))
+static size_t json_scan_string_avx2(const char *str, size_t len,
+                                    int stop_utf8)
+{
+    __m256i v, stop;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)&str[i]);
+        stop = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        mask = _mm256_movemask_epi8(stop);
+        if (stop_utf8)
+            mask |= _mm256_movemask_epi8(v);
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
 
-    strbuf_append_char(json, ']');
-
-    cfg->current_depth--;
+    return i + json_scan_string_scalar(&str[i], len - i, stop_utf8);
 }
 
-static void json_append_number(lua_State *l, strbuf_t *json, int index,
-                               json_config_t *cfg)
+__attribute__((target("avx512f,avx512bw")))
+static size_t json_scan_string_avx512(const char *str, size_t len,
+                                      int stop_utf8)
 {
-    double num = lua_tonumber(l, index);
-
-    if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
-        json_encode_exception(l, cfg, index, "must not be NaN or Inf");
+    __m512i v;
+    uint64_t mask;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        v = _mm512_loadu_si512(&str[i]);
+        mask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"')) |
+               _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\')) |
+               _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512());
+        if (stop_utf8)
+            mask |= _mm512_movepi8_mask(v);
+        if (mask)
+            return i + __builtin_ctzll(mask);
+    }
 
-    /* Lowest double printed with %.14g is 21 characters long:
-     * -1.7976931348623e+308
-     *
-     * Use 32 to include the \0, and a few extra just in case..
-     */
-    strbuf_append_fmt(json, 32, cfg->number_fmt, num);
+    return i + json_scan_string_avx2(&str[i], len - i, stop_utf8);
 }
 
-static void json_append_object(lua_State *l, json_config_t *cfg,
-                               strbuf_t *json)
+/* Characters 0-31 are found with an unsigned comparison: max(v, 31) is
+ * only 31 when v <= 31 */
+__attribute__((target("sse2")))
+static size_t json_scan_escape_sse2(const char *str, size_t len)
 {
-    int comma, keytype;
+    __m128i v, esc;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)&str[i]);
+        esc = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(127))));
+        esc = _mm_or_si128(esc, _mm_cmpeq_epi8(
+            _mm_max_epu8(v, _mm_set1_epi8(31)), _mm_set1_epi8(31)));
+        mask = _mm_movemask_epi8(esc);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
 
-    json_encode_descend(l, cfg);
+    return i + json_scan_escape_scalar(&str[i], len - i);
+}
 
-    /* Object */
-    strbuf_append_char(json, '{');
+__attribute__((target("sse2")))
+static size_t json_scan_text_sse2(const char *str, size_t len,
+                                  int stop_structural)
+{
+    __m128i v, fold, stop;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)&str[i]);
+        stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+        if (stop_structural) {
+            fold = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            stop = _mm_or_si128(stop, _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(fold, _mm_set1_epi8('{')),
+                             _mm_cmpeq_epi8(fold, _mm_set1_epi8('}'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(':')))));
+        }
+        mask = _mm_movemask_epi8(stop);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
 
-    lua_pushnil(l);
-    /* table, startkey */
-    comma = 0;
-    while (lua_next(l, -2) != 0) {
-        if (comma)
-            strbuf_append_char(json, ',');
-        else
-            comma = 1;
+    return i + json_scan_text_scalar(&str[i], len - i, stop_structural);
+}
 
-        /* table, key, value */
-        keytype = lua_type(l, -2);
-        if (keytype == LUA_TNUMBER) {
-            strbuf_append_char(json, '"');
-            json_append_number(l, json, -2, cfg);
-            strbuf_append_mem(json, "\":", 2);
-        } else if (keytype == LUA_TSTRING) {
-            json_append_string(l, json, -2);
-            strbuf_append_char(json, ':');
-        } else {
-            json_encode_exception(l, cfg, -2,
-                                  "table key must be a number or string");
-            /* never returns */
+__attribute__((target("avx2")))
+static size_t json_scan_text_avx2(const char *str, size_t len,
+                                  int stop_structural)
+{
+    __m256i v, fold, stop;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)&str[i]);
+        stop = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        stop = _mm256_or_si256(stop,
+                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+        if (stop_structural) {
+            fold = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            stop = _mm256_or_si256(stop, _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(fold, _mm256_set1_epi8('{')),
+                                _mm256_cmpeq_epi8(fold, _mm256_set1_epi8('}'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')))));
         }
-
-        /* table, key, value */
-        json_append_data(l, cfg, json);
-        lua_pop(l, 1);
-        /* table, key */
+        mask = _mm256_movemask_epi8(stop);
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
 
-    strbuf_append_char(json, '}');
-
-    cfg->current_depth--;
+    return i + json_scan_text_scalar(&str[i], len - i, stop_structural);
 }
 
-/* Serialise Lua data into JSON string. */
-static void json_append_data(lua_State *l, json_config_t *cfg, strbuf_t *json)
+/* PCMPESTRI matches every escaped character range with one instruction */
+__attribute__((target("sse4.2")))
+static size_t json_scan_escape_sse42(const char *str, size_t len)
 {
-    int len;
+    static const char ranges[16] = "\x00\x1f\"\"//\\\\\x7f\x7f";
+    __m128i set, v;
+    size_t i;
+    int index;
 
-    switch (lua_type(l, -1)) {
-    case LUA_TSTRING:
-        json_append_string(l, json, -1);
-        break;
-    case LUA_TNUMBER:
-        json_append_number(l, json, -1, cfg);
-        break;
-    case LUA_TBOOLEAN:
-        if (lua_toboolean(l, -1))
-            strbuf_append_mem(json, "true", 4);
-        else
-            strbuf_append_mem(json, "false", 5);
-        break;
-    case LUA_TTABLE:
-        len = lua_array_length(l, cfg);
-        if (len > 0)
-            json_append_array(l, cfg, json, len);
-        else
-            json_append_object(l, cfg, json);
-        break;
-    case LUA_TNIL:
-        strbuf_append_mem(json, "null", 4);
-        break;
-    case LUA_TLIGHTUSERDATA:
-        if (lua_touserdata(l, -1) == NULL) {
-            strbuf_append_mem(json, "null", 4);
-            break;
-        }
-    default:
-        /* Remaining types (LUA_TFUNCTION, LUA_TUSERDATA, LUA_TTHREAD,
-         * and LUA_TLIGHTUSERDATA) cannot be serialised */
-        json_encode_exception(l, cfg, -1, "type not supported");
-        /* never returns */
+    set = _mm_loadu_si128((const __m128i *)ranges);
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)&str[i]);
+        index = _mm_cmpestri(set, 10, v, 16, _SIDD_UBYTE_OPS |
+                             _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16)
+            return i + index;
     }
+
+    return i + json_scan_escape_scalar(&str[i], len - i);
 }
 
-static int json_encode(lua_State *l)
+__attribute__((target("avx2")))
+static size_t json_scan_escape_avx2(const char *str, size_t len)
 {
-    json_config_t *cfg;
-    char *json;
-    int len;
+    __m256i v, esc;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)&str[i]);
+        esc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127))));
+        esc = _mm256_or_si256(esc, _mm256_cmpeq_epi8(
+            _mm256_max_epu8(v, _mm256_set1_epi8(31)), _mm256_set1_epi8(31)));
+        mask = _mm256_movemask_epi8(esc);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
 
-    /* Can't use json_verify_arg_count() since we need to ensure
-     * there is only 1 argument */
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    return i + json_scan_escape_scalar(&str[i], len - i);
+}
 
-    cfg = json_fetch_config(l);
-    cfg->current_depth = 0;
+__attribute__((target("avx512f,avx512bw")))
+static size_t json_scan_escape_avx512(const char *str, size_t len)
+{
+    __m512i v;
+    uint64_t mask;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        v = _mm512_loadu_si512(&str[i]);
+        mask = _mm512_cmplt_epu8_mask(v, _mm512_set1_epi8(32)) |
+               _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"')) |
+               _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\')) |
+               _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('/')) |
+               _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(127));
+        if (mask)
+            return i + __builtin_ctzll(mask);
+    }
 
-    /* Reset the persistent buffer if it exists.
-     * Otherwise allocate a new buffer. */
-    if (strbuf_allocated(&cfg->encode_buf))
-        strbuf_reset(&cfg->encode_buf);
-    else
-        strbuf_init(&cfg->encode_buf, 0);
+    return i + json_scan_escape_avx2(&str[i], len - i);
+}
 
-    json_append_data(l, cfg, &cfg->encode_buf);
-    json = strbuf_string(&cfg->encode_buf, &len);
+/* Long runs of digits are right aligned in a zero padded vector, then
+ * combined pairwise: 16 x 1 digit -> 8 x 2 -> 4 x 4 -> 2 x 8 digits. */
+__attribute__((target("sse2")))
+static int json_parse_digits_sse2(const char *str, size_t len,
+                                  uint64_t *value)
+{
+    char buf[16];
+    __m128i v, digits;
+    unsigned mask;
+    int count;
+
+    if (len < 16)
+        return json_parse_digits_scalar(str, len, value);
+
+    v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)str),
+                     _mm_set1_epi8('0'));
+    digits = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(9)),
+                            _mm_set1_epi8(9));
+    mask = ~_mm_movemask_epi8(digits) & 0xFFFF;
+    count = mask ? __builtin_ctz(mask) : 16;
+
+    /* Short numbers are quicker to convert one digit at a time */
+    if (count < 8)
+        return json_parse_digits_scalar(str, count, value);
+
+    memset(buf, '0', sizeof(buf));
+    memcpy(&buf[16 - count], str, count);
+    v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)buf),
+                     _mm_set1_epi8('0'));
+
+    v = _mm_packs_epi32(
+        _mm_madd_epi16(_mm_unpacklo_epi8(v, _mm_setzero_si128()),
+                       _mm_set_epi16(1, 10, 1, 10, 1, 10, 1, 10)),
+        _mm_madd_epi16(_mm_unpackhi_epi8(v, _mm_setzero_si128()),
+                       _mm_set_epi16(1, 10, 1, 10, 1, 10, 1, 10)));
+    v = _mm_madd_epi16(v, _mm_set_epi16(1, 100, 1, 100, 1, 100, 1, 100));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_madd_epi16(v, _mm_set_epi16(1, 10000, 1, 10000,
+                                        1, 10000, 1, 10000));
+
+    *value = (uint64_t)_mm_cvtsi128_si32(v) * 100000000 +
+             (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+
+    return count;
+}
+#endif
 
-    lua_pushlstring(l, json, len);
+/* The best implementation of each kernel up to each level. Levels
+ * above KERNEL_SCALAR are only selected on x86 CPUs. */
+static const json_kernels_t json_kernel_levels[] = {
+    {
+        json_skip_whitespace_scalar,
+        json_scan_string_scalar,
+        json_scan_escape_scalar,
+        json_parse_digits_scalar,
+        json_scan_text_scalar,
+        KERNEL_SCALAR, KERNEL_SCALAR, KERNEL_SCALAR, KERNEL_SCALAR,
+        KERNEL_SCALAR, KERNEL_SCALAR
+    },
+#ifdef JSON_X86_KERNELS
+    {
+        json_skip_whitespace_sse2,
+        json_scan_string_sse2,
+        json_scan_escape_sse2,
+        json_parse_digits_sse2,
+        json_scan_text_sse2,
+        KERNEL_SSE2, KERNEL_SSE2, KERNEL_SSE2, KERNEL_SSE2,
+        KERNEL_SSE2, KERNEL_SSE2
+    },
+    {
+        json_skip_whitespace_sse2,
+        json_scan_string_sse2,
+        json_scan_escape_sse42,
+        json_parse_digits_sse2,
+        json_scan_text_sse2,
+        KERNEL_SSE42, KERNEL_SSE2, KERNEL_SSE2, KERNEL_SSE42,
+        KERNEL_SSE2, KERNEL_SSE2
+    },
+    {
+        json_skip_whitespace_avx2,
+        json_scan_string_avx2,
+        json_scan_escape_avx2,
+        json_parse_digits_sse2,
+        json_scan_text_avx2,
+        KERNEL_AVX2, KERNEL_AVX2, KERNEL_AVX2, KERNEL_AVX2,
+        KERNEL_SSE2, KERNEL_AVX2
+    },
+    {
+        json_skip_whitespace_avx2,
+        json_scan_string_avx512,
+        json_scan_escape_avx512,
+        json_parse_digits_sse2,
+        json_scan_text_avx2,
+        KERNEL_AVX512, KERNEL_AVX2, KERNEL_AVX512, KERNEL_AVX512,
+        KERNEL_SSE2, KERNEL_AVX2
+    },
+#endif
+};
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(&cfg->encode_buf);
+/* Kernels in use. Other threads may be decoding or encoding while
+ * cjson.features() changes the selection, so only this pointer is ever
+ * replaced, never the table it points to. */
+static const json_kernels_t *json_kernels = &json_kernel_levels[KERNEL_SCALAR];
 
-    return 1;
+static inline const json_kernels_t *json_get_kernels(void)
+{
+#ifdef __GNUC__
+    return __atomic_load_n(&json_kernels, __ATOMIC_RELAXED);
+#else
+    return json_kernels;
+#endif
 }
 
-/* ===== DECODING ===== */
+/* Highest level supported by the CPU, or -1 before detection */
+static int json_cpu_level = -1;
 
-static void json_process_value(lua_State *l, json_parse_t *json,
-                               json_token_t *token);
+/* Levels are treated as cumulative, every CPU with AVX2 also supports
+ * SSE4.2 and SSE2. */
+static json_kernel_level_t json_detect_cpu(void)
+{
+#ifdef JSON_X86_KERNELS
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2"))
+        return KERNEL_SCALAR;
+    if (!__builtin_cpu_supports("sse4.2"))
+        return KERNEL_SSE2;
+    if (!__builtin_cpu_supports("avx2"))
+        return KERNEL_SSE42;
+    if (!__builtin_cpu_supports("avx512bw"))
+        return KERNEL_AVX2;
+    return KERNEL_AVX512;
+#else
+    return KERNEL_SCALAR;
+#endif
+}
 
-static int hexdigit2int(char hex)
+/* Select the best implementation of each kernel up to "level" */
+static void json_select_kernels(json_kernel_level_t level)
 {
-    if ('0' <= hex  && hex <= '9')
-        return hex - '0';
+#ifdef __GNUC__
+    __atomic_store_n(&json_kernels, &json_kernel_levels[level],
+                     __ATOMIC_RELAXED);
+#else
+    json_kernels = &json_kernel_levels[level];
+#endif
+}
 
-    /* Force lowercase */
-    hex |= 0x20;
-    if ('a' <= hex && hex <= 'f')
-        return 10 + hex - 'a';
+static void json_detect_kernels(void)
+{
+    json_cpu_level = json_detect_cpu();
+    json_select_kernels(json_cpu_level);
+}
 
-    return -1;
+/* Select the kernels once per process */
+static void json_init_kernels(void)
+{
+#ifndef DISABLE_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, json_detect_kernels);
+#else
+    if (json_cpu_level < 0)
+        json_detect_kernels();
+#endif
 }
 
-static int decode_hex4(const char *hex)
+/* Selection is process wide. Every kernel produces identical results,
+ * so other Lua states are unaffected apart from speed. Calls already
+ * running in other threads may keep using the previous selection. */
+static int json_features(lua_State *l)
 {
-    int digit[4];
-    int i;
+    static const char *options[] = {
+        "scalar", "sse2", "sse4.2", "avx2", "avx512", "auto", NULL
+    };
+    const json_kernels_t *k;
+    int level, i;
 
-    /* Convert ASCII hex digit to numeric digit
-     * Note: this returns an error for invalid hex digits, including
-     *       NULL */
-    for (i = 0; i < 4; i++) {
-        digit[i] = hexdigit2int(hex[i]);
-        if (digit[i] < 0) {
-            return -1;
-        }
+    json_verify_arg_count(l, 1);
+
+    if (!lua_isnoneornil(l, 1)) {
+        level = luaL_checkoption(l, 1, NULL, options);
+        if (level == KERNEL_AVX512 + 1)
+            level = json_cpu_level;
+        else if (level > json_cpu_level)
+            luaL_error(l, "CPU does not support %s", options[level]);
+        json_select_kernels(level);
     }
+    k = json_get_kernels();
 
-    return (digit[0] << 12) +
-           (digit[1] << 8) +
-           (digit[2] << 4) +
-            digit[3];
+    lua_createtable(l, 0, 7);
+
+    lua_createtable(l, 0, 5);
+    for (i = KERNEL_SCALAR; i <= KERNEL_AVX512; i++) {
+        lua_pushboolean(l, i <= json_cpu_level);
+        lua_setfield(l, -2, json_kernel_level_name[i]);
+    }
+    lua_setfield(l, -2, "cpu");
+
+    lua_pushstring(l, json_kernel_level_name[k->level]);
+    lua_setfield(l, -2, "level");
+    lua_pushstring(l, json_kernel_level_name[k->whitespace_level]);
+    lua_setfield(l, -2, "whitespace");
+    lua_pushstring(l, json_kernel_level_name[k->string_level]);
+    lua_setfield(l, -2, "string");
+    lua_pushstring(l, json_kernel_level_name[k->escape_level]);
+    lua_setfield(l, -2, "escape");
+    lua_pushstring(l, json_kernel_level_name[k->digits_level]);
+    lua_setfield(l, -2, "digits");
+    lua_pushstring(l, json_kernel_level_name[k->text_level]);
+    lua_setfield(l, -2, "text");
+
+    return 1;
 }
 
-/* Converts a Unicode codepoint to UTF-8.
- * Returns UTF-8 string length, and up to 4 bytes in *utf8 */
-static int codepoint_to_utf8(char *utf8, int codepoint)
+/* ===== UTF-8 VALIDATION ===== */
+
+/* Returns the length of the valid UTF-8 sequence starting at *str, or 0
+ * if the sequence is invalid (RFC 3629: overlong forms, surrogates and
+ * codepoints above U+10FFFF are rejected).
+ *
+ * The input must be NULL terminated. A truncated sequence will stop
+ * at the terminator since NULL is never a valid continuation byte. */
+static inline int utf8_sequence_length(const unsigned char *str)
 {
-    /* 0xxxxxxx */
-    if (codepoint <= 0x7F) {
-        utf8[0] = codepoint;
+    unsigned char c = str[0];
+
+    if (c < 0x80)
         return 1;
-    }
 
     /* 110xxxxx 10xxxxxx */
-    if (codepoint <= 0x7FF) {
-        utf8[0] = (codepoint >> 6) | 0xC0;
-        utf8[1] = (codepoint & 0x3F) | 0x80;
-        return 2;
-    }
+    if (c < 0xC2)
+        return 0;
+    if (c < 0xE0)
+        return (str[1] & 0xC0) == 0x80 ? 2 : 0;
 
     /* 1110xxxx 10xxxxxx 10xxxxxx */
-    if (codepoint <= 0xFFFF) {
-        utf8[0] = (codepoint >> 12) | 0xE0;
-        utf8[1] = ((codepoint >> 6) & 0x3F) | 0x80;
-        utf8[2] = (codepoint & 0x3F) | 0x80;
+    if (c < 0xF0) {
+        if (c == 0xE0 && str[1] < 0xA0)     /* Overlong */
+            return 0;
+        if (c == 0xED && str[1] > 0x9F)     /* UTF-16 surrogate */
+            return 0;
+        if ((str[1] & 0xC0) != 0x80 || (str[2] & 0xC0) != 0x80)
+            return 0;
         return 3;
     }
 
     /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
-    if (codepoint <= 0x1FFFFF) {
-        utf8[0] = (codepoint >> 18) | 0xF0;
-        utf8[1] = ((codepoint >> 12) & 0x3F) | 0x80;
-        utf8[2] = ((codepoint >> 6) & 0x3F) | 0x80;
-        utf8[3] = (codepoint & 0x3F) | 0x80;
-        return 4;
+    if (c > 0xF4)
+        return 0;
+    if (c == 0xF0 && str[1] < 0x90)         /* Overlong */
+        return 0;
+    if (c == 0xF4 && str[1] > 0x8F)         /* > U+10FFFF */
+        return 0;
+    if ((str[1] & 0xC0) != 0x80 || (str[2] & 0xC0) != 0x80 ||
+        (str[3] & 0xC0) != 0x80)
+        return 0;
+    return 4;
+}
+
+/* Returns 1 if the NULL terminated string is valid UTF-8, 0 otherwise.
+ *
+ * ASCII is skipped 8 bytes at a time by testing the high bit of each
+ * byte within a word. Only non-ASCII sequences fall back to
+ * utf8_sequence_length(). */
+static int utf8_validate(const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    const unsigned char *end = s + len;
+    uint64_t word;
+    int seqlen;
+
+    while (s < end) {
+        while (end - s >= 8) {
+            memcpy(&word, s, 8);
+            if (word & UINT64_C(0x8080808080808080))
+                break;
+            s += 8;
+        }
+        if (s >= end)
+            break;
+        if (*s < 0x80) {
+            s++;
+            continue;
+        }
+        seqlen = utf8_sequence_length(s);
+        if (!seqlen || seqlen > end - s)
+            return 0;
+        s += seqlen;
     }
 
-    return 0;
+    return 1;
 }
 
+/* ===== PACKED ARRAYS ===== */
 
-/* Called when index pointing to beginning of UTF-16 code escape: \uXXXX
- * \u is guaranteed to exist, but the remaining hex characters may be
- * missing.
- * Translate to UTF-8 and append to temporary token string.
- * Must advance index to the next character to be processed.
- * Returns: 0   success
- *          -1  error
- */
-static int json_append_unicode_escape(json_parse_t *json)
+/* Arrays which only contain numbers may be decoded into a userdata
+ * holding a contiguous double[] (see cjson.decode_packed_arrays()).
+ * They use less memory than a table and are a single object for the
+ * garbage collector to traverse. Elements are read with __index and
+ * __len, and cjson.encode() writes them back as a JSON array. */
+
+typedef struct {
+    int length;
+    double values[1];
+} json_packed_t;
+
+static json_packed_t *json_new_packed(lua_State *l, int length)
+{
+    json_packed_t *packed;
+
+    packed = lua_newuserdata(l, offsetof(json_packed_t, values) +
+                                length * sizeof(double));
+    packed->length = length;
+    luaL_getmetatable(l, JSON_PACKED_MT);
+    lua_setmetatable(l, -2);
+
+    return packed;
+}
+
+/* Returns the packed array at lindex, or NULL for any other value */
+static json_packed_t *json_to_packed(lua_State *l, int lindex)
+{
+    json_packed_t *packed = lua_touserdata(l, lindex);
+
+    if (!packed || !lua_getmetatable(l, lindex))
+        return NULL;
+
+    luaL_getmetatable(l, JSON_PACKED_MT);
+    if (!lua_rawequal(l, -1, -2))
+        packed = NULL;
+    lua_pop(l, 2);
+
+    return packed;
+}
+
+/* Integral elements are pushed as Lua integers, the same as elements
+ * decoded into a table */
+static void json_push_packed_value(lua_State *l, double num)
+{
+#ifdef JSON_INTEGERS
+    if (num >= (double)JSON_INTEGER_MIN && num < -(double)JSON_INTEGER_MIN &&
+        floor(num) == num) {
+        lua_pushinteger(l, (lua_Integer)num);
+        return;
+    }
+#endif
+    lua_pushnumber(l, num);
+}
+
+static int json_packed_index(lua_State *l)
+{
+    json_packed_t *packed;
+    double num;
+
+    packed = luaL_checkudata(l, 1, JSON_PACKED_MT);
+    if (lua_type(l, 2) == LUA_TNUMBER) {
+        /* Check the range before converting. NaN fails every test. */
+        num = lua_tonumber(l, 2);
+        if (num >= 1 && num <= packed->length && floor(num) == num) {
+            json_push_packed_value(l, packed->values[(int)num - 1]);
+            return 1;
+        }
+    }
+
+    lua_pushnil(l);
+
+    return 1;
+}
+
+static int json_packed_len(lua_State *l)
+{
+    json_packed_t *packed;
+
+    packed = luaL_checkudata(l, 1, JSON_PACKED_MT);
+    lua_pushinteger(l, packed->length);
+
+    return 1;
+}
+
+/* ===== HASHING ===== */
+
+/* XXH64, used for decode cache lookups and canonical encoding digests.
+ * The streaming interface allows output to be hashed while it is being
+ * written. */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t json_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Little endian loads, so hashes match on every platform */
+static inline uint64_t json_read64(const char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+
+    return v;
+}
+
+static inline uint32_t json_read32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+
+    return v;
+}
+
+static inline uint64_t json_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = json_rotl64(acc, 31);
+
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t json_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= json_xxh64_round(0, val);
+
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void json_xxh64_init(json_xxh64_t *state, uint64_t seed)
+{
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+    state->seed = seed;
+    state->total = 0;
+    state->buffered = 0;
+}
+
+/* Consume whole 32 byte stripes, and return the number of bytes used */
+static size_t json_xxh64_stripes(json_xxh64_t *state, const char *p,
+                                 size_t len)
+{
+    uint64_t v1 = state->v[0], v2 = state->v[1];
+    uint64_t v3 = state->v[2], v4 = state->v[3];
+    size_t pos;
+
+    for (pos = 0; len - pos >= 32; pos += 32) {
+        v1 = json_xxh64_round(v1, json_read64(p + pos));
+        v2 = json_xxh64_round(v2, json_read64(p + pos + 8));
+        v3 = json_xxh64_round(v3, json_read64(p + pos + 16));
+        v4 = json_xxh64_round(v4, json_read64(p + pos + 24));
+    }
+
+    state->v[0] = v1;
+    state->v[1] = v2;
+    state->v[2] = v3;
+    state->v[3] = v4;
+
+    return pos;
+}
+
+static void json_xxh64_update(json_xxh64_t *state, const char *p, size_t len)
+{
+    size_t used;
+
+    state->total += len;
+
+    /* Complete a partial stripe from an earlier update */
+    if (state->buffered) {
+        used = 32 - state->buffered;
+        if (used > len)
+            used = len;
+        memcpy(state->buffer + state->buffered, p, used);
+        state->buffered += used;
+        p += used;
+        len -= used;
+        if (state->buffered < 32)
+            return;
+        json_xxh64_stripes(state, state->buffer, 32);
+        state->buffered = 0;
+    }
+
+    used = json_xxh64_stripes(state, p, len);
+    memcpy(state->buffer, p + used, len - used);
+    state->buffered = len - used;
+}
+
+static uint64_t json_xxh64_digest(const json_xxh64_t *state)
+{
+    const char *p = state->buffer;
+    const char *end = p + state->buffered;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = json_rotl64(state->v[0], 1) + json_rotl64(state->v[1], 7) +
+            json_rotl64(state->v[2], 12) + json_rotl64(state->v[3], 18);
+        h = json_xxh64_merge(h, state->v[0]);
+        h = json_xxh64_merge(h, state->v[1]);
+        h = json_xxh64_merge(h, state->v[2]);
+        h = json_xxh64_merge(h, state->v[3]);
+    } else {
+        h = state->seed + XXH_PRIME64_5;
+    }
+
+    h += state->total;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= json_xxh64_round(0, json_read64(p));
+        h = json_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= json_read32(p) * XXH_PRIME64_1;
+        h = json_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (unsigned char)*p * XXH_PRIME64_5;
+        h = json_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* XXH64 hash of len bytes */
+static uint64_t json_hash64(const char *p, size_t len, uint64_t seed)
+{
+    json_xxh64_t state;
+
+    json_xxh64_init(&state, seed);
+    json_xxh64_update(&state, p, len);
+
+    return json_xxh64_digest(&state);
+}
+
+/* ===== ENCODING ===== */
+
+static void json_encode_exception(lua_State *l, json_config_t *cfg, int lindex,
+                                  const char *reason)
+{
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+    luaL_error(l, "Cannot serialise %s: %s",
+                  lua_typename(l, lua_type(l, lindex)), reason);
+}
+
+/* Append a quoted and escaped string. Does not use the Lua state. */
+static void json_append_escaped(strbuf_t *json, const char *str, size_t len)
+{
+    const json_kernels_t *k = json_get_kernels();
+    size_t i, run;
+
+    /* Worst case is len * 6 (all unicode escapes).
+     * This buffer is reused constantly for small strings
+     * If there are any excess pages, they won't be hit anyway.
+     * This gains ~5% speedup. */
+    strbuf_ensure_empty_length(json, len * 6 + 2);
+
+    strbuf_append_char_unsafe(json, '\"');
+    for (i = 0; i < len; i++) {
+        /* Copy characters which don't require escaping */
+        run = k->scan_escape(&str[i], len - i);
+        strbuf_append_mem_unsafe(json, &str[i], run);
+        i += run;
+        if (i == len)
+            break;
+        strbuf_append_string(json, char2escape[(unsigned char)str[i]]);
+    }
+    strbuf_append_char_unsafe(json, '\"');
+}
+
+/* json_append_string args:
+ * - lua_State
+ * - JSON strbuf
+ * - String (Lua stack index)
+ *
+ * Returns nothing. Doesn't remove string from Lua stack */
+static void json_append_string(lua_State *l, json_config_t *cfg,
+                               strbuf_t *json, int lindex)
+{
+    const char *str;
+    size_t len;
+    int start;
+
+    str = lua_tolstring(l, lindex, &len);
+
+    if (cfg->encode_refuse_badutf8 && !utf8_validate(str, len))
+        json_encode_exception(l, cfg, lindex, "invalid UTF-8 string");
+
+    start = strbuf_length(json);
+    json_append_escaped(json, str, len);
+    if (strbuf_length(json) - start != len + 2)
+        cfg->stats.encode_escaped_strings++;
+}
+
+/* Find the size of the array on the top of the Lua stack
+ * -1   object (not a pure array)
+ * >=0  elements in array
+ */
+static int lua_array_length(lua_State *l, json_config_t *cfg)
+{
+    double k;
+    int max;
+    int items;
+
+    max = 0;
+    items = 0;
+
+    lua_pushnil(l);
+    /* table, startkey */
+    while (lua_next(l, -2) != 0) {
+        /* table, key, value */
+        if (lua_type(l, -2) == LUA_TNUMBER &&
+            (k = lua_tonumber(l, -2))) {
+            /* Integer >= 1 ? */
+            if (floor(k) == k && k >= 1) {
+                if (k > max)
+                    max = k;
+                items++;
+                lua_pop(l, 1);
+                continue;
+            }
+        }
+
+        /* Must not be an array (non integer key) */
+        lua_pop(l, 2);
+        return -1;
+    }
+
+    /* Encode excessively sparse arrays as objects (if enabled) */
+    if (cfg->encode_sparse_ratio > 0 &&
+        max > items * cfg->encode_sparse_ratio &&
+        max > cfg->encode_sparse_safe) {
+        if (!cfg->encode_sparse_convert)
+            json_encode_exception(l, cfg, -1, "excessively sparse array");
+
+        return -1;
+    }
+
+    return max;
+}
+
+/* Each nested table also requires a few Lua stack slots for the table
+ * key and value being serialised */
+static void json_encode_descend(lua_State *l, json_config_t *cfg)
+{
+    cfg->current_depth++;
+
+    if (cfg->current_depth > cfg->encode_max_depth ||
+        !lua_checkstack(l, 3)) {
+        if (!cfg->encode_keep_buffer)
+            strbuf_free(&cfg->encode_buf);
+        luaL_error(l, "Cannot serialise, excessive nesting (%d)",
+                   cfg->current_depth);
+    }
+}
+
+static void json_append_data(lua_State *l, json_config_t *cfg, strbuf_t *json);
+
+/* json_append_array args:
+ * - lua_State
+ * - JSON strbuf
+ * - Size of passwd Lua array (top of stack) */
+static void json_append_array(lua_State *l, json_config_t *cfg, strbuf_t *json,
+                              int array_length)
+{
+    int comma, i;
+
+    json_encode_descend(l, cfg);
+
+    strbuf_append_char(json, '[');
+
+    comma = 0;
+    for (i = 1; i <= array_length; i++) {
+        if (comma)
+            strbuf_append_char(json, ',');
+        else
+            comma = 1;
+
+        lua_rawgeti(l, -1, i);
+        json_append_data(l, cfg, json);
+        lua_pop(l, 1);
+    }
+
+    strbuf_append_char(json, ']');
+
+    cfg->current_depth--;
+}
+
+/* Append the decimal representation of an integer. Much faster than
+ * snprintf() for the IDs and counters common in JSON documents. */
+static void json_append_integer(strbuf_t *json, int64_t value)
+{
+    char buf[20];
+    uint64_t mag;
+    int i = sizeof(buf);
+
+    /* Negate as unsigned, INT64_MIN has no positive int64_t */
+    mag = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do {
+        buf[--i] = '0' + mag % 10;
+        mag /= 10;
+    } while (mag);
+
+    strbuf_ensure_empty_length(json, sizeof(buf) + 1);
+    if (value < 0)
+        strbuf_append_char_unsafe(json, '-');
+    strbuf_append_mem_unsafe(json, &buf[i], sizeof(buf) - i);
+}
+
+/* Append a double. Errors are reported against the Lua value at index. */
+static void json_append_float(lua_State *l, strbuf_t *json, double num,
+                              int index, json_config_t *cfg)
+{
+    if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
+        json_encode_exception(l, cfg, index, "must not be NaN or Inf");
+
+    /* Integral doubles below 10^precision are printed without an
+     * exponent or fraction by "%.XXg". -0 is left to snprintf(). */
+    if (fabs(num) < cfg->number_integer_limit && num == (int64_t)num &&
+        (num != 0 || !signbit(num))) {
+        json_append_integer(json, (int64_t)num);
+        return;
+    }
+
+    /* Lowest double printed with %.14g is 21 characters long:
+     * -1.7976931348623e+308
+     *
+     * Use 32 to include the \0, and a few extra just in case..
+     */
+    strbuf_append_fmt(json, 32, cfg->number_fmt, num);
+    cfg->stats.encode_numbers++;
+}
+
+static void json_append_number(lua_State *l, strbuf_t *json, int index,
+                               json_config_t *cfg)
+{
+#ifdef JSON_INTEGERS
+    if (lua_isinteger(l, index)) {
+        json_append_integer(json, lua_tointeger(l, index));
+        return;
+    }
+#endif
+
+    json_append_float(l, json, lua_tonumber(l, index), index, cfg);
+}
+
+/* Packed arrays do not contain Lua values, so they are appended without
+ * descending */
+static void json_append_packed(lua_State *l, json_config_t *cfg,
+                               strbuf_t *json, json_packed_t *packed)
+{
+    int i;
+
+    strbuf_append_char(json, '[');
+    for (i = 0; i < packed->length; i++) {
+        if (i)
+            strbuf_append_char(json, ',');
+        json_append_float(l, json, packed->values[i], -1, cfg);
+    }
+    strbuf_append_char(json, ']');
+}
+
+static void json_append_object(lua_State *l, json_config_t *cfg,
+                               strbuf_t *json)
+{
+    int comma, keytype;
+
+    json_encode_descend(l, cfg);
+
+    /* Object */
+    strbuf_append_char(json, '{');
+
+    lua_pushnil(l);
+    /* table, startkey */
+    comma = 0;
+    while (lua_next(l, -2) != 0) {
+        if (comma)
+            strbuf_append_char(json, ',');
+        else
+            comma = 1;
+
+        /* table, key, value */
+        keytype = lua_type(l, -2);
+        if (keytype == LUA_TNUMBER) {
+            strbuf_append_char(json, '"');
+            json_append_number(l, json, -2, cfg);
+            strbuf_append_mem(json, "\":", 2);
+        } else if (keytype == LUA_TSTRING) {
+            json_append_string(l, cfg, json, -2);
+            strbuf_append_char(json, ':');
+        } else {
+            json_encode_exception(l, cfg, -2,
+                                  "table key must be a number or string");
+            /* never returns */
+        }
+
+        /* table, key, value */
+        json_append_data(l, cfg, json);
+        lua_pop(l, 1);
+        /* table, key */
+    }
+
+    strbuf_append_char(json, '}');
+
+    cfg->current_depth--;
+}
+
+/* Object key for canonical encoding */
+typedef struct {
+    const char *str;            /* Key text, before escaping */
+    size_t len;
+    int index;                  /* Position in the fields table */
+    int number;                 /* Number key */
+} json_sorted_key_t;
+
+static int json_compare_keys(const void *a, const void *b)
+{
+    const json_sorted_key_t *x = a;
+    const json_sorted_key_t *y = b;
+    int cmp;
+
+    cmp = memcmp(x->str, y->str, x->len < y->len ? x->len : y->len);
+    if (cmp)
+        return cmp;
+    if (x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+
+    /* A number key and a string key may have the same text */
+    return y->number - x->number;
+}
+
+/* Serialise an object with its keys in byte order. Number keys are
+ * ordered by their JSON text. */
+static void json_append_sorted_object(lua_State *l, json_config_t *cfg,
+                                      strbuf_t *json)
+{
+    json_sorted_key_t *keys;
+    int table, fields, count, start, keytype, i;
+
+    json_encode_descend(l, cfg);
+    table = lua_gettop(l);
+
+    /* Build: fields = { key1, key1_text, key2, key2_text, .. } */
+    lua_newtable(l);
+    fields = table + 1;
+    count = 0;
+    lua_pushnil(l);
+    /* table, fields, startkey */
+    while (lua_next(l, table) != 0) {
+        lua_pop(l, 1);
+        /* table, fields, key */
+        keytype = lua_type(l, -1);
+        if (keytype == LUA_TNUMBER) {
+            start = strbuf_length(json);
+            json_append_number(l, json, -1, cfg);
+            lua_pushlstring(l, json->buf + start,
+                            strbuf_length(json) - start);
+            strbuf_truncate(json, start);
+        } else if (keytype == LUA_TSTRING) {
+            lua_pushvalue(l, -1);
+        } else {
+            json_encode_exception(l, cfg, -1,
+                                  "table key must be a number or string");
+            /* never returns */
+        }
+        lua_rawseti(l, fields, 2 * count + 2);
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, fields, 2 * count + 1);
+        count++;
+    }
+
+    /* Text is referenced by "fields" while the keys are in use */
+    keys = lua_newuserdata(l, (count ? count : 1) * sizeof(*keys));
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(l, fields, 2 * i + 2);
+        keys[i].str = lua_tolstring(l, -1, &keys[i].len);
+        keys[i].index = i;
+        lua_rawgeti(l, fields, 2 * i + 1);
+        keys[i].number = lua_type(l, -1) == LUA_TNUMBER;
+        lua_pop(l, 2);
+    }
+    qsort(keys, count, sizeof(*keys), json_compare_keys);
+
+    strbuf_append_char(json, '{');
+    for (i = 0; i < count; i++) {
+        if (i)
+            strbuf_append_char(json, ',');
+
+        lua_rawgeti(l, fields, 2 * keys[i].index + 1);
+        /* table, fields, keys, key */
+        if (keys[i].number) {
+            strbuf_append_char(json, '"');
+            strbuf_append_mem(json, keys[i].str, keys[i].len);
+            strbuf_append_mem(json, "\":", 2);
+        } else {
+            json_append_string(l, cfg, json, -1);
+            strbuf_append_char(json, ':');
+        }
+
+        lua_rawget(l, table);
+        /* table, fields, keys, value */
+        json_append_data(l, cfg, json);
+        lua_pop(l, 1);
+    }
+    strbuf_append_char(json, '}');
+
+    lua_pop(l, 2);
+    cfg->current_depth--;
+}
+
+/* Add completed output to the digest. Output is never rewritten once
+ * appended, so it can be hashed while it is still in the CPU cache. */
+static void json_encode_digest_update(json_config_t *cfg, strbuf_t *json)
+{
+    json_xxh64_update(&cfg->encode_digest,
+                      json->buf + cfg->encode_digest_pos,
+                      json->length - cfg->encode_digest_pos);
+    cfg->encode_digest_pos = json->length;
+}
+
+/* Lua values which can be serialised, see json_classify() */
+typedef enum {
+    JSON_CLASS_NULL,            /* nil or cjson.null */
+    JSON_CLASS_BOOLEAN,
+    JSON_CLASS_NUMBER,
+    JSON_CLASS_STRING,
+    JSON_CLASS_ARRAY,
+    JSON_CLASS_OBJECT,
+    JSON_CLASS_PACKED           /* Packed array userdata */
+} json_class_t;
+
+/* Classify the Lua value on the top of the stack. Every encoder
+ * dispatches on this, so they all accept the same values.
+ *
+ * Array lengths are stored in *len, and packed arrays in *packed.
+ * Raises an error for values which cannot be serialised. */
+static json_class_t json_classify(lua_State *l, json_config_t *cfg,
+                                  int *len, json_packed_t **packed)
+{
+    switch (lua_type(l, -1)) {
+    case LUA_TSTRING:
+        return JSON_CLASS_STRING;
+    case LUA_TNUMBER:
+        return JSON_CLASS_NUMBER;
+    case LUA_TBOOLEAN:
+        return JSON_CLASS_BOOLEAN;
+    case LUA_TTABLE:
+        *len = lua_array_length(l, cfg);
+        return *len > 0 ? JSON_CLASS_ARRAY : JSON_CLASS_OBJECT;
+    case LUA_TNIL:
+        return JSON_CLASS_NULL;
+    case LUA_TUSERDATA:
+        *packed = json_to_packed(l, -1);
+        if (*packed)
+            return JSON_CLASS_PACKED;
+        break;
+    case LUA_TLIGHTUSERDATA:
+        if (lua_touserdata(l, -1) == NULL)
+            return JSON_CLASS_NULL;
+        break;
+    }
+
+    /* Remaining types (LUA_TFUNCTION, LUA_TUSERDATA, LUA_TTHREAD,
+     * and LUA_TLIGHTUSERDATA) cannot be serialised */
+    json_encode_exception(l, cfg, -1, "type not supported");
+    return JSON_CLASS_NULL;     /* never returns */
+}
+
+/* Serialise Lua data into JSON string. */
+static void json_append_data(lua_State *l, json_config_t *cfg, strbuf_t *json)
+{
+    json_packed_t *packed;
+    int len;
+
+    switch (json_classify(l, cfg, &len, &packed)) {
+    case JSON_CLASS_STRING:
+        json_append_string(l, cfg, json, -1);
+        break;
+    case JSON_CLASS_NUMBER:
+        json_append_number(l, json, -1, cfg);
+        break;
+    case JSON_CLASS_BOOLEAN:
+        if (lua_toboolean(l, -1))
+            strbuf_append_mem(json, "true", 4);
+        else
+            strbuf_append_mem(json, "false", 5);
+        break;
+    case JSON_CLASS_ARRAY:
+        json_append_array(l, cfg, json, len);
+        break;
+    case JSON_CLASS_OBJECT:
+        if (cfg->encode_canonical)
+            json_append_sorted_object(l, cfg, json);
+        else
+            json_append_object(l, cfg, json);
+        break;
+    case JSON_CLASS_PACKED:
+        json_append_packed(l, cfg, json, packed);
+        break;
+    case JSON_CLASS_NULL:
+        strbuf_append_mem(json, "null", 4);
+        break;
+    }
+
+    if (cfg->encode_canonical &&
+        json->length - cfg->encode_digest_pos >= JSON_DIGEST_BLOCK)
+        json_encode_digest_update(cfg, json);
+}
+
+/* Prepare the configuration for a new encode */
+static void json_encode_init(json_config_t *cfg)
+{
+    cfg->current_depth = 0;
+
+    /* Reset the persistent buffer if it exists.
+     * Otherwise allocate a new buffer. */
+    if (strbuf_allocated(&cfg->encode_buf))
+        strbuf_reset(&cfg->encode_buf);
+    else
+        strbuf_init(&cfg->encode_buf, 0);
+
+    /* A chunked or canonical encode may have been interrupted by an
+     * error */
+    strbuf_set_chunk_size(&cfg->encode_buf, 0);
+    cfg->encode_canonical = 0;
+
+    cfg->encode_buf_reallocs = cfg->encode_buf.reallocs;
+}
+
+/* Add the document in the encoding buffer to the statistics */
+static void json_encode_stats(json_config_t *cfg)
+{
+    strbuf_t *json = &cfg->encode_buf;
+
+    cfg->stats.encode_documents++;
+    cfg->stats.encode_bytes += strbuf_length(json);
+    cfg->stats.encode_buffer_reallocs += json->reallocs -
+                                         cfg->encode_buf_reallocs;
+    if (cfg->stats.encode_buffer_peak < (uint64_t)json->size)
+        cfg->stats.encode_buffer_peak = json->size;
+}
+
+static int json_encode(lua_State *l)
+{
+    json_config_t *cfg;
+    char *json;
+    int len;
+
+    /* Can't use json_verify_arg_count() since we need to ensure
+     * there is only 1 argument */
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = json_fetch_config(l);
+    json_encode_init(cfg);
+
+    json_append_data(l, cfg, &cfg->encode_buf);
+    json = strbuf_string(&cfg->encode_buf, &len);
+
+    lua_pushlstring(l, json, len);
+    json_encode_stats(cfg);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+
+    return 1;
+}
+
+/* Serialise a value with object keys in sorted order, so equal values
+ * always produce the same text. Returns the JSON text and its XXH64
+ * digest as 16 hexadecimal digits. */
+static int json_encode_canonical(lua_State *l)
+{
+    json_config_t *cfg;
+    char hex[17];
+    char *json;
+    int len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = json_fetch_config(l);
+    json_encode_init(cfg);
+
+    cfg->encode_canonical = 1;
+    json_xxh64_init(&cfg->encode_digest, 0);
+    cfg->encode_digest_pos = 0;
+
+    json_append_data(l, cfg, &cfg->encode_buf);
+    json_encode_digest_update(cfg, &cfg->encode_buf);
+    cfg->encode_canonical = 0;
+
+    json = strbuf_string(&cfg->encode_buf, &len);
+    lua_pushlstring(l, json, len);
+    snprintf(hex, sizeof(hex), "%016llx",
+             (unsigned long long)json_xxh64_digest(&cfg->encode_digest));
+    lua_pushlstring(l, hex, 16);
+    json_encode_stats(cfg);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+
+    return 2;
+}
+
+/* Encode the value at index 1 into a chunked buffer, so the output is
+ * never copied into a single contiguous string */
+static strbuf_t *json_encode_chunked(lua_State *l, json_config_t *cfg,
+                                     int chunk_size)
+{
+    strbuf_t *json = &cfg->encode_buf;
+
+    luaL_argcheck(l, chunk_size > 0, 2, "expected positive integer");
+
+    json_encode_init(cfg);
+    strbuf_set_chunk_size(json, chunk_size);
+
+    lua_pushvalue(l, 1);
+    json_append_data(l, cfg, json);
+    lua_pop(l, 1);
+    strbuf_flush_chunk(json);
+    json_encode_stats(cfg);
+
+    return json;
+}
+
+/* Release the chunks and return the buffer to contiguous mode */
+static void json_encode_chunked_finish(json_config_t *cfg)
+{
+    strbuf_reset(&cfg->encode_buf);
+    strbuf_set_chunk_size(&cfg->encode_buf, 0);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+}
+
+/* Returns an array of strings which concatenate to the JSON text.
+ * Each string holds up to chunk_size bytes, unless a single value
+ * requires more. */
+static int json_encode_chunks(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    strbuf_t *json;
+    int i;
+
+    json_verify_arg_count(l, 2);
+    luaL_checkany(l, 1);
+    json = json_encode_chunked(l, cfg, luaL_optinteger(l, 2,
+                                            DEFAULT_ENCODE_CHUNK_SIZE));
+
+    lua_createtable(l, json->chunk_count, 0);
+    for (i = 0; i < json->chunk_count; i++) {
+        lua_pushlstring(l, json->chunks[i].buf, json->chunks[i].length);
+        lua_rawseti(l, -2, i + 1);
+    }
+
+    json_encode_chunked_finish(cfg);
+
+    return 1;
+}
+
+static FILE *json_check_file(lua_State *l, int lindex)
+{
+    FILE *file;
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+    luaL_Stream *stream = luaL_checkudata(l, lindex, LUA_FILEHANDLE);
+
+    /* Closed streams have no close function */
+    file = stream->closef ? stream->f : NULL;
+#else
+    file = *(FILE **)luaL_checkudata(l, lindex, LUA_FILEHANDLE);
+#endif
+    if (!file)
+        luaL_argerror(l, lindex, "attempt to use a closed file");
+
+    return file;
+}
+
+/* Write every chunk to the file. Returns 0 on success, or -1 with errno
+ * set */
+static int json_write_chunks(FILE *file, strbuf_t *json)
+{
+#ifndef _WIN32
+    struct iovec iov[64];
+    int fd, i, count, next = 0;
+    ssize_t written;
+
+    /* Data buffered by earlier io.write() calls must come first */
+    if (fflush(file))
+        return -1;
+    fd = fileno(file);
+
+    while (next < json->chunk_count) {
+        count = json->chunk_count - next;
+        if (count > 64)
+            count = 64;
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = json->chunks[next + i].buf;
+            iov[i].iov_len = json->chunks[next + i].length;
+        }
+
+        written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        /* Skip the completed chunks, and trim a partially written one
+         * so the remainder is sent by the next writev() */
+        while (next < json->chunk_count &&
+               written >= json->chunks[next].length) {
+            written -= json->chunks[next].length;
+            next++;
+        }
+        if (written) {
+            memmove(json->chunks[next].buf,
+                    json->chunks[next].buf + written,
+                    json->chunks[next].length - written);
+            json->chunks[next].length -= written;
+        }
+    }
+
+    return 0;
+#else
+    int i;
+
+    for (i = 0; i < json->chunk_count; i++) {
+        if (fwrite(json->chunks[i].buf, 1, json->chunks[i].length, file) !=
+            (size_t)json->chunks[i].length)
+            return -1;
+    }
+
+    return 0;
+#endif
+}
+
+/* Serialise a value directly into a Lua file handle with writev().
+ * Returns the number of bytes written. */
+static int json_encode_file(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    strbuf_t *json;
+    FILE *file;
+    int len, err;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    file = json_check_file(l, 2);
+    json = json_encode_chunked(l, cfg, DEFAULT_ENCODE_CHUNK_SIZE);
+    len = strbuf_length(json);
+
+    err = json_write_chunks(file, json) ? errno : 0;
+    json_encode_chunked_finish(cfg);
+    if (err)
+        luaL_error(l, "Unable to write JSON: %s", strerror(err));
+
+    lua_pushinteger(l, len);
+    return 1;
+}
+
+/* Serialise a table of columns into a JSON array of objects. Eg:
+ *   { a = { 1, 2 }, b = { "x", "y" } }
+ * becomes:
+ *   [{"a":1,"b":"x"},{"a":2,"b":"y"}]
+ *
+ * Keys are escaped once per column rather than once per row. Missing
+ * (nil) column entries are omitted from the object for that row. */
+static int json_encode_columns(lua_State *l)
+{
+    typedef struct {
+        const char *str;
+        size_t len;
+    } json_column_key_t;
+
+    json_config_t *cfg;
+    strbuf_t *json;
+    json_column_key_t *keys;
+    char *text;
+    int rows, count_rows, ncols, keytype, len, comma, base, i, j;
+
+    json_verify_arg_count(l, 2);
+    luaL_checktype(l, 1, LUA_TTABLE);
+    count_rows = lua_isnoneornil(l, 2);
+    rows = luaL_optinteger(l, 2, 0);
+    luaL_argcheck(l, rows >= 0, 2, "expected integer >= 0");
+    lua_settop(l, 1);
+
+    cfg = json_fetch_config(l);
+    json_encode_init(cfg);
+    json = &cfg->encode_buf;
+
+    /* Build: fields = { key1_json, column1, key2_json, column2, .. }
+     * Each key is pre-encoded as: "key": */
+    lua_newtable(l);
+    ncols = 0;
+    lua_pushnil(l);
+    /* cols, fields, startkey */
+    while (lua_next(l, 1) != 0) {
+        /* cols, fields, key, column */
+        if (lua_type(l, -1) != LUA_TTABLE)
+            json_encode_exception(l, cfg, -1, "column must be a table");
+
+        /* Without an explicit row count, use the longest column */
+        len = lua_objlen(l, -1);
+        if (count_rows && len > rows)
+            rows = len;
+
+        strbuf_reset(json);
+        keytype = lua_type(l, -2);
+        if (keytype == LUA_TNUMBER) {
+            strbuf_append_char(json, '"');
+            json_append_number(l, json, -2, cfg);
+            strbuf_append_mem(json, "\":", 2);
+        } else if (keytype == LUA_TSTRING) {
+            json_append_string(l, cfg, json, -2);
+            strbuf_append_char(json, ':');
+        } else {
+            json_encode_exception(l, cfg, -2,
+                                  "table key must be a number or string");
+            /* never returns */
+        }
+        text = strbuf_string(json, &len);
+        lua_pushlstring(l, text, len);
+        lua_rawseti(l, 2, 2 * ncols + 1);
+        lua_rawseti(l, 2, 2 * ncols + 2);   /* Pops column */
+        ncols++;
+        /* cols, fields, key */
+    }
+    strbuf_reset(json);
+
+    /* Place each column on the stack, and keep pointers to the encoded
+     * keys (referenced by "fields") in a userdata array */
+    keys = lua_newuserdata(l, (ncols ? ncols : 1) * sizeof(*keys));
+    if (!lua_checkstack(l, ncols + 3)) {
+        if (!cfg->encode_keep_buffer)
+            strbuf_free(&cfg->encode_buf);
+        luaL_error(l, "Cannot serialise, too many columns (%d)", ncols);
+    }
+    base = lua_gettop(l);
+    for (j = 0; j < ncols; j++) {
+        lua_rawgeti(l, 2, 2 * j + 1);
+        keys[j].str = lua_tolstring(l, -1, &keys[j].len);
+        lua_pop(l, 1);
+        lua_rawgeti(l, 2, 2 * j + 2);
+    }
+    /* cols, fields, keys, column1, .., columnN */
+
+    /* Rows are an array of objects */
+    json_encode_descend(l, cfg);
+    json_encode_descend(l, cfg);
+
+    strbuf_append_char(json, '[');
+    for (i = 1; i <= rows; i++) {
+        if (i > 1)
+            strbuf_append_char(json, ',');
+        strbuf_append_char(json, '{');
+
+        comma = 0;
+        for (j = 0; j < ncols; j++) {
+            lua_rawgeti(l, base + 1 + j, i);
+            if (lua_isnil(l, -1)) {
+                lua_pop(l, 1);
+                continue;
+            }
+
+            if (comma)
+                strbuf_append_char(json, ',');
+            else
+                comma = 1;
+
+            strbuf_append_mem(json, keys[j].str, keys[j].len);
+            json_append_data(l, cfg, json);
+            lua_pop(l, 1);
+        }
+
+        strbuf_append_char(json, '}');
+    }
+    strbuf_append_char(json, ']');
+
+    cfg->current_depth -= 2;
+
+    text = strbuf_string(json, &len);
+    lua_pushlstring(l, text, len);
+    json_encode_stats(cfg);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+
+    return 1;
+}
+
+/* ===== DECODING ===== */
+
+static int hexdigit2int(char hex)
+{
+    if ('0' <= hex  && hex <= '9')
+        return hex - '0';
+
+    /* Force lowercase */
+    hex |= 0x20;
+    if ('a' <= hex && hex <= 'f')
+        return 10 + hex - 'a';
+
+    return -1;
+}
+
+static int decode_hex4(const char *hex)
+{
+    int digit[4];
+    int i;
+
+    /* Convert ASCII hex digit to numeric digit
+     * Note: this returns an error for invalid hex digits, including
+     *       NULL */
+    for (i = 0; i < 4; i++) {
+        digit[i] = hexdigit2int(hex[i]);
+        if (digit[i] < 0) {
+            return -1;
+        }
+    }
+
+    return (digit[0] << 12) +
+           (digit[1] << 8) +
+           (digit[2] << 4) +
+            digit[3];
+}
+
+/* Converts a Unicode codepoint to UTF-8.
+ * Returns UTF-8 string length, and up to 4 bytes in *utf8 */
+static int codepoint_to_utf8(char *utf8, int codepoint)
+{
+    /* 0xxxxxxx */
+    if (codepoint <= 0x7F) {
+        utf8[0] = codepoint;
+        return 1;
+    }
+
+    /* 110xxxxx 10xxxxxx */
+    if (codepoint <= 0x7FF) {
+        utf8[0] = (codepoint >> 6) | 0xC0;
+        utf8[1] = (codepoint & 0x3F) | 0x80;
+        return 2;
+    }
+
+    /* 1110xxxx 10xxxxxx 10xxxxxx */
+    if (codepoint <= 0xFFFF) {
+        utf8[0] = (codepoint >> 12) | 0xE0;
+        utf8[1] = ((codepoint >> 6) & 0x3F) | 0x80;
+        utf8[2] = (codepoint & 0x3F) | 0x80;
+        return 3;
+    }
+
+    /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
+    if (codepoint <= 0x1FFFFF) {
+        utf8[0] = (codepoint >> 18) | 0xF0;
+        utf8[1] = ((codepoint >> 12) & 0x3F) | 0x80;
+        utf8[2] = ((codepoint >> 6) & 0x3F) | 0x80;
+        utf8[3] = (codepoint & 0x3F) | 0x80;
+        return 4;
+    }
+
+    return 0;
+}
+
+
+/* Called when index pointing to beginning of UTF-16 code escape: \uXXXX
+ * \u is guaranteed to exist, but the remaining hex characters may be
+ * missing.
+ * Translate to UTF-8 and append to temporary token string.
+ * Must advance index to the next character to be processed.
+ * Returns: 0   success
+ *          -1  error
+ */
+static int json_append_unicode_escape(json_parse_t *json)
+{
+    char utf8[4];       /* Surrogate pairs require 4 UTF-8 bytes */
+    int codepoint;
+    int surrogate_low;
+    int len;
+    int escape_len = 6;
+
+    /* Fetch UTF-16 code unit */
+    codepoint = decode_hex4(&json->data[json->index + 2]);
+    if (codepoint < 0)
+        return -1;
+
+    /* UTF-16 surrogate pairs take the following 2 byte form:
+     *      11011 x yyyyyyyyyy
+     * When x = 0: y is the high 10 bits of the codepoint
+     *      x = 1: y is the low 10 bits of the codepoint
+     *
+     * Check for a surrogate pair (high or low) */
+    if ((codepoint & 0xF800) == 0xD800) {
+        /* Error if the 1st surrogate is not high */
+        if (codepoint & 0x400)
+            return -1;
+
+        /* Ensure the next code is a unicode escape */
+        if (json->data[json->index + escape_len] != '\\' ||
+            json->data[json->index + escape_len + 1] != 'u') {
+            return -1;
+        }
+
+        /* Fetch the next codepoint */
+        surrogate_low = decode_hex4(&json->data[json->index + 2 + escape_len]);
+        if (surrogate_low < 0)
+            return -1;
+
+        /* Error if the 2nd code is not a low surrogate */
+        if ((surrogate_low & 0xFC00) != 0xDC00)
+            return -1;
+
+        /* Calculate Unicode codepoint */
+        codepoint = (codepoint & 0x3FF) << 10;
+        surrogate_low &= 0x3FF;
+        codepoint = (codepoint | surrogate_low) + 0x10000;
+        escape_len = 12;
+    }
+
+    /* Convert codepoint to UTF-8 */
+    len = codepoint_to_utf8(utf8, codepoint);
+    if (!len)
+        return -1;
+
+    /* Append bytes and advance parse index */
+    strbuf_append_mem_unsafe(json->tmp, utf8, len);
+    json->index += escape_len;
+
+    return 0;
+}
+
+static void json_set_token_error(json_token_t *token, json_parse_t *json,
+                                 const char *errtype)
+{
+    token->type = T_ERROR;
+    token->index = json->index;
+    token->value.string = errtype;
+}
+
+static void json_next_string_token(json_parse_t *json, json_token_t *token)
+{
+    char *escape2char = json->cfg->escape2char;
+    int refuse_badutf8 = json->cfg->decode_refuse_badutf8;
+    int seqlen, run;
+    char ch;
+
+    /* Caller must ensure a string is next */
+    assert(json->data[json->index] == '"');
+
+    /* Skip " */
+    json->index++;
+
+    /* json->tmp is the temporary strbuf used to accumulate the
+     * decoded string value. */
+    strbuf_reset(json->tmp);
+    while (1) {
+        /* Copy characters which don't require processing */
+        run = json_get_kernels()->scan_string(&json->data[json->index],
+                                       json->len - json->index,
+                                       refuse_badutf8);
+        strbuf_append_mem_unsafe(json->tmp, &json->data[json->index], run);
+        json->index += run;
+
+        ch = json->data[json->index];
+        if (ch == '"')
+            break;
+
+        if (!ch) {
+            /* Premature end of the string */
+            json_set_token_error(token, json, "unexpected end of string");
+            return;
+        }
+
+        /* Handle escapes */
+        if (ch == '\\') {
+            json->escapes++;
+
+            /* Fetch escape character */
+            ch = json->data[json->index + 1];
+
+            /* Translate escape code and append to tmp string */
+            ch = escape2char[(unsigned char)ch];
+            if (ch == 'u') {
+                if (json_append_unicode_escape(json) == 0)
+                    continue;
+
+                json_set_token_error(token, json,
+                                     "invalid unicode escape code");
+                return;
+            }
+            if (!ch) {
+                json_set_token_error(token, json, "invalid escape code");
+                return;
+            }
+
+            /* Skip '\' */
+            json->index++;
+        } else if (ch & 0x80 && refuse_badutf8) {
+            /* Copy a complete multibyte sequence once validated */
+            seqlen = utf8_sequence_length(
+                (const unsigned char *)&json->data[json->index]);
+            if (!seqlen) {
+                json_set_token_error(token, json, "invalid UTF-8 string");
+                return;
+            }
+            strbuf_append_mem_unsafe(json->tmp, &json->data[json->index],
+                                     seqlen);
+            json->index += seqlen;
+            continue;
+        }
+        /* Append normal character or translated single character
+         * Unicode escapes are handled above */
+        strbuf_append_char_unsafe(json->tmp, ch);
+        json->index++;
+    }
+    json->index++;  /* Eat final quote (") */
+
+    strbuf_ensure_null(json->tmp);
+
+    token->type = T_STRING;
+    token->value.string = strbuf_string(json->tmp, &token->string_len);
+}
+
+/* JSON numbers should take the following form:
+ *      -?(0|[1-9]|[1-9][0-9]+)(.[0-9]+)?([eE][-+]?[0-9]+)?
+ *
+ * json_next_number_token() uses strtod() which allows other forms:
+ * - numbers starting with '+'
+ * - NaN, -NaN, infinity, -infinity
+ * - hexidecimal numbers
+ * - numbers with leading zeros
+ *
+ * json_is_invalid_number() detects "numbers" which may pass strtod()'s
+ * error checking, but should not be allowed with strict JSON.
+ *
+ * json_is_invalid_number() may pass numbers which cause strtod()
+ * to generate an error.
+ */
+static int json_is_invalid_number(json_parse_t *json)
+{
+    int i = json->index;
+
+    /* Reject numbers starting with + */
+    if (json->data[i] == '+')
+        return 1;
+
+    /* Skip minus sign if it exists */
+    if (json->data[i] == '-')
+        i++;
+
+    /* Reject numbers starting with 0x, or leading zeros */
+    if (json->data[i] == '0') {
+        int ch2 = json->data[i + 1];
+
+        if ((ch2 | 0x20) == 'x' ||          /* Hex */
+            ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
+            return 1;
+
+        return 0;
+    } else if (json->data[i] <= '9') {
+        return 0;                           /* Ordinary number */
+    }
+
+
+    /* Reject inf/nan */
+    if (!strncasecmp(&json->data[i], "inf", 3))
+        return 1;
+    if (!strncasecmp(&json->data[i], "nan", 3))
+        return 1;
+
+    /* Pass all other numbers which may still be invalid, but
+     * strtod() will catch them. */
+    return 0;
+}
+
+static void json_next_number_token(json_parse_t *json, json_token_t *token)
+{
+    const char *startptr;
+    char *endptr;
+    uint64_t value;
+    int neg, digits;
+    char ch;
+
+    token->type = T_NUMBER;
+    token->integer = 0;
+    startptr = &json->data[json->index];
+
+    /* Integer literals are converted without strtod(). The kernels
+     * convert up to 16 digits, and 19 digits always fit in a uint64_t. */
+    neg = *startptr == '-';
+    digits = json_get_kernels()->parse_digits(&startptr[neg],
+                                       json->len - json->index - neg, &value);
+    for (; 16 <= digits && digits < 19; digits++) {
+        ch = startptr[neg + digits];
+        if (ch < '0' || '9' < ch)
+            break;
+        value = value * 10 + (ch - '0');
+    }
+    ch = startptr[neg + digits];
+    if (0 < digits && (ch < '0' || '9' < ch) && ch != '.' &&
+        ch != 'e' && ch != 'E' && ch != 'x' && ch != 'X') {
+        /* -0 is kept as a double to preserve the sign */
+        if (!neg && value <= (uint64_t)JSON_INTEGER_MAX) {
+            token->value.integer = value;
+            token->integer = 1;
+            json->index += digits;
+            return;
+        }
+        if (neg && value && value - 1 <= (uint64_t)JSON_INTEGER_MAX) {
+            token->value.integer = -(int64_t)(value - 1) - 1;
+            token->integer = 1;
+            json->index += 1 + digits;
+            return;
+        }
+        /* Exactly representable as a double */
+        if (digits <= 15) {
+            token->value.number = neg ? -(double)value : (double)value;
+            json->index += neg + digits;
+            return;
+        }
+    }
+
+    token->value.number = strtod(&json->data[json->index], &endptr);
+    json->numbers++;
+    if (startptr == endptr)
+        json_set_token_error(token, json, "invalid number");
+    else
+        json->index += endptr - startptr;   /* Skip the processed number */
+
+    return;
+}
+
+/* Fills in the token struct.
+ * T_STRING will return a pointer to the json_parse_t temporary string
+ * T_ERROR will leave the json->index pointer at the error.
+ */
+static void json_next_token(json_parse_t *json, json_token_t *token)
+{
+    json_token_type_t *ch2token = json->cfg->ch2token;
+    int ch;
+
+    /* Eat whitespace. Longer runs (Eg, indentation) are skipped by the
+     * whitespace kernel */
+    token->type = ch2token[(unsigned char)json->data[json->index]];
+    if (token->type == T_WHITESPACE) {
+        json->index++;
+        json->index += json_get_kernels()->skip_whitespace(
+            &json->data[json->index], json->len - json->index);
+        token->type = ch2token[(unsigned char)json->data[json->index]];
+    }
+
+    token->index = json->index;
+
+    /* Don't advance the pointer for an error or the end */
+    if (token->type == T_ERROR) {
+        json_set_token_error(token, json, "invalid token");
+        return;
+    }
+
+    if (token->type == T_END) {
+        return;
+    }
+
+    /* Found a known single character token, advance index and return */
+    if (token->type != T_UNKNOWN) {
+        json->index++;
+        return;
+    }
+
+    /* Process characters which triggered T_UNKNOWN */
+    ch = json->data[json->index];
+
+    /* Must use strncmp() to match the front of the JSON string.
+     * JSON identifier must be lowercase.
+     * When strict_numbers if disabled, either case is allowed for
+     * Infinity/NaN (since we are no longer following the spec..) */
+    if (ch == '"') {
+        json_next_string_token(json, token);
+        return;
+    } else if (ch == '-' || ('0' <= ch && ch <= '9')) {
+        if (json->cfg->decode_refuse_badnum && json_is_invalid_number(json)) {
+            json_set_token_error(token, json, "invalid number");
+            return;
+        }
+        json_next_number_token(json, token);
+        return;
+    } else if (!strncmp(&json->data[json->index], "true", 4)) {
+        token->type = T_BOOLEAN;
+        token->value.boolean = 1;
+        json->index += 4;
+        return;
+    } else if (!strncmp(&json->data[json->index], "false", 5)) {
+        token->type = T_BOOLEAN;
+        token->value.boolean = 0;
+        json->index += 5;
+        return;
+    } else if (!strncmp(&json->data[json->index], "null", 4)) {
+        token->type = T_NULL;
+        json->index += 4;
+        return;
+    } else if (!json->cfg->decode_refuse_badnum &&
+               json_is_invalid_number(json)) {
+        /* When refuse_badnum is disabled, only attempt to process
+         * numbers we know are invalid JSON (Inf, NaN, hex)
+         * This is required to generate an appropriate token error,
+         * otherwise all bad tokens will register as "invalid number"
+         */
+        json_next_number_token(json, token);
+        return;
+    }
+
+    /* Token starts with t/f/n but isn't recognised above. */
+    json_set_token_error(token, json, "invalid token");
+}
+
+/* Take the container stack of the configuration, so it cannot be used
+ * by another decode until it is returned. A nested decode (Eg, from a
+ * __gc metamethod) gets a new stack instead. Returns NULL when out of
+ * memory.
+ *
+ * A Lua error raised while the stack is taken, other than by the
+ * decoder's error functions (Eg, out of memory), loses the stack. The
+ * next decode allocates a new one. */
+static json_container_t *json_take_stack(json_config_t *cfg)
+{
+    json_container_t *stack = cfg->decode_stack;
+
+    if (stack) {
+        cfg->decode_stack = NULL;
+        return stack;
+    }
+
+    return malloc(cfg->decode_max_depth * sizeof(*stack));
+}
+
+/* "size" is cfg->decode_max_depth when the stack was taken. Stacks
+ * which are not needed, or too small, are freed. */
+static void json_return_stack(json_config_t *cfg, json_container_t *stack,
+                              int size)
+{
+    if (!cfg->decode_stack && size == cfg->decode_max_depth)
+        cfg->decode_stack = stack;
+    else
+        free(stack);
+}
+
+/* Return the container stack to the configuration */
+static void json_parse_return_stack(json_parse_t *json)
+{
+    if (json->stack_size) {
+        json_return_stack(json->cfg, json->stack, json->stack_size);
+        json->stack_size = 0;
+    }
+}
+
+/* Release the temporary buffer and the container stack */
+static void json_parse_free(json_parse_t *json)
+{
+    strbuf_free(json->tmp);
+    json_parse_return_stack(json);
+}
+
+/* This function does not return.
+ * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
+ * The only supported exceptions are the temporary parser string
+ * json->tmp struct and the container stack.
+ * json and token should exist on the stack somewhere.
+ * luaL_error() will long_jmp and release the stack */
+static void json_throw_parse_error(lua_State *l, json_parse_t *json,
+                                   const char *exp, json_token_t *token)
+{
+    const char *found;
+
+    json_parse_free(json);
+
+    if (token->type == T_ERROR)
+        found = token->value.string;
+    else
+        found = json_token_type_name[token->type];
+
+    /* Note: token->index is 0 based, display starting from 1 */
+    luaL_error(l, "Expected %s but found %s at character %d",
+               exp, found, token->index + 1);
+}
+
+static const char json_nested_error[] = "nested data structures";
+
+/* Read the next step of the document: a value, an object key, or the
+ * start or end of an array or object. Every decoder is driven by this
+ * state machine, and only differs in what it builds from the events.
+ *
+ * Open containers are tracked on json->stack, and container->index is
+ * left for the caller. json->state must be JSON_PARSE_VALUE (or
+ * JSON_PARSE_HELD with the first token in *token) at the start of a
+ * value, and the caller stops once the value is complete.
+ *
+ * On JSON_EVENT_ERROR, *token holds the unexpected token and json->error
+ * the expected token (see json_throw_parse_error()), or
+ * json_nested_error when json->max_depth is exceeded. */
+static inline json_event_t json_next_event(json_parse_t *json,
+                                           json_token_t *token)
+{
+    json_container_t *container;
+
+    switch (json->state) {
+    case JSON_PARSE_VALUE:
+        json_next_token(json, token);
+        break;
+    case JSON_PARSE_HELD:
+        break;
+    case JSON_PARSE_COLON:
+        json_next_token(json, token);
+        if (token->type != T_COLON) {
+            json->error = "colon";
+            return JSON_EVENT_ERROR;
+        }
+        json_next_token(json, token);
+        break;
+    default:
+        /* JSON_PARSE_FIRST or JSON_PARSE_NEXT within a container.
+         * T_OBJ_END and T_ARR_END follow their T_*_BEGIN tokens. */
+        container = &json->stack[json->depth - 1];
+        json_next_token(json, token);
+        if (token->type == container->type + 1) {
+            json->depth--;
+            json->state = JSON_PARSE_NEXT;
+            return JSON_EVENT_CLOSE;
+        }
+        if (json->state == JSON_PARSE_NEXT) {
+            if (token->type != T_COMMA) {
+                json->error = container->type == T_OBJ_BEGIN ?
+                              "comma or object end" : "comma or array end";
+                return JSON_EVENT_ERROR;
+            }
+            json_next_token(json, token);
+        }
+        if (container->type == T_OBJ_BEGIN) {
+            if (token->type != T_STRING) {
+                json->error = "object key string";
+                return JSON_EVENT_ERROR;
+            }
+            json->state = JSON_PARSE_COLON;
+            return JSON_EVENT_KEY;
+        }
+        break;
+    }
+
+    switch (token->type) {
+    case T_STRING:
+    case T_NUMBER:
+    case T_BOOLEAN:
+    case T_NULL:
+        json->state = JSON_PARSE_NEXT;
+        return JSON_EVENT_VALUE;
+    case T_OBJ_BEGIN:
+    case T_ARR_BEGIN:
+        if (json->depth >= json->max_depth) {
+            json->error = json_nested_error;
+            return JSON_EVENT_ERROR;
+        }
+        container = &json->stack[json->depth++];
+        container->type = token->type;
+        container->index = 0;
+        json->state = JSON_PARSE_FIRST;
+        return JSON_EVENT_OPEN;
+    default:
+        json->error = "value";
+        return JSON_EVENT_ERROR;
+    }
+}
+
+/* Raise the error for JSON_EVENT_ERROR */
+static void json_throw_event_error(lua_State *l, json_parse_t *json,
+                                   json_token_t *token)
+{
+    if (json->error == json_nested_error) {
+        json_parse_free(json);
+        luaL_error(l, "Too many nested data structures");
+    }
+
+    json_throw_parse_error(l, json, json->error, token);
+}
+
+static void json_decode_checkstack(lua_State *l, json_parse_t *json, int n)
+{
+    if (lua_checkstack(l, n))
+        return;
+
+    json_parse_free(json);
+    luaL_error(l, "Too many nested data structures");
+}
+
+/* Create the table for a container opened with json->next_node. Tables
+ * matching their template node are created with the expected size. */
+static void json_template_table(lua_State *l, json_parse_t *json,
+                                json_container_t *container)
+{
+    json_template_node_t *node;
+
+    container->node = json->next_node;
+    container->field = -1;
+    json->next_node = -1;
+
+    if (container->node >= 0) {
+        node = &json->tmpl->nodes[container->node];
+        if (node->type == container->type) {
+            if (node->type == T_ARR_BEGIN) {
+                lua_createtable(l, node->size, 0);
+                container->field = node->element;
+                json->next_node = node->element;
+            } else {
+                lua_createtable(l, 0, node->size);
+                container->field = 0;
+            }
+            return;
+        }
+        container->node = -1;
+    }
+
+    lua_newtable(l);
+}
+
+/* Push the key in *token from the template's key table when it is a
+ * known field of the current object. Fields are compared starting with
+ * the one after the last match, since keys usually arrive in the same
+ * order. Returns 0 for unknown keys. */
+static int json_template_key(lua_State *l, json_parse_t *json,
+                             json_token_t *token)
+{
+    json_container_t *container = &json->stack[json->depth - 1];
+    json_template_node_t *node;
+    json_template_field_t *field;
+    int i, n;
+
+    json->next_node = -1;
+    if (container->node < 0)
+        return 0;
+
+    node = &json->tmpl->nodes[container->node];
+    for (n = 0, i = container->field; n < node->size; n++, i++) {
+        if (i == node->size)
+            i = 0;
+        field = &json->tmpl->fields[node->fields + i];
+        if (field->key_len == (size_t)token->string_len &&
+            !memcmp(field->key, token->value.string, field->key_len)) {
+            lua_rawgeti(l, json->tmpl_keys, node->fields + i + 1);
+            json->next_node = field->node;
+            container->field = i + 1;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Push the table for the array or object just opened on the container
+ * stack.
+ *
+ * Each open container uses up to 2 Lua stack slots (table, key), plus
+ * 1 slot for the value being decoded. Lua stack space is reserved for
+ * blocks of levels to avoid checking it for every container. */
+static void json_push_container(lua_State *l, json_parse_t *json)
+{
+    if (json->depth > json->reserved_depth) {
+        json_decode_checkstack(l, json, 2 * DECODE_STACK_RESERVE + 1);
+        json->reserved_depth = json->depth - 1 + DECODE_STACK_RESERVE;
+    }
+
+    if (json->tmpl)
+        json_template_table(l, json, &json->stack[json->depth - 1]);
+    else
+        lua_newtable(l);
+    json->tables++;
+}
+
+/* Lua 5.1 and 5.2 represent all numbers as doubles */
+static void json_push_integer(lua_State *l, int64_t value)
+{
+#ifdef JSON_INTEGERS
+    lua_pushinteger(l, (lua_Integer)value);
+#else
+    lua_pushnumber(l, (lua_Number)value);
+#endif
+}
+
+static void json_push_number(lua_State *l, json_token_t *token)
+{
+    if (token->integer)
+        json_push_integer(l, token->value.integer);
+    else
+        lua_pushnumber(l, token->value.number);
+}
+
+static void json_throw_limit_error(lua_State *l, json_parse_t *json,
+                                   const char *limit)
+{
+    json_parse_free(json);
+    luaL_error(l, "Decode limit %s exceeded at character %d", limit,
+               json->index);
+}
+
+/* Push a string value or object key */
+static void json_push_string(lua_State *l, json_parse_t *json,
+                             json_token_t *token, int key)
+{
+    json->string_bytes -= token->string_len;
+    if (json->string_bytes < 0)
+        json_throw_limit_error(l, json, "max_string_bytes");
+
+    if (!key || !json->tmpl || !json_template_key(l, json, token))
+        lua_pushlstring(l, token->value.string, token->string_len);
+}
+
+/* Decode the array after a T_ARR_BEGIN token into a packed array when it
+ * only contains numbers. Otherwise the tokeniser is rewound to the start
+ * of the array, and 0 is returned.
+ *
+ * The numbers are collected in json->tmp, which is not in use between
+ * string tokens. */
+static int json_decode_packed_array(lua_State *l, json_parse_t *json)
+{
+    json_token_t token;
+    json_packed_t *packed;
+    int index = json->index;
+    int escapes = json->escapes;
+    int numbers = json->numbers;
+    double num;
+    int count;
+
+    strbuf_reset(json->tmp);
+    while (1) {
+        json_next_token(json, &token);
+        if (token.type != T_NUMBER)
+            break;
+        if (token.integer) {
+            /* Keep integers which are not exact as doubles in tables */
+            if (token.value.integer < -(INT64_C(1) << 53) ||
+                token.value.integer > INT64_C(1) << 53)
+                break;
+            num = (double)token.value.integer;
+        } else {
+            num = token.value.number;
+        }
+        strbuf_append_mem(json->tmp, (const char *)&num, sizeof(num));
+
+        json_next_token(json, &token);
+        if (token.type == T_ARR_END) {
+            count = strbuf_length(json->tmp) / sizeof(num);
+            if (count < json->cfg->decode_packed_min)
+                break;
+
+            json->elements -= count;
+            if (json->elements < 0)
+                json_throw_limit_error(l, json, "max_elements");
+
+            packed = json_new_packed(l, count);
+            memcpy(packed->values, json->tmp->buf, count * sizeof(num));
+            return 1;
+        }
+        if (token.type != T_COMMA)
+            break;
+    }
+
+    json->index = index;
+    json->escapes = escapes;
+    json->numbers = numbers;
+
+    return 0;
+}
+
+/* Handle the "value" context. The value begins with *token.
+ *
+ * Arrays and objects are tracked on an explicit container stack rather
+ * than by recursion. Each open container keeps its table on the Lua
+ * stack, followed by the pending key for objects.
+ *
+ * Returns once the complete value has been pushed onto the Lua stack. */
+static void json_process_value(lua_State *l, json_parse_t *json,
+                               json_token_t *token)
+{
+    json_container_t *container;
+    int base = json->depth;
+
+    json->state = JSON_PARSE_HELD;
+    do {
+        switch (json_next_event(json, token)) {
+        case JSON_EVENT_KEY:
+            json_push_string(l, json, token, 1);
+            continue;
+        case JSON_EVENT_VALUE:
+            if (--json->elements < 0)
+                json_throw_limit_error(l, json, "max_elements");
+
+            switch (token->type) {
+            case T_STRING:
+                json_push_string(l, json, token, 0);
+                break;
+            case T_NUMBER:
+                json_push_number(l, token);
+                break;
+            case T_BOOLEAN:
+                lua_pushboolean(l, token->value.boolean);
+                break;
+            default:
+                /* In Lua, setting "t[k] = nil" will delete k from the
+                 * table. Hence a NULL pointer lightuserdata object is
+                 * used instead */
+                lua_pushlightuserdata(l, NULL);
+                break;
+            }
+            break;
+        case JSON_EVENT_OPEN:
+            if (--json->elements < 0)
+                json_throw_limit_error(l, json, "max_elements");
+
+            if (token->type == T_ARR_BEGIN &&
+                json->cfg->decode_packed_arrays &&
+                json_decode_packed_array(l, json)) {
+                json->depth--;
+                json->state = JSON_PARSE_NEXT;
+                break;
+            }
+            json_push_container(l, json);
+            continue;
+        case JSON_EVENT_CLOSE:
+            break;
+        default:
+            json_throw_event_error(l, json, token);
+        }
+
+        /* A complete value is on the top of the Lua stack. Store it in
+         * the enclosing container. */
+        if (json->depth > base) {
+            container = &json->stack[json->depth - 1];
+            if (container->type == T_ARR_BEGIN) {
+                lua_rawseti(l, -2, ++container->index);
+                if (json->tmpl)
+                    json->next_node = container->field;
+            } else {
+                lua_rawset(l, -3);
+            }
+        }
+    } while (json->depth > base);
+}
+
+/* Uses "stack" (cfg->decode_max_depth entries) and "tmp" as the
+ * container stack and temporary buffer when not NULL */
+static inline void json_parse_init_with(json_parse_t *json,
+                                        json_config_t *cfg,
+                                        const char *json_text, int json_len,
+                                        json_container_t *stack,
+                                        strbuf_t *tmp)
+{
+    json->cfg = cfg;
+    json->data = json_text;
+    json->len = json_len;
+    json->index = 0;
+    if (stack) {
+        json->stack = stack;
+        json->stack_size = 0;
+    } else {
+        json->stack = json_take_stack(cfg);
+        if (!json->stack)
+            die("Out of memory");
+        json->stack_size = cfg->decode_max_depth;
+    }
+    json->depth = 0;
+    json->reserved_depth = 0;
+    json->state = JSON_PARSE_VALUE;
+    json->error = NULL;
+    json->max_depth = cfg->decode_max_depth;
+    json->elements = INT_MAX;
+    json->string_bytes = INT_MAX;
+    json->escapes = 0;
+    json->numbers = 0;
+    json->tables = 0;
+    json->tmpl = NULL;
+
+    /* Ensure the temporary buffer can hold the entire string.
+     * This means we no longer need to do length checks since the decoded
+     * string must be smaller than the entire json string */
+    if (tmp) {
+        strbuf_reset(tmp);
+        strbuf_ensure_empty_length(tmp, json_len);
+        json->tmp = tmp;
+    } else {
+        json->tmp = strbuf_new(json_len);
+    }
+}
+
+static void json_parse_init(json_parse_t *json, json_config_t *cfg,
+                            const char *json_text, int json_len)
+{
+    json_parse_init_with(json, cfg, json_text, json_len, NULL, NULL);
+}
+
+/* Add a decoded document to the statistics */
+static void json_decode_stats(json_config_t *cfg, json_parse_t *json,
+                              int json_len)
+{
+    cfg->stats.decode_documents++;
+    cfg->stats.decode_bytes += json_len;
+    cfg->stats.decode_tables += json->tables;
+    cfg->stats.decode_escapes += json->escapes;
+    cfg->stats.decode_numbers += json->numbers;
+}
+
+static int json_decode_parallel(lua_State *l, json_config_t *cfg,
+                                const char *json_text, int json_len);
+
+/* json_text must be null terminated string */
+/* Decode JSON text onto the Lua stack. Documents with limits, or which
+ * may contain packed arrays, are always parsed by the calling thread.
+ * limits->bytes is checked by the caller. */
+static void lua_json_decode(lua_State *l, json_config_t *cfg,
+                            const char *json_text, int json_len,
+                            const json_limits_t *limits)
+{
+    json_parse_t json;
+    json_token_t token;
+
+    if (!limits && !cfg->decode_packed_arrays && cfg->decode_threads > 1 &&
+        json_len >= cfg->decode_parallel_min &&
+        json_decode_parallel(l, cfg, json_text, json_len)) {
+        return;
+    }
+
+    json_parse_init(&json, cfg, json_text, json_len);
+    if (limits) {
+        if (limits->depth < json.max_depth)
+            json.max_depth = limits->depth;
+        json.elements = limits->elements;
+        json.string_bytes = limits->string_bytes;
+    }
+
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    /* Ensure there is no more input left */
+    json_next_token(&json, &token);
+
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    json_parse_free(&json);
+    json_decode_stats(cfg, &json, json_len);
+}
+
+/* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
+ *
+ * CJSON can support any simple data type, hence only the first
+ * character is guaranteed to be ASCII (at worst: '"'). This is
+ * still enough to detect whether the wrong encoding is in use. */
+static void json_check_encoding(lua_State *l, const char *json, size_t len)
+{
+    if (len >= 2 && (!json[0] || !json[1]))
+        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+}
+
+/* Returns the non-negative limit in field "name" of the table at lindex,
+ * or INT_MAX when unset */
+static int json_get_limit(lua_State *l, int lindex, const char *name)
+{
+    double limit;
+
+    lua_getfield(l, lindex, name);
+    if (lua_isnil(l, -1)) {
+        lua_pop(l, 1);
+        return INT_MAX;
+    }
+    limit = lua_tonumber(l, -1);
+    if (lua_type(l, -1) != LUA_TNUMBER || !(limit >= 0)) {
+        luaL_argerror(l, lindex,
+                      lua_pushfstring(l, "%s must be a non-negative number",
+                                      name));
+    }
+    lua_pop(l, 1);
+
+    return limit < INT_MAX ? (int)limit : INT_MAX;
+}
+
+/* Reads the optional limits table of cjson.decode() */
+static void json_decode_limits(lua_State *l, int lindex,
+                               json_limits_t *limits)
+{
+    luaL_checktype(l, lindex, LUA_TTABLE);
+
+    limits->bytes = json_get_limit(l, lindex, "max_bytes");
+    limits->depth = json_get_limit(l, lindex, "max_depth");
+    limits->elements = json_get_limit(l, lindex, "max_elements");
+    limits->string_bytes = json_get_limit(l, lindex, "max_string_bytes");
+}
+
+static int json_decode(lua_State *l)
+{
+    json_limits_t limits;
+    const char *json;
+    size_t len;
+
+    json_verify_arg_count(l, 2);
+
+    json = luaL_checklstring(l, 1, &len);
+    if (!lua_isnoneornil(l, 2)) {
+        json_decode_limits(l, 2, &limits);
+        /* Checked before any parsing is done */
+        if (len > (size_t)limits.bytes)
+            luaL_error(l, "Decode limit max_bytes exceeded");
+    }
+    json_check_encoding(l, json, len);
+
+    lua_json_decode(l, json_fetch_config(l), json, len,
+                    lua_isnoneornil(l, 2) ? NULL : &limits);
+
+    return 1;
+}
+
+/* Pushes the column table for the object key in *token.
+ *
+ * Records within an array usually share the same key order, so the
+ * key at each position of the previous record is checked first. This
+ * avoids interning the key and looking up the column by name.
+ *
+ * Lua stack: [2] columns, [3] shape = { key1, column1, key2, .. } */
+static void json_fetch_column(lua_State *l, json_token_t *token, int field)
+{
+    const char *key;
+    size_t keylen;
+
+    lua_rawgeti(l, 3, 2 * field - 1);
+    key = lua_tolstring(l, -1, &keylen);
+    lua_pop(l, 1);
+    if (key && keylen == token->string_len &&
+        !memcmp(key, token->value.string, keylen)) {
+        lua_rawgeti(l, 3, 2 * field);
+        return;
+    }
+
+    /* Look up the column by name, creating it if required */
+    lua_pushlstring(l, token->value.string, token->string_len);
+    lua_pushvalue(l, -1);
+    lua_rawget(l, 2);
+    if (lua_isnil(l, -1)) {
+        lua_pop(l, 1);
+        lua_newtable(l);
+        lua_pushvalue(l, -2);
+        lua_pushvalue(l, -2);
+        lua_rawset(l, 2);
+    }
+    /* key, column */
+
+    /* Remember the key position for the next record */
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, 3, 2 * field);
+    lua_insert(l, -2);
+    lua_rawseti(l, 3, 2 * field - 1);
+    /* column */
+}
+
+/* Deserialise a JSON array of objects into a table of columns. Eg:
+ *   [{"a":1,"b":"x"},{"a":2}]
+ * becomes:
+ *   { a = { 1, 2 }, b = { "x" } }, 2
+ *
+ * Returns the columns and the number of rows. Columns may contain
+ * holes where a key was missing from a record. */
+static int json_decode_columns(lua_State *l)
+{
+    json_parse_t json;
+    json_token_t token;
+    const char *text;
+    size_t len;
+    int row, field;
+
+    json_verify_arg_count(l, 1);
+
+    text = luaL_checklstring(l, 1, &len);
+    json_check_encoding(l, text, len);
+
+    json_parse_init(&json, json_fetch_config(l), text, len);
+
+    lua_newtable(l);    /* Columns */
+    lua_newtable(l);    /* Key order of the previous record */
+
+    json_next_token(&json, &token);
+    if (token.type != T_ARR_BEGIN)
+        json_throw_parse_error(l, &json, "array", &token);
+
+    json_next_token(&json, &token);
+
+    row = 0;
+    while (token.type != T_ARR_END) {
+        row++;
+        if (token.type != T_OBJ_BEGIN)
+            json_throw_parse_error(l, &json, "object", &token);
+
+        json_next_token(&json, &token);
+
+        for (field = 1; token.type != T_OBJ_END; field++) {
+            if (token.type != T_STRING)
+                json_throw_parse_error(l, &json, "object key string", &token);
+
+            json_fetch_column(l, &token, field);
+
+            json_next_token(&json, &token);
+            if (token.type != T_COLON)
+                json_throw_parse_error(l, &json, "colon", &token);
+
+            /* Fetch value */
+            json_next_token(&json, &token);
+            json_process_value(l, &json, &token);
+
+            /* Set column[row] = value */
+            lua_rawseti(l, -2, row);
+            lua_pop(l, 1);
+
+            json_next_token(&json, &token);
+
+            if (token.type == T_OBJ_END)
+                break;
+
+            if (token.type != T_COMMA)
+                json_throw_parse_error(l, &json, "comma or object end", &token);
+
+            json_next_token(&json, &token);
+        }
+
+        json_next_token(&json, &token);
+
+        if (token.type == T_ARR_END)
+            break;
+
+        if (token.type != T_COMMA)
+            json_throw_parse_error(l, &json, "comma or array end", &token);
+
+        json_next_token(&json, &token);
+    }
+
+    /* Ensure there is no more input left */
+    json_next_token(&json, &token);
+
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    json_parse_free(&json);
+    json_decode_stats(json.cfg, &json, len);
+
+    lua_pop(l, 1);
+    lua_pushinteger(l, row);
+
+    return 2;
+}
+
+/* ===== TEXT EDITING ===== */
+
+/* cjson.set() and cjson.delete() edit JSON text at a JSON Pointer
+ * (RFC 6901) without decoding it. The tokeniser finds the span of the
+ * target value, and the result is built from the text before the span,
+ * the replacement and the text after it.
+ *
+ * The whole text is checked while it is tokenised, so invalid JSON is
+ * never edited. Text outside the span is copied unchanged. */
+
+/* Location of the value referenced by a JSON Pointer */
+typedef struct {
+    int found;          /* 0: the last reference token does not exist */
+    int object;         /* The parent is an object */
+    int start;          /* Value, or insertion point when not found */
+    int end;
+    int member;         /* Object key or array element */
+    int prev_end;       /* End of the previous member, or -1 */
+    int next;           /* Start of the next member, or -1 */
+    int key_len;        /* Last reference token, decoded */
+} json_span_t;
+
+/* Check the syntax of a JSON Pointer */
+static int json_pointer_valid(const char *ptr, size_t len)
+{
+    size_t i;
+
+    if (len && ptr[0] != '/')
+        return 0;
+
+    for (i = 0; i < len; i++) {
+        if (ptr[i] == '~' &&
+            (i + 1 == len || (ptr[i + 1] != '0' && ptr[i + 1] != '1')))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Decode the reference token following the '/' at *pos into buf, and
+ * advance *pos to the next '/' */
+static int json_pointer_token(const char *ptr, size_t len, size_t *pos,
+                              char *buf)
+{
+    size_t i;
+    int n = 0;
+
+    for (i = *pos + 1; i < len && ptr[i] != '/'; i++) {
+        if (ptr[i] == '~')
+            buf[n++] = ptr[++i] == '0' ? '~' : '/';
+        else
+            buf[n++] = ptr[i];
+    }
+    *pos = i;
+
+    return n;
+}
+
+/* Returns the array index in a reference token, -1 for "-" (after the
+ * last element) or -2 when invalid */
+static int json_pointer_index(const char *buf, int len)
+{
+    int i, index = 0;
+
+    if (len == 1 && buf[0] == '-')
+        return -1;
+    if (!len || len > 9 || (len > 1 && buf[0] == '0'))
+        return -2;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] < '0' || '9' < buf[i])
+            return -2;
+        index = index * 10 + buf[i] - '0';
+    }
+
+    return index;
+}
+
+static void json_edit_error(lua_State *l, json_parse_t *json,
+                            const char *ptr, const char *reason)
+{
+    json_parse_free(json);
+    luaL_error(l, "JSON pointer \"%s\" %s", ptr, reason);
+}
+
+/* Fetch the next event, raising any syntax error */
+static json_event_t json_edit_next(lua_State *l, json_parse_t *json,
+                                   json_token_t *token)
+{
+    json_event_t event = json_next_event(json, token);
+
+    if (event == JSON_EVENT_ERROR)
+        json_throw_event_error(l, json, token);
+
+    return event;
+}
+
+/* Statistics gathered by cjson.analyze(), see DOCUMENT ANALYSIS */
+typedef struct json_analysis json_analysis_t;
+
+static void json_analyze_event(json_parse_t *json, json_analysis_t *a,
+                               json_event_t event, json_token_t *token);
+
+/* Check the syntax of the rest of a value, after json_next_event()
+ * returned "event" for its first token. Leaves the index after it.
+ * Each event is counted in "a" when it is not NULL. */
+static void json_skip_value(lua_State *l, json_parse_t *json,
+                            json_event_t event, json_token_t *token,
+                            json_analysis_t *a)
+{
+    int base = json->depth;
+
+    if (event == JSON_EVENT_OPEN)
+        base--;
+
+    while (1) {
+        if (event == JSON_EVENT_ERROR)
+            json_throw_event_error(l, json, token);
+        if (a)
+            json_analyze_event(json, a, event, token);
+        if (json->depth == base)
+            return;
+        event = json_next_event(json, token);
+    }
+}
+
+/* Find the span of the value referenced by ptr. When only the last
+ * reference token is missing, span->found is 0 and span->start is
+ * where a new member would be inserted. buf receives each decoded
+ * reference token. */
+static void json_find_pointer(lua_State *l, json_parse_t *json,
+                              const char *ptr, size_t ptr_len, char *buf,
+                              json_span_t *span)
+{
+    json_token_t token;
+    json_event_t event;
+    size_t pos = 0;
+    int index = 0, count, match, member, last, last_member, last_prev_end;
+
+    event = json_next_event(json, &token);
+
+    span->found = 1;
+    span->object = 0;
+    span->member = token.index;
+    span->prev_end = -1;
+    span->next = -1;
+
+    while (pos < ptr_len) {
+        span->key_len = json_pointer_token(ptr, ptr_len, &pos, buf);
+        span->prev_end = -1;
+
+        if (event == JSON_EVENT_ERROR)
+            json_throw_event_error(l, json, &token);
+        if (event != JSON_EVENT_OPEN)
+            json_edit_error(l, json, ptr, "does not exist");
+
+        span->object = json->stack[json->depth - 1].type == T_OBJ_BEGIN;
+        if (!span->object) {
+            index = json_pointer_index(buf, span->key_len);
+            if (index == -2)
+                json_edit_error(l, json, ptr, "has an invalid array index");
+        }
+
+        /* Find the member, or the end of the container. Objects are
+         * scanned to the end since the last duplicate key is decoded,
+         * and last is the start of its value. */
+        last = -1;
+        last_member = last_prev_end = 0;
+        for (count = 0; ; count++) {
+            event = json_edit_next(l, json, &token);
+            if (event == JSON_EVENT_CLOSE)
+                break;
+            member = token.index;
+            if (event == JSON_EVENT_KEY) {
+                /* The key is overwritten by the next string token */
+                match = token.string_len == span->key_len &&
+                        !memcmp(token.value.string, buf, span->key_len);
+                event = json_edit_next(l, json, &token);
+            } else {
+                match = count == index;
+            }
+            if (match) {
+                span->member = member;
+                if (!span->object)
+                    break;
+                last = token.index;
+                last_member = member;
+                last_prev_end = span->prev_end;
+            }
+
+            json_skip_value(l, json, event, &token, NULL);
+            span->prev_end = json->index;
+        }
+
+        if (last >= 0) {
+            /* Reopen the object and tokenise the value again */
+            json->depth++;
+            json->index = last;
+            json->state = JSON_PARSE_VALUE;
+            span->member = last_member;
+            span->prev_end = last_prev_end;
+            event = json_edit_next(l, json, &token);
+        } else if (event == JSON_EVENT_CLOSE) {
+            /* Members may only be added by the last reference token */
+            if (pos < ptr_len || (!span->object && index != -1 &&
+                                  index != count))
+                json_edit_error(l, json, ptr, "does not exist");
+            span->found = 0;
+            span->start = span->end = span->prev_end >= 0 ?
+                                      span->prev_end : token.index;
+            break;
+        }
+    }
+
+    if (span->found) {
+        span->start = token.index;
+        json_skip_value(l, json, event, &token, NULL);
+        span->end = json->index;
+
+        if (ptr_len && json_edit_next(l, json, &token) != JSON_EVENT_CLOSE)
+            span->next = token.index;
+    }
+
+    /* Check the rest of the text */
+    while (json->depth > 0)
+        json_edit_next(l, json, &token);
+    json_next_token(json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, json, "the end", &token);
+}
+
+/* Locate ptr in the JSON text at index 1. The decoded reference tokens
+ * are kept in a userdata pushed onto the stack. */
+static char *json_edit_locate(lua_State *l, json_config_t *cfg,
+                              json_span_t *span)
+{
+    json_parse_t json;
+    const char *json_text, *ptr;
+    size_t json_len, ptr_len;
+    char *buf;
+
+    json_text = luaL_checklstring(l, 1, &json_len);
+    ptr = luaL_checklstring(l, 2, &ptr_len);
+    luaL_argcheck(l, json_pointer_valid(ptr, ptr_len), 2,
+                  "invalid JSON pointer");
+    json_check_encoding(l, json_text, json_len);
+
+    buf = lua_newuserdata(l, ptr_len + 1);
+
+    json_parse_init(&json, cfg, json_text, json_len);
+    json_find_pointer(l, &json, ptr, ptr_len, buf, span);
+    json_parse_free(&json);
+
+    return buf;
+}
+
+/* Returns the JSON text with the value at the pointer replaced, or
+ * added when only the last reference token does not exist. "-" adds
+ * an element to the end of an array. */
+static int json_set(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_span_t span;
+    const char *json_text;
+    size_t json_len;
+    strbuf_t *json;
+    char *buf, *text;
+    int len;
+
+    luaL_argcheck(l, lua_gettop(l) == 3, 3, "expected 3 arguments");
+    buf = json_edit_locate(l, cfg, &span);
+    json_text = lua_tolstring(l, 1, &json_len);
+
+    json_encode_init(cfg);
+    json = &cfg->encode_buf;
+    strbuf_append_mem(json, json_text, span.start);
+    if (!span.found) {
+        if (span.prev_end >= 0)
+            strbuf_append_char(json, ',');
+        if (span.object) {
+            json_append_escaped(json, buf, span.key_len);
+            strbuf_append_char(json, ':');
+        }
+    }
+    lua_pushvalue(l, 3);
+    json_append_data(l, cfg, json);
+    strbuf_append_mem(json, json_text + span.end, json_len - span.end);
+
+    text = strbuf_string(json, &len);
+    lua_pushlstring(l, text, len);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(json);
+
+    return 1;
+}
+
+/* Returns the JSON text without the value at the pointer, and its
+ * object key or separating comma */
+static int json_delete(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_span_t span;
+    const char *json_text;
+    size_t json_len;
+    strbuf_t *json;
+    char *text;
+    int start, end, len;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    luaL_argcheck(l, lua_objlen(l, 2), 2, "cannot delete the whole document");
+    json_edit_locate(l, cfg, &span);
+    if (!span.found)
+        luaL_error(l, "JSON pointer \"%s\" does not exist",
+                   lua_tostring(l, 2));
+    json_text = lua_tolstring(l, 1, &json_len);
+
+    if (span.next >= 0) {
+        start = span.member;
+        end = span.next;
+    } else if (span.prev_end >= 0) {
+        start = span.prev_end;
+        end = span.end;
+    } else {
+        start = span.member;
+        end = span.end;
+    }
+
+    json_encode_init(cfg);
+    json = &cfg->encode_buf;
+    strbuf_append_mem(json, json_text, start);
+    strbuf_append_mem(json, json_text + end, json_len - end);
+
+    text = strbuf_string(json, &len);
+    lua_pushlstring(l, text, len);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(json);
+
+    return 1;
+}
+
+/* ===== TEXT FORMATTING ===== */
+
+/* cjson.minify() and cjson.reformat() rewrite the whitespace of JSON
+ * text without converting any values. The scan_text kernel finds the
+ * next whitespace, quote or structural character. Strings are copied
+ * unchanged, including any whitespace they contain.
+ *
+ * Only strings and bracket nesting are checked. Other invalid JSON is
+ * copied through, keeping a space between bare tokens so they are not
+ * joined together. */
+
+#define JSON_MAX_INDENT 16
+
+static void json_format_error(lua_State *l, json_config_t *cfg,
+                              const char *reason, size_t index)
+{
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+    luaL_error(l, "%s at character %d", reason, (int)index + 1);
+}
+
+/* Returns the length of the string starting with the quote at str[0],
+ * or 0 when it is not terminated */
+static size_t json_string_span(const char *str, size_t len)
+{
+    size_t i = 1;
+
+    while (1) {
+        i += json_get_kernels()->scan_string(&str[i], len - i, 0);
+        if (i >= len)
+            return 0;
+        if (str[i] == '"')
+            return i + 1;
+        /* Skip the escaped character, or a NULL */
+        i += str[i] == '\\' ? 2 : 1;
+        if (i > len)
+            return 0;
+    }
+}
+
+/* Returns true when whitespace between "prev" and "next" separates
+ * tokens which would be joined without it, eg. "1 2" or "tr ue" */
+static int json_format_separates(char prev, char next)
+{
+    return !memchr("{}[],:", prev, 6) && !memchr("{}[],:\"", next, 7);
+}
+
+/* Push the formatted text and release the buffer */
+static void json_format_finish(lua_State *l, json_config_t *cfg)
+{
+    char *text;
+    int len;
+
+    text = strbuf_string(&cfg->encode_buf, &len);
+    lua_pushlstring(l, text, len);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+}
+
+/* Remove all whitespace outside of strings */
+static int json_minify(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    const json_kernels_t *k = json_get_kernels();
+    strbuf_t *json;
+    const char *str;
+    size_t len, i, run, start;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    str = luaL_checklstring(l, 1, &len);
+
+    json_encode_init(cfg);
+    json = &cfg->encode_buf;
+
+    /* Output is never longer than the input */
+    strbuf_ensure_empty_length(json, len);
+
+    for (i = 0; i < len; ) {
+        run = k->scan_text(&str[i], len - i, 0);
+        strbuf_append_mem_unsafe(json, &str[i], run);
+        i += run;
+        if (i == len)
+            break;
+
+        if (str[i] == '"') {
+            run = json_string_span(&str[i], len - i);
+            if (!run)
+                json_format_error(l, cfg, "Unterminated string", i);
+            strbuf_append_mem_unsafe(json, &str[i], run);
+            i += run;
+        } else {
+            /* Whitespace */
+            start = i++;
+            i += k->skip_whitespace(&str[i], len - i);
+            if (start && i < len &&
+                json_format_separates(str[start - 1], str[i]))
+                strbuf_append_char_unsafe(json, ' ');
+        }
+    }
+
+    json_format_finish(l, cfg);
+
+    return 1;
+}
+
+static void json_append_newline(strbuf_t *json, const char *indent,
+                                size_t indent_len, int depth)
+{
+    int i;
+
+    strbuf_ensure_empty_length(json, 1 + indent_len * depth);
+    strbuf_append_char_unsafe(json, '\n');
+    for (i = 0; i < depth; i++)
+        strbuf_append_mem_unsafe(json, indent, indent_len);
+}
+
+/* Pretty print with each member on its own line. "indent" is a number
+ * of spaces (default: 2), or the string used for each level. */
+static int json_reformat(lua_State *l)
+{
+    static const char spaces[JSON_MAX_INDENT + 1] = "                ";
+    json_config_t *cfg = json_fetch_config(l);
+    const json_kernels_t *k = json_get_kernels();
+    strbuf_t *json;
+    const char *str, *indent;
+    size_t len, indent_len, i, run, next;
+    int depth;
+    char ch;
+
+    json_verify_arg_count(l, 2);
+    str = luaL_checklstring(l, 1, &len);
+    if (lua_type(l, 2) == LUA_TSTRING) {
+        indent = lua_tolstring(l, 2, &indent_len);
+    } else {
+        indent = spaces;
+        indent_len = luaL_optinteger(l, 2, 2);
+        luaL_argcheck(l, indent_len <= JSON_MAX_INDENT, 2,
+                      "expected integer between 0 and 16");
+    }
+
+    json_encode_init(cfg);
+    json = &cfg->encode_buf;
+
+    depth = 0;
+    for (i = 0; i < len; ) {
+        run = k->scan_text(&str[i], len - i, 1);
+        strbuf_append_mem(json, &str[i], run);
+        i += run;
+        if (i == len)
+            break;
+
+        ch = str[i];
+        switch (ch) {
+        case '"':
+            run = json_string_span(&str[i], len - i);
+            if (!run)
+                json_format_error(l, cfg, "Unterminated string", i);
+            strbuf_append_mem(json, &str[i], run);
+            i += run;
+            break;
+        case '{':
+        case '[':
+            /* Empty containers stay on one line. '{' + 2 is '}', and
+             * '[' + 2 is ']'. */
+            next = i + 1;
+            next += k->skip_whitespace(&str[next], len - next);
+            if (next < len && str[next] == ch + 2) {
+                strbuf_append_char(json, ch);
+                strbuf_append_char(json, ch + 2);
+                i = next + 1;
+                break;
+            }
+            strbuf_append_char(json, ch);
+            json_append_newline(json, indent, indent_len, ++depth);
+            i++;
+            break;
+        case '}':
+        case ']':
+            if (!depth)
+                json_format_error(l, cfg, "Unbalanced bracket", i);
+            json_append_newline(json, indent, indent_len, --depth);
+            strbuf_append_char(json, ch);
+            i++;
+            break;
+        case ',':
+            strbuf_append_char(json, ',');
+            json_append_newline(json, indent, indent_len, depth);
+            i++;
+            break;
+        case ':':
+            strbuf_append_mem(json, ": ", 2);
+            i++;
+            break;
+        default:
+            /* Whitespace */
+            next = i + 1;
+            next += k->skip_whitespace(&str[next], len - next);
+            if (i && next < len &&
+                json_format_separates(str[i - 1], str[next]))
+                strbuf_append_char(json, ' ');
+            i = next;
+        }
+    }
+
+    if (depth)
+        json_format_error(l, cfg, "Unbalanced bracket", len);
+
+    json_format_finish(l, cfg);
+
+    return 1;
+}
+
+/* ===== DOCUMENT ANALYSIS ===== */
+
+/* cjson.analyze() tokenises JSON text and returns statistics describing
+ * its shape, without creating Lua values for its contents. Sizes are
+ * counted in power of 2 buckets: bucket 0 holds size 0, and bucket n
+ * holds sizes 2^(n-1) to 2^n - 1.
+ *
+ * Object keys are counted in a fixed size hash table indexed by their
+ * XXH64 hash. Each distinct key is copied into a names buffer and
+ * compared on a hash match, so colliding keys are counted separately.
+ * The table and buffers are kept in the configuration between calls. */
+
+#define JSON_ANALYZE_BUCKETS 32
+#define JSON_ANALYZE_KEY_SLOTS 4096     /* Must be a power of 2 */
+#define JSON_ANALYZE_MAX_KEYS (JSON_ANALYZE_KEY_SLOTS / 4 * 3)
+#define JSON_ANALYZE_DEFAULT_TOP 10
+
+typedef struct {
+    int count;
+    int max;
+    double total;
+    int buckets[JSON_ANALYZE_BUCKETS];
+} json_histogram_t;
+
+struct json_analysis {
+    int values;
+    int max_depth;
+    double total_depth;
+    json_histogram_t objects;   /* Members */
+    json_histogram_t arrays;    /* Elements */
+    json_histogram_t strings;   /* Decoded bytes, excluding keys */
+    int escaped_strings;
+    int numbers;
+    int booleans;
+    int nulls;
+    int keys;
+    int distinct_keys;          /* Keys in the table */
+    json_key_count_t *key_table;
+    strbuf_t *names;            /* Decoded distinct keys */
+};
+
+static void json_histogram_add(json_histogram_t *h, int size)
+{
+    unsigned int n = size;
+    int bucket = 0;
+
+    while (n) {
+        bucket++;
+        n >>= 1;
+    }
+
+    h->count++;
+    h->total += size;
+    h->buckets[bucket]++;
+    if (size > h->max)
+        h->max = size;
+}
+
+/* Count the key in *token. New keys are ignored once the table is
+ * full. */
+static void json_analyze_key(json_analysis_t *a, json_token_t *token)
+{
+    json_key_count_t *entry;
+    uint64_t hash;
+    int slot;
+
+    a->keys++;
+
+    hash = json_hash64(token->value.string, token->string_len, 0);
+    slot = hash & (JSON_ANALYZE_KEY_SLOTS - 1);
+    while (a->key_table[slot].count) {
+        entry = &a->key_table[slot];
+        if (entry->hash == hash && entry->length == token->string_len &&
+            !memcmp(a->names->buf + entry->offset, token->value.string,
+                    token->string_len)) {
+            entry->count++;
+            return;
+        }
+        slot = (slot + 1) & (JSON_ANALYZE_KEY_SLOTS - 1);
+    }
+
+    if (a->distinct_keys >= JSON_ANALYZE_MAX_KEYS)
+        return;
+
+    entry = &a->key_table[slot];
+    entry->hash = hash;
+    entry->index = token->index;
+    entry->offset = strbuf_length(a->names);
+    entry->length = token->string_len;
+    entry->count = 1;
+    strbuf_append_mem(a->names, token->value.string, token->string_len);
+    a->distinct_keys++;
+}
+
+/* Count an event reported by json_next_event(). Open containers count
+ * their members so far in container->index. */
+static void json_analyze_event(json_parse_t *json, json_analysis_t *a,
+                               json_event_t event, json_token_t *token)
+{
+    json_container_t *container;
+    int parent;
+
+    switch (event) {
+    case JSON_EVENT_KEY:
+        json_analyze_key(a, token);
+        return;
+    case JSON_EVENT_CLOSE:
+        container = &json->stack[json->depth];
+        json_histogram_add(container->type == T_OBJ_BEGIN ?
+                           &a->objects : &a->arrays, container->index);
+        return;
+    default:
+        break;
+    }
+
+    /* Containers are already open at their own depth */
+    a->values++;
+    a->total_depth += json->depth;
+    if (json->depth > a->max_depth)
+        a->max_depth = json->depth;
+
+    parent = event == JSON_EVENT_OPEN ? json->depth - 1 : json->depth;
+    if (parent)
+        json->stack[parent - 1].index++;
+    if (event == JSON_EVENT_OPEN)
+        return;
+
+    switch (token->type) {
+    case T_STRING:
+        json_histogram_add(&a->strings, token->string_len);
+        /* Every escape sequence is longer than its decoded bytes */
+        if (token->string_len < json->index - token->index - 2)
+            a->escaped_strings++;
+        break;
+    case T_NUMBER:
+        a->numbers++;
+        break;
+    case T_BOOLEAN:
+        a->booleans++;
+        break;
+    case T_NULL:
+        a->nulls++;
+        break;
+    default:
+        break;
+    }
+}
+
+static void json_push_histogram(lua_State *l, json_histogram_t *h)
+{
+    int i, used;
+
+    lua_createtable(l, 0, 4);
+    lua_pushinteger(l, h->count);
+    lua_setfield(l, -2, "count");
+    lua_pushinteger(l, h->max);
+    lua_setfield(l, -2, "max");
+    lua_pushnumber(l, h->count ? h->total / h->count : 0);
+    lua_setfield(l, -2, "average");
+
+    /* Omit empty buckets above the largest size */
+    for (used = JSON_ANALYZE_BUCKETS; used > 0; used--) {
+        if (h->buckets[used - 1])
+            break;
+    }
+    lua_createtable(l, used, 0);
+    for (i = 0; i < used; i++) {
+        lua_pushinteger(l, h->buckets[i]);
+        lua_rawseti(l, -2, i + 1);
+    }
+    lua_setfield(l, -2, "histogram");
+}
+
+/* Most frequent first, then in order of appearance */
+static int json_key_count_compare(const void *a, const void *b)
+{
+    const json_key_count_t *x = a;
+    const json_key_count_t *y = b;
+
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Push the most frequent keys as an array of { key =, count = } */
+static void json_push_top_keys(lua_State *l, json_analysis_t *a, int top)
+{
+    int i, n;
+
+    /* Move used slots to the front */
+    for (i = 0, n = 0; i < JSON_ANALYZE_KEY_SLOTS; i++) {
+        if (a->key_table[i].count)
+            a->key_table[n++] = a->key_table[i];
+    }
+    qsort(a->key_table, n, sizeof(a->key_table[0]), json_key_count_compare);
+
+    if (top > n)
+        top = n;
+
+    lua_createtable(l, top, 0);
+    for (i = 0; i < top; i++) {
+        lua_createtable(l, 0, 2);
+        lua_pushlstring(l, a->names->buf + a->key_table[i].offset,
+                        a->key_table[i].length);
+        lua_setfield(l, -2, "key");
+        lua_pushinteger(l, a->key_table[i].count);
+        lua_setfield(l, -2, "count");
+        lua_rawseti(l, -2, i + 1);
+    }
+}
+
+/* Returns a table of statistics for the JSON text. "top" limits the
+ * number of frequent keys returned (default: 10). */
+static int json_analyze(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_analysis_t a;
+    json_parse_t json;
+    json_token_t token;
+    json_event_t event;
+    const char *json_text;
+    size_t json_len;
+    lua_Integer top;
+
+    json_verify_arg_count(l, 2);
+    json_text = luaL_checklstring(l, 1, &json_len);
+    top = luaL_optinteger(l, 2, JSON_ANALYZE_DEFAULT_TOP);
+    luaL_argcheck(l, top >= 0, 2, "expected non-negative integer");
+    json_check_encoding(l, json_text, json_len);
+
+    /* The key table and buffers are kept for later calls */
+    if (!cfg->analyze_keys) {
+        cfg->analyze_keys = malloc(sizeof(*cfg->analyze_keys) *
+                                   JSON_ANALYZE_KEY_SLOTS);
+        if (!cfg->analyze_keys)
+            luaL_error(l, "Out of memory");
+    }
+    if (!cfg->analyze_names)
+        cfg->analyze_names = strbuf_new(0);
+
+    memset(&a, 0, sizeof(a));
+    a.key_table = cfg->analyze_keys;
+    memset(a.key_table, 0, sizeof(a.key_table[0]) * JSON_ANALYZE_KEY_SLOTS);
+    a.names = cfg->analyze_names;
+    strbuf_reset(a.names);
+
+    /* Parse errors free the temporary buffer, so it is only returned to
+     * the configuration once the text has been checked */
+    json_parse_init_with(&json, cfg, json_text, json_len, NULL,
+                         cfg->analyze_tmp);
+    cfg->analyze_tmp = NULL;
+    event = json_next_event(&json, &token);
+    json_skip_value(l, &json, event, &token, &a);
+
+    /* Ensure there is no more input left */
+    json_next_token(&json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    lua_createtable(l, 0, 12);
+    lua_pushinteger(l, json_len);
+    lua_setfield(l, -2, "bytes");
+    lua_pushinteger(l, a.values);
+    lua_setfield(l, -2, "values");
+    lua_pushinteger(l, a.max_depth);
+    lua_setfield(l, -2, "max_depth");
+    lua_pushnumber(l, a.total_depth / a.values);
+    lua_setfield(l, -2, "average_depth");
+    json_push_histogram(l, &a.objects);
+    lua_setfield(l, -2, "objects");
+    json_push_histogram(l, &a.arrays);
+    lua_setfield(l, -2, "arrays");
+    json_push_histogram(l, &a.strings);
+    lua_pushinteger(l, a.escaped_strings);
+    lua_setfield(l, -2, "escaped");
+    lua_setfield(l, -2, "strings");
+    lua_pushinteger(l, a.numbers);
+    lua_setfield(l, -2, "numbers");
+    lua_pushinteger(l, a.booleans);
+    lua_setfield(l, -2, "booleans");
+    lua_pushinteger(l, a.nulls);
+    lua_setfield(l, -2, "nulls");
+
+    lua_createtable(l, 0, 3);
+    lua_pushinteger(l, a.keys);
+    lua_setfield(l, -2, "count");
+    lua_pushinteger(l, a.distinct_keys);
+    lua_setfield(l, -2, "distinct");
+    json_push_top_keys(l, &a, top < INT_MAX ? (int)top : INT_MAX);
+    lua_setfield(l, -2, "top");
+    lua_setfield(l, -2, "keys");
+
+    cfg->analyze_tmp = json.tmp;
+    json_parse_return_stack(&json);
+
+    return 1;
+}
+
+/* ===== DOCUMENT TAPE ===== */
+
+/* A tape holds a parsed JSON value without using the Lua state, so it
+ * can be built outside of Lua (Eg, by another thread).
+ *
+ * Nodes are stored in document order. Arrays and objects are followed
+ * by their elements (objects: key, value, key, value..). Strings are
+ * stored unescaped in a separate string arena. */
+
+static void json_tape_init(json_tape_t *tape, int strings_len)
+{
+    tape->nodes = NULL;
+    tape->count = 0;
+    tape->size = 0;
+    strbuf_init(&tape->strings, strings_len);
+}
+
+static void json_tape_free(json_tape_t *tape)
+{
+    free(tape->nodes);
+    tape->nodes = NULL;
+    tape->count = 0;
+    tape->size = 0;
+    strbuf_free(&tape->strings);
+}
+
+/* Append a node and return its index */
+static int json_tape_append(json_tape_t *tape, json_tape_type_t type)
+{
+    json_tape_node_t *nodes;
+    int size;
+
+    if (tape->count == tape->size) {
+        size = tape->size ? tape->size * 2 : 64;
+        nodes = realloc(tape->nodes, size * sizeof(*nodes));
+        if (!nodes)
+            die("Out of memory");
+        tape->nodes = nodes;
+        tape->size = size;
+    }
+
+    tape->nodes[tape->count].type = type;
+    tape->nodes[tape->count].length = 0;
+
+    return tape->count++;
+}
+
+static void json_tape_append_string(json_tape_t *tape, const char *str,
+                                    int len)
+{
+    json_tape_node_t *node;
+    int n;
+
+    /* Fetch the node after appending, since the tape may be moved */
+    n = json_tape_append(tape, TAPE_STRING);
+    node = &tape->nodes[n];
+    node->length = len;
+    node->value.offset = strbuf_length(&tape->strings);
+    strbuf_append_mem(&tape->strings, str, len);
+}
+
+/* Parse the value beginning with *token onto the tape. This does not use
+ * the Lua state, and may be called from any thread.
+ *
+ * Returns NULL on success. Otherwise returns the expected token
+ * (see json_next_event()), and leaves the unexpected token in *token. */
+static const char *json_tape_parse_value(json_parse_t *json,
+                                         json_tape_t *tape,
+                                         json_token_t *token)
+{
+    json_container_t *container;
+    int base = json->depth;
+    int n;
+
+    json->state = JSON_PARSE_HELD;
+    do {
+        switch (json_next_event(json, token)) {
+        case JSON_EVENT_KEY:
+            json_tape_append_string(tape, token->value.string,
+                                    token->string_len);
+            continue;
+        case JSON_EVENT_VALUE:
+            switch (token->type) {
+            case T_STRING:
+                json_tape_append_string(tape, token->value.string,
+                                        token->string_len);
+                break;
+            case T_NUMBER:
+                if (token->integer) {
+                    n = json_tape_append(tape, TAPE_INTEGER);
+                    tape->nodes[n].value.integer = token->value.integer;
+                } else {
+                    n = json_tape_append(tape, TAPE_NUMBER);
+                    tape->nodes[n].value.number = token->value.number;
+                }
+                break;
+            case T_BOOLEAN:
+                json_tape_append(tape, token->value.boolean ? TAPE_TRUE :
+                                                              TAPE_FALSE);
+                break;
+            default:
+                json_tape_append(tape, TAPE_NULL);
+                break;
+            }
+            break;
+        case JSON_EVENT_OPEN:
+            container = &json->stack[json->depth - 1];
+            container->index = json_tape_append(tape,
+                token->type == T_OBJ_BEGIN ? TAPE_OBJECT : TAPE_ARRAY);
+            continue;
+        case JSON_EVENT_CLOSE:
+            container = &json->stack[json->depth];
+            tape->nodes[container->index].value.next = tape->count;
+            break;
+        default:
+            return json->error;
+        }
+
+        /* A complete value has been appended. Count it in the enclosing
+         * container. */
+        if (json->depth > base)
+            tape->nodes[json->stack[json->depth - 1].index].length++;
+    } while (json->depth > base);
+
+    return NULL;
+}
+
+/* Push the value at tape node *pos onto the Lua stack, and advance *pos
+ * past it. Tables are created with their exact sizes.
+ *
+ * Uses the container stack of the configuration. Returns the number of
+ * tables created. */
+static int json_tape_push_value(lua_State *l, json_config_t *cfg,
+                                json_tape_t *tape, int *pos)
+{
+    const char *strings = tape->strings.buf;
+    json_tape_node_t *node, *key;
+    json_container_t *stack, *container;
+    int max_depth = cfg->decode_max_depth;
+    int depth = 0;
+    int reserved_depth = 0;
+    int tables = 0;
+
+    stack = json_take_stack(cfg);
+    if (!stack)
+        luaL_error(l, "Out of memory");
+
+    while (1) {
+        node = &tape->nodes[(*pos)++];
+
+        switch (node->type) {
+        case TAPE_NULL:
+            lua_pushlightuserdata(l, NULL);
+            break;
+        case TAPE_FALSE:
+            lua_pushboolean(l, 0);
+            break;
+        case TAPE_TRUE:
+            lua_pushboolean(l, 1);
+            break;
+        case TAPE_NUMBER:
+            lua_pushnumber(l, node->value.number);
+            break;
+        case TAPE_INTEGER:
+            json_push_integer(l, node->value.integer);
+            break;
+        case TAPE_STRING:
+            lua_pushlstring(l, strings + node->value.offset, node->length);
+            break;
+        case TAPE_ARRAY:
+        case TAPE_OBJECT:
+            if (depth >= max_depth || (depth >= reserved_depth &&
+                !lua_checkstack(l, 2 * DECODE_STACK_RESERVE + 1))) {
+                json_return_stack(cfg, stack, max_depth);
+                luaL_error(l, "Too many nested data structures");
+            }
+            if (depth >= reserved_depth)
+                reserved_depth = depth + DECODE_STACK_RESERVE;
+
+            if (node->type == TAPE_ARRAY)
+                lua_createtable(l, node->length, 0);
+            else
+                lua_createtable(l, 0, node->length);
+            tables++;
+
+            if (!node->length)
+                break;
+
+            container = &stack[depth++];
+            container->type = node->type == TAPE_ARRAY ? T_ARR_BEGIN :
+                                                         T_OBJ_BEGIN;
+            container->index = 0;
+            container->length = node->length;
+
+            if (node->type == TAPE_OBJECT) {
+                key = &tape->nodes[(*pos)++];
+                lua_pushlstring(l, strings + key->value.offset, key->length);
+            }
+            continue;
+        }
+
+        /* A complete value is on the top of the Lua stack. Store it in
+         * the enclosing container, and close any containers which end. */
+        while (1) {
+            if (!depth) {
+                json_return_stack(cfg, stack, max_depth);
+                return tables;
+            }
+
+            container = &stack[depth - 1];
+            if (container->type == T_ARR_BEGIN)
+                lua_rawseti(l, -2, ++container->index);
+            else {
+                lua_rawset(l, -3);
+                container->index++;
+            }
+
+            if (container->index == container->length) {
+                depth--;
+                continue;
+            }
+
+            if (container->type == T_OBJ_BEGIN) {
+                key = &tape->nodes[(*pos)++];
+                lua_pushlstring(l, strings + key->value.offset, key->length);
+            }
+            break;
+        }
+    }
+}
+
+/* Parse JSON text onto a new tape. The tape is freed if an error is
+ * raised. */
+static void json_tape_parse_text(lua_State *l, json_config_t *cfg,
+                                 json_tape_t *tape, const char *json_text,
+                                 int json_len)
+{
+    json_parse_t json;
+    json_token_t token;
+    const char *expected;
+
+    json_tape_init(tape, json_len);
+    json_parse_init(&json, cfg, json_text, json_len);
+
+    json_next_token(&json, &token);
+    expected = json_tape_parse_value(&json, tape, &token);
+    if (!expected) {
+        /* Ensure there is no more input left */
+        json_next_token(&json, &token);
+        if (token.type != T_END)
+            expected = json.error = "the end";
+    }
+    if (expected) {
+        json_tape_free(tape);
+        json_throw_event_error(l, &json, &token);
+    }
+
+    json_parse_free(&json);
+    json_decode_stats(cfg, &json, json_len);
+}
+
+/* ===== PARALLEL DECODING ===== */
+
+/* Large top level arrays are split into ranges of elements. Each range
+ * is parsed onto a separate tape by a worker thread, then the calling
+ * thread builds the Lua array from the tapes in order. */
+
+/* Locate top level commas which split the array elements beginning at
+ * data[start] into roughly equal ranges. Only strings and nesting are
+ * tracked here, each range is fully validated when it is parsed.
+ *
+ * Returns the number of split points stored. */
+static int json_split_array(const char *data, int start, int len,
+                            int *splits, int nsplits)
+{
+    int64_t span = len - start;
+    int64_t target;
+    int depth = 0;
+    int found = 0;
+    int i;
+
+    target = start + span / (nsplits + 1);
+    for (i = start; i < len && found < nsplits; i++) {
+        switch (data[i]) {
+        case '"':
+            /* Skip the string, including escaped characters */
+            for (i++; i < len && data[i] != '"'; i++) {
+                if (data[i] == '\\')
+                    i++;
+            }
+            break;
+        case '[':
+        case '{':
+            depth++;
+            break;
+        case ']':
+        case '}':
+            if (--depth < 0)
+                return found;       /* End of the top level array */
+            break;
+        case ',':
+            if (!depth && i >= target) {
+                splits[found++] = i;
+                target = start + span * (found + 1) / (nsplits + 1);
+            }
+            break;
+        }
+    }
+
+    return found;
+}
+
+/* Returned by tape workers when memory could not be allocated */
+static const char json_oom_error[] = "Out of memory";
+
+/* Parse array elements up to the comma at range->end onto range->tape.
+ * The final range (end < 0) must finish the array and the JSON text. */
+static void json_parse_range_elements(json_range_t *range)
+{
+    json_parse_t *json = &range->json;
+    json_token_t token;
+
+    json_next_token(json, &token);
+    while (1) {
+        range->error = json_tape_parse_value(json, &range->tape, &token);
+        if (range->error)
+            return;
+        range->elements++;
+
+        json_next_token(json, &token);
+        if (token.type == T_COMMA && token.index == range->end)
+            return;
+
+        if (token.type == T_ARR_END && range->end < 0) {
+            json_next_token(json, &token);
+            if (token.type != T_END)
+                range->error = "the end";
+            return;
+        }
+
+        if (token.type != T_COMMA) {
+            range->error = "comma or array end";
+            return;
+        }
+
+        json_next_token(json, &token);
+    }
+}
+
+/* Allocation failures are returned as json_oom_error, since exiting
+ * from a worker would take the whole process down */
+static void json_parse_range(json_range_t *range)
+{
+    jmp_buf oom;
+
+    if (setjmp(oom))
+        range->error = json_oom_error;
+    else {
+        strbuf_set_die_jmp(&oom);
+        json_parse_range_elements(range);
+    }
+    strbuf_set_die_jmp(NULL);
+}
+
+#ifndef DISABLE_THREADS
+static void *json_range_thread(void *arg)
+{
+    json_parse_range(arg);
+
+    return NULL;
+}
+#endif
+
+static void json_free_range(json_range_t *range)
+{
+    json_tape_free(&range->tape);
+    if (range->json.tmp) {
+        strbuf_free(range->json.tmp);
+        range->json.tmp = NULL;
+    }
+    free(range->json.stack);
+    range->json.stack = NULL;
+}
+
+static void json_free_ranges(json_ranges_t *ranges)
+{
+    int i;
+
+    for (i = 0; i < ranges->count; i++)
+        json_free_range(&ranges->range[i]);
+}
+
+static int json_destroy_ranges(lua_State *l)
+{
+    json_ranges_t *ranges;
+
+    ranges = lua_touserdata(l, 1);
+    if (ranges)
+        json_free_ranges(ranges);
+
+    return 0;
+}
+
+/* Decode a large top level array using multiple threads.
+ *
+ * Threads are started for each document rather than kept in a pool.
+ * Ranges are at least DECODE_PARALLEL_MIN_RANGE bytes, so thread start
+ * up is small next to the parsing, and no thread is left running code
+ * from this module after Lua unloads it.
+ *
+ * Returns 1 when the array has been pushed onto the Lua stack.
+ * Returns 0 if the JSON text should be decoded serially instead. This
+ * includes invalid JSON, so errors are always reported consistently. */
+static int json_decode_parallel(lua_State *l, json_config_t *cfg,
+                                const char *json_text, int json_len)
+{
+    int splits[DECODE_MAX_THREADS - 1];
+    json_ranges_t *ranges;
+    json_range_t *range;
+    int start, range_start, count, total, pos, i, n;
+
+    /* Find the beginning of the top level array */
+    for (start = 0; cfg->ch2token[(unsigned char)json_text[start]] ==
+                    T_WHITESPACE; start++)
+        ;
+    if (json_text[start] != '[')
+        return 0;
+    start++;
+
+    count = json_len / DECODE_PARALLEL_MIN_RANGE;
+    if (count > cfg->decode_threads)
+        count = cfg->decode_threads;
+    if (count < 2)
+        return 0;
+
+    count = json_split_array(json_text, start, json_len, splits,
+                             count - 1) + 1;
+    if (count < 2)
+        return 0;
+
+    /* Range state is owned by a userdata, so it is released even if
+     * building the Lua array raises an error */
+    ranges = lua_newuserdata(l, sizeof(*ranges) +
+                                (count - 1) * sizeof(ranges->range[0]));
+    memset(ranges, 0, sizeof(*ranges) +
+                      (count - 1) * sizeof(ranges->range[0]));
+    luaL_getmetatable(l, JSON_RANGES_MT);
+    lua_setmetatable(l, -2);
+
+    for (i = 0; i < count; i++) {
+        range = &ranges->range[i];
+        range_start = i ? splits[i - 1] + 1 : start;
+        range->end = i < count - 1 ? splits[i] : -1;
+
+        range->json.cfg = cfg;
+        range->json.data = json_text;
+        range->json.len = json_len;
+        range->json.index = range_start;
+        range->json.tmp = strbuf_new((i < count - 1 ? splits[i] : json_len) -
+                                     range_start);
+        range->json.stack = malloc(cfg->decode_max_depth *
+                                   sizeof(*range->json.stack));
+        if (!range->json.stack)
+            luaL_error(l, "Out of memory");
+        /* Elements are nested within the top level array */
+        range->json.max_depth = cfg->decode_max_depth - 1;
+        json_tape_init(&range->tape, 0);
+        ranges->count = i + 1;
+    }
+
+#ifndef DISABLE_THREADS
+    for (i = 1; i < count; i++) {
+        range = &ranges->range[i];
+        range->started = !pthread_create(&range->thread, NULL,
+                                         json_range_thread, range);
+    }
+#endif
+
+    json_parse_range(&ranges->range[0]);
+
+    for (i = 1; i < count; i++) {
+        range = &ranges->range[i];
+#ifndef DISABLE_THREADS
+        if (range->started) {
+            pthread_join(range->thread, NULL);
+            range->started = 0;
+            continue;
+        }
+#endif
+        /* Unable to start a thread, parse the range here instead */
+        json_parse_range(range);
+    }
+
+    total = 0;
+    for (i = 0; i < count; i++) {
+        if (ranges->range[i].error == json_oom_error) {
+            json_free_ranges(ranges);
+            luaL_error(l, "Out of memory");
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (ranges->range[i].error) {
+            json_free_ranges(ranges);
+            lua_pop(l, 1);
+            return 0;
+        }
+        total += ranges->range[i].elements;
+    }
+
+    lua_createtable(l, total, 0);
+    cfg->stats.decode_documents++;
+    cfg->stats.decode_bytes += json_len;
+    cfg->stats.decode_tables++;
+
+    n = 0;
+    for (i = 0; i < count; i++) {
+        range = &ranges->range[i];
+        pos = 0;
+        while (pos < range->tape.count) {
+            cfg->stats.decode_tables += json_tape_push_value(l, cfg,
+                &range->tape, &pos);
+            lua_rawseti(l, -2, ++n);
+        }
+        cfg->stats.decode_escapes += range->json.escapes;
+        cfg->stats.decode_numbers += range->json.numbers;
+        json_free_range(range);
+    }
+
+    /* Remove the range state */
+    lua_remove(l, -2);
+
+    return 1;
+}
+
+/* ===== ASYNCHRONOUS ENCODING ===== */
+
+/* cjson.encode_async() captures a Lua value onto a tape using the calling
+ * thread. Number formatting, escaping and assembling the JSON text are
+ * performed from the tape by a worker thread.
+ *
+ * Object keys may be TAPE_NUMBER or TAPE_INTEGER nodes on captured
+ * tapes. */
+
+static void json_capture_data(lua_State *l, json_config_t *cfg,
+                              json_tape_t *tape);
+
+static void json_capture_string(lua_State *l, json_config_t *cfg,
+                                json_tape_t *tape, int lindex)
+{
+    const char *str;
+    size_t len;
+
+    str = lua_tolstring(l, lindex, &len);
+
+    if (cfg->encode_refuse_badutf8 && !utf8_validate(str, len))
+        json_encode_exception(l, cfg, lindex, "invalid UTF-8 string");
+
+    json_tape_append_string(tape, str, len);
+}
+
+static void json_capture_number(lua_State *l, json_config_t *cfg,
+                                json_tape_t *tape, int lindex)
+{
+    double num;
+    int n;
+
+#ifdef JSON_INTEGERS
+    if (lua_isinteger(l, lindex)) {
+        n = json_tape_append(tape, TAPE_INTEGER);
+        tape->nodes[n].value.integer = lua_tointeger(l, lindex);
+        return;
+    }
+#endif
+
+    num = lua_tonumber(l, lindex);
+    if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
+        json_encode_exception(l, cfg, lindex, "must not be NaN or Inf");
+
+    n = json_tape_append(tape, TAPE_NUMBER);
+    tape->nodes[n].value.number = num;
+}
+
+static void json_capture_array(lua_State *l, json_config_t *cfg,
+                               json_tape_t *tape, int array_length)
+{
+    int n, i;
+
+    json_encode_descend(l, cfg);
+
+    n = json_tape_append(tape, TAPE_ARRAY);
+    for (i = 1; i <= array_length; i++) {
+        lua_rawgeti(l, -1, i);
+        json_capture_data(l, cfg, tape);
+        lua_pop(l, 1);
+    }
+    tape->nodes[n].length = array_length;
+    tape->nodes[n].value.next = tape->count;
+
+    cfg->current_depth--;
+}
+
+static void json_capture_object(lua_State *l, json_config_t *cfg,
+                                json_tape_t *tape)
+{
+    int n, count, keytype;
+
+    json_encode_descend(l, cfg);
+
+    n = json_tape_append(tape, TAPE_OBJECT);
+    count = 0;
+
+    lua_pushnil(l);
+    /* table, startkey */
+    while (lua_next(l, -2) != 0) {
+        /* table, key, value */
+        keytype = lua_type(l, -2);
+        if (keytype == LUA_TNUMBER) {
+            json_capture_number(l, cfg, tape, -2);
+        } else if (keytype == LUA_TSTRING) {
+            json_capture_string(l, cfg, tape, -2);
+        } else {
+            json_encode_exception(l, cfg, -2,
+                                  "table key must be a number or string");
+            /* never returns */
+        }
+
+        json_capture_data(l, cfg, tape);
+        lua_pop(l, 1);
+        count++;
+        /* table, key */
+    }
+    tape->nodes[n].length = count;
+    tape->nodes[n].value.next = tape->count;
+
+    cfg->current_depth--;
+}
+
+/* Packed arrays are captured as arrays of numbers */
+static void json_capture_packed(lua_State *l, json_config_t *cfg,
+                                json_tape_t *tape, json_packed_t *packed)
+{
+    double num;
+    int n, i;
+
+    n = json_tape_append(tape, TAPE_ARRAY);
+    for (i = 0; i < packed->length; i++) {
+        num = packed->values[i];
+        if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
+            json_encode_exception(l, cfg, -1, "must not be NaN or Inf");
+        tape->nodes[json_tape_append(tape, TAPE_NUMBER)].value.number = num;
+    }
+    tape->nodes[n].length = packed->length;
+    tape->nodes[n].value.next = tape->count;
+}
+
+/* Capture Lua data onto a tape. Follows the same rules and raises the
+ * same errors as json_append_data(). */
+static void json_capture_data(lua_State *l, json_config_t *cfg,
+                              json_tape_t *tape)
+{
+    json_packed_t *packed;
+    int len;
+
+    switch (json_classify(l, cfg, &len, &packed)) {
+    case JSON_CLASS_STRING:
+        json_capture_string(l, cfg, tape, -1);
+        break;
+    case JSON_CLASS_NUMBER:
+        json_capture_number(l, cfg, tape, -1);
+        break;
+    case JSON_CLASS_BOOLEAN:
+        json_tape_append(tape, lua_toboolean(l, -1) ? TAPE_TRUE : TAPE_FALSE);
+        break;
+    case JSON_CLASS_ARRAY:
+        json_capture_array(l, cfg, tape, len);
+        break;
+    case JSON_CLASS_OBJECT:
+        json_capture_object(l, cfg, tape);
+        break;
+    case JSON_CLASS_PACKED:
+        json_capture_packed(l, cfg, tape, packed);
+        break;
+    case JSON_CLASS_NULL:
+        json_tape_append(tape, TAPE_NULL);
+        break;
+    }
+}
+
+/* Serialise the tape value at node *pos into JSON, and advance *pos
+ * past it. Does not use the Lua state. */
+static void json_tape_append_data(strbuf_t *json, json_tape_t *tape,
+                                  int *pos, const char *number_fmt)
+{
+    json_tape_node_t *node = &tape->nodes[(*pos)++];
+    json_tape_node_t *key;
+    int i;
+
+    switch (node->type) {
+    case TAPE_NULL:
+        strbuf_append_mem(json, "null", 4);
+        break;
+    case TAPE_FALSE:
+        strbuf_append_mem(json, "false", 5);
+        break;
+    case TAPE_TRUE:
+        strbuf_append_mem(json, "true", 4);
+        break;
+    case TAPE_NUMBER:
+        strbuf_append_fmt(json, 32, number_fmt, node->value.number);
+        break;
+    case TAPE_INTEGER:
+        json_append_integer(json, node->value.integer);
+        break;
+    case TAPE_STRING:
+        json_append_escaped(json, tape->strings.buf + node->value.offset,
+                            node->length);
+        break;
+    case TAPE_ARRAY:
+        strbuf_append_char(json, '[');
+        for (i = 0; i < node->length; i++) {
+            if (i)
+                strbuf_append_char(json, ',');
+            json_tape_append_data(json, tape, pos, number_fmt);
+        }
+        strbuf_append_char(json, ']');
+        break;
+    case TAPE_OBJECT:
+        strbuf_append_char(json, '{');
+        for (i = 0; i < node->length; i++) {
+            if (i)
+                strbuf_append_char(json, ',');
+            key = &tape->nodes[*pos];
+            if (key->type == TAPE_NUMBER || key->type == TAPE_INTEGER) {
+                strbuf_append_char(json, '"');
+                json_tape_append_data(json, tape, pos, number_fmt);
+                strbuf_append_char(json, '"');
+            } else {
+                json_tape_append_data(json, tape, pos, number_fmt);
+            }
+            strbuf_append_char(json, ':');
+            json_tape_append_data(json, tape, pos, number_fmt);
+        }
+        strbuf_append_char(json, '}');
+        break;
+    }
+}
+
+/* Allocation failures are reported by json_async_join(), since exiting
+ * from a worker would take the whole process down */
+static void json_async_run(json_async_t *async)
+{
+    jmp_buf oom;
+    int pos = 0;
+
+    if (setjmp(oom))
+        async->failed = 1;
+    else {
+        strbuf_set_die_jmp(&oom);
+        json_tape_append_data(&async->output, &async->tape, &pos,
+                              async->number_fmt);
+    }
+    strbuf_set_die_jmp(NULL);
+    json_tape_free(&async->tape);
+
+#ifndef DISABLE_THREADS
+    pthread_mutex_lock(&async->lock);
+    async->done = 1;
+    pthread_mutex_unlock(&async->lock);
+#else
+    async->done = 1;
+#endif
+}
+
+#ifndef DISABLE_THREADS
+static void *json_async_thread(void *arg)
+{
+    json_async_run(arg);
+
+    return NULL;
+}
+#endif
+
+/* Wait for the worker thread to finish */
+static void json_async_wait(json_async_t *async)
+{
+#ifndef DISABLE_THREADS
+    if (async->started) {
+        pthread_join(async->thread, NULL);
+        async->started = 0;
+    }
+#endif
+}
+
+static int json_destroy_async(lua_State *l)
+{
+    json_async_t *async;
+
+    async = lua_touserdata(l, 1);
+    if (async) {
+        json_async_wait(async);
+#ifndef DISABLE_THREADS
+        if (async->lock_init) {
+            pthread_mutex_destroy(&async->lock);
+            async->lock_init = 0;
+        }
+#endif
+        json_tape_free(&async->tape);
+        strbuf_free(&async->output);
+    }
+
+    return 0;
+}
+
+/* Returns true when the JSON text is available without blocking */
+static int json_async_ready(lua_State *l)
+{
+    json_async_t *async;
+    int done;
+
+    async = luaL_checkudata(l, 1, JSON_ASYNC_MT);
+#ifndef DISABLE_THREADS
+    pthread_mutex_lock(&async->lock);
+    done = async->done;
+    pthread_mutex_unlock(&async->lock);
+#else
+    done = async->done;
+#endif
+    lua_pushboolean(l, done);
+
+    return 1;
+}
+
+/* Wait for, and return the JSON text */
+static int json_async_join(lua_State *l)
+{
+    json_async_t *async;
+    char *json;
+    int len;
+
+    async = luaL_checkudata(l, 1, JSON_ASYNC_MT);
+    json_async_wait(async);
+    if (async->failed)
+        luaL_error(l, "Out of memory");
+
+    json = strbuf_string(&async->output, &len);
+    lua_pushlstring(l, json, len);
+
+    return 1;
+}
+
+static int json_encode_async(lua_State *l)
+{
+    json_config_t *cfg;
+    json_async_t *async;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = json_fetch_config(l);
+    cfg->current_depth = 0;
+
+    /* The handle owns the tape, so it is released by the garbage
+     * collector if capturing raises an error */
+    async = lua_newuserdata(l, sizeof(*async));
+    memset(async, 0, sizeof(*async));
+    luaL_getmetatable(l, JSON_ASYNC_MT);
+    lua_setmetatable(l, -2);
+
+    json_tape_init(&async->tape, 0);
+    strbuf_init(&async->output, 0);
+    strcpy(async->number_fmt, cfg->number_fmt);
+#ifndef DISABLE_THREADS
+    pthread_mutex_init(&async->lock, NULL);
+    async->lock_init = 1;
+#endif
+
+    /* value, handle */
+    lua_pushvalue(l, 1);
+    json_capture_data(l, cfg, &async->tape);
+    lua_pop(l, 1);
+
+#ifndef DISABLE_THREADS
+    async->started = !pthread_create(&async->thread, NULL,
+                                     json_async_thread, async);
+    if (!async->started)
+#endif
+        json_async_run(async);
+
+    return 1;
+}
+
+/* ===== SHARED DOCUMENTS ===== */
+
+/* Shared documents are parsed once onto a tape and registered by name
+ * in a process wide list. Any Lua state, in any thread, can open a
+ * registered document and read it through proxy userdata. Values are
+ * only converted to Lua types when they are accessed.
+ *
+ * Documents are never modified once registered. Each proxy holds a
+ * reference, and a document is freed when its last proxy is collected.
+ * json_shared_mutex protects the list and all reference counts. */
+
+static json_shared_doc_t *json_shared_docs;
+
+#ifndef DISABLE_THREADS
+static pthread_mutex_t json_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void json_shared_lock(void)
+{
+#ifndef DISABLE_THREADS
+    pthread_mutex_lock(&json_shared_mutex);
+#endif
+}
+
+static void json_shared_unlock(void)
+{
+#ifndef DISABLE_THREADS
+    pthread_mutex_unlock(&json_shared_mutex);
+#endif
+}
+
+/* Return the index of the node following the value at node n */
+static int json_tape_skip(json_tape_t *tape, int n)
+{
+    if (tape->nodes[n].type == TAPE_ARRAY ||
+        tape->nodes[n].type == TAPE_OBJECT)
+        return tape->nodes[n].value.next;
+
+    return n + 1;
+}
+
+/* Order object keys for binary search. Duplicate keys are kept in
+ * document order. */
+static int json_shared_compare_keys(const void *a, const void *b)
+{
+    const json_sorted_key_t *x = a;
+    const json_sorted_key_t *y = b;
+    int cmp;
+
+    cmp = json_compare_keys(a, b);
+    if (cmp)
+        return cmp;
+
+    return x->index < y->index ? -1 : 1;
+}
+
+/* Record the child nodes of every array and object, so elements can
+ * be found without walking the tape. Object keys are sorted so they can
+ * be found by binary search. */
+static void json_shared_build_index(json_shared_doc_t *doc)
+{
+    json_tape_t *tape = &doc->tape;
+    json_tape_node_t *node;
+    json_sorted_key_t *keys;
+    int total, max_keys, slot, child, n, i;
+
+    total = 0;
+    max_keys = 0;
+    for (n = 0; n < tape->count; n++) {
+        node = &tape->nodes[n];
+        if (node->type == TAPE_ARRAY || node->type == TAPE_OBJECT)
+            total += node->length;
+        if (node->type == TAPE_OBJECT && node->length > max_keys)
+            max_keys = node->length;
+    }
+
+    doc->first = malloc(tape->count * sizeof(*doc->first));
+    doc->children = malloc((total + 1) * sizeof(*doc->children));
+    keys = malloc((max_keys + 1) * sizeof(*keys));
+    if (!doc->first || !doc->children || !keys)
+        die("Out of memory");
+
+    slot = 0;
+    for (n = 0; n < tape->count; n++) {
+        node = &tape->nodes[n];
+        if (node->type != TAPE_ARRAY && node->type != TAPE_OBJECT)
+            continue;
+
+        doc->first[n] = slot;
+        child = n + 1;
+        for (i = 0; i < node->length; i++) {
+            if (node->type == TAPE_OBJECT) {
+                keys[i].str = tape->strings.buf +
+                              tape->nodes[child].value.offset;
+                keys[i].len = tape->nodes[child].length;
+                keys[i].index = child;
+                keys[i].number = 0;
+                child++;        /* Skip the key */
+            } else {
+                doc->children[slot + i] = child;
+            }
+            child = json_tape_skip(tape, child);
+        }
+
+        if (node->type == TAPE_OBJECT) {
+            qsort(keys, node->length, sizeof(*keys),
+                  json_shared_compare_keys);
+            for (i = 0; i < node->length; i++)
+                doc->children[slot + i] = keys[i].index;
+        }
+        slot += node->length;
+    }
+
+    free(keys);
+}
+
+static void json_shared_free(json_shared_doc_t *doc)
+{
+    json_tape_free(&doc->tape);
+    free(doc->first);
+    free(doc->children);
+    free(doc->name);
+    free(doc);
+}
+
+/* The registry lock must be held */
+static json_shared_doc_t *json_shared_find(const char *name, size_t len)
+{
+    json_shared_doc_t *doc;
+
+    for (doc = json_shared_docs; doc; doc = doc->next) {
+        if (doc->name_len == len && !memcmp(doc->name, name, len))
+            return doc;
+    }
+
+    return NULL;
+}
+
+/* Drop a reference, and free the document once it is unused.
+ * Unnamed documents are not registered. */
+static void json_shared_release(json_shared_doc_t *doc)
+{
+    json_shared_doc_t **prev;
+    int unused;
+
+    json_shared_lock();
+    unused = !--doc->refcount;
+    if (unused && doc->name) {
+        for (prev = &json_shared_docs; *prev != doc; prev = &(*prev)->next)
+            ;
+        *prev = doc->next;
+    }
+    json_shared_unlock();
+
+    if (unused)
+        json_shared_free(doc);
+}
+
+/* Create an unnamed document which owns the tape */
+static json_shared_doc_t *json_shared_new_doc(lua_State *l, json_tape_t *tape)
+{
+    json_shared_doc_t *doc;
+
+    doc = calloc(1, sizeof(*doc));
+    if (!doc) {
+        json_tape_free(tape);
+        luaL_error(l, "Out of memory");
+    }
+    doc->tape = *tape;
+
+    json_shared_build_index(doc);
+
+    return doc;
+}
+
+/* Parse JSON text into a new unregistered document */
+static json_shared_doc_t *json_shared_parse(lua_State *l, json_config_t *cfg,
+                                            const char *name, size_t name_len,
+                                            const char *json_text, int json_len)
+{
+    json_shared_doc_t *doc;
+    json_tape_t tape;
+
+    json_tape_parse_text(l, cfg, &tape, json_text, json_len);
+
+    if (tape.nodes[0].type != TAPE_ARRAY && tape.nodes[0].type != TAPE_OBJECT) {
+        json_tape_free(&tape);
+        luaL_error(l, "Shared JSON must be an array or object");
+    }
+
+    doc = json_shared_new_doc(l, &tape);
+
+    doc->name = malloc(name_len + 1);
+    if (!doc->name)
+        die("Out of memory");
+    memcpy(doc->name, name, name_len);
+    doc->name[name_len] = 0;
+    doc->name_len = name_len;
+
+    return doc;
+}
+
+/* Push a proxy without a document. The caller must set proxy->doc
+ * after taking a reference. */
+static json_shared_t *json_shared_new_proxy(lua_State *l)
+{
+    json_shared_t *proxy;
+
+    proxy = lua_newuserdata(l, sizeof(*proxy));
+    proxy->doc = NULL;
+    proxy->node = 0;
+    luaL_getmetatable(l, JSON_SHARED_MT);
+    lua_setmetatable(l, -2);
+
+    return proxy;
+}
+
+/* Push the value at node n. Arrays and objects are pushed as proxies. */
+static void json_shared_push_value(lua_State *l, json_shared_doc_t *doc,
+                                   int n)
+{
+    json_tape_node_t *node = &doc->tape.nodes[n];
+    json_shared_t *proxy;
+
+    switch (node->type) {
+    case TAPE_NULL:
+        lua_pushlightuserdata(l, NULL);
+        break;
+    case TAPE_FALSE:
+        lua_pushboolean(l, 0);
+        break;
+    case TAPE_TRUE:
+        lua_pushboolean(l, 1);
+        break;
+    case TAPE_NUMBER:
+        lua_pushnumber(l, node->value.number);
+        break;
+    case TAPE_INTEGER:
+        json_push_integer(l, node->value.integer);
+        break;
+    case TAPE_STRING:
+        lua_pushlstring(l, doc->tape.strings.buf + node->value.offset,
+                        node->length);
+        break;
+    case TAPE_ARRAY:
+    case TAPE_OBJECT:
+        proxy = json_shared_new_proxy(l);
+        json_shared_lock();
+        doc->refcount++;
+        json_shared_unlock();
+        proxy->doc = doc;
+        proxy->node = n;
+        break;
+    }
+}
+
+static int json_shared_index(lua_State *l)
+{
+    json_shared_t *proxy;
+    json_tape_node_t *node;
+    json_sorted_key_t name, key;
+    const int *children;
+    double num;
+    int i, low, high;
+
+    proxy = luaL_checkudata(l, 1, JSON_SHARED_MT);
+    node = &proxy->doc->tape.nodes[proxy->node];
+    children = proxy->doc->children + proxy->doc->first[proxy->node];
+
+    if (node->type == TAPE_ARRAY) {
+        if (lua_type(l, 2) == LUA_TNUMBER) {
+            num = lua_tonumber(l, 2);
+            i = (int)num;
+            if (i == num && 1 <= i && i <= node->length) {
+                json_shared_push_value(l, proxy->doc, children[i - 1]);
+                return 1;
+            }
+        }
+    } else if (lua_type(l, 2) == LUA_TSTRING) {
+        name.str = lua_tolstring(l, 2, &name.len);
+        name.number = 0;
+        key.number = 0;
+
+        /* Find the last key <= name. When a key is repeated, the last
+         * value wins, as with cjson.decode(). */
+        low = 0;
+        high = node->length;
+        while (low < high) {
+            i = low + (high - low) / 2;
+            key.str = proxy->doc->tape.strings.buf +
+                      proxy->doc->tape.nodes[children[i]].value.offset;
+            key.len = proxy->doc->tape.nodes[children[i]].length;
+            if (json_compare_keys(&key, &name) <= 0)
+                low = i + 1;
+            else
+                high = i;
+        }
+        if (low) {
+            i = children[low - 1];
+            key.str = proxy->doc->tape.strings.buf +
+                      proxy->doc->tape.nodes[i].value.offset;
+            key.len = proxy->doc->tape.nodes[i].length;
+            if (!json_compare_keys(&key, &name)) {
+                json_shared_push_value(l, proxy->doc, i + 1);
+                return 1;
+            }
+        }
+    }
+
+    lua_pushnil(l);
+
+    return 1;
+}
+
+/* Returns the number of array elements, or object key/value pairs */
+static int json_shared_len(lua_State *l)
+{
+    json_shared_t *proxy;
+
+    proxy = luaL_checkudata(l, 1, JSON_SHARED_MT);
+    lua_pushinteger(l, proxy->doc->tape.nodes[proxy->node].length);
+
+    return 1;
+}
+
+static int json_destroy_shared(lua_State *l)
+{
+    json_shared_t *proxy;
+
+    proxy = lua_touserdata(l, 1);
+    if (proxy && proxy->doc) {
+        json_shared_release(proxy->doc);
+        proxy->doc = NULL;
+    }
+
+    return 0;
+}
+
+/* Open the shared document "name". If it has not been registered, the
+ * optional JSON text is parsed and registered under that name.
+ *
+ * Returns a proxy for the top level array or object, or nil when the
+ * document does not exist and no JSON text was provided. */
+static int json_shared(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_shared_doc_t *doc, *parsed;
+    json_shared_t *proxy;
+    const char *name, *json_text;
+    size_t name_len, json_len;
+
+    json_verify_arg_count(l, 2);
+
+    name = luaL_checklstring(l, 1, &name_len);
+    json_text = luaL_optlstring(l, 2, NULL, &json_len);
+    if (json_text)
+        json_check_encoding(l, json_text, json_len);
+
+    proxy = json_shared_new_proxy(l);
+
+    json_shared_lock();
+    doc = json_shared_find(name, name_len);
+    if (doc)
+        doc->refcount++;
+    json_shared_unlock();
+
+    if (!doc) {
+        if (!json_text) {
+            lua_pushnil(l);
+            return 1;
+        }
+
+        parsed = json_shared_parse(l, cfg, name, name_len, json_text,
+                                   json_len);
+
+        /* Another Lua state may have registered the document while it
+         * was being parsed. Use the registered copy if so. */
+        json_shared_lock();
+        doc = json_shared_find(name, name_len);
+        if (doc) {
+            doc->refcount++;
+        } else {
+            doc = parsed;
+            doc->refcount = 1;
+            doc->next = json_shared_docs;
+            json_shared_docs = doc;
+            parsed = NULL;
+        }
+        json_shared_unlock();
+
+        if (parsed)
+            json_shared_free(parsed);
+    }
+
+    proxy->doc = doc;
+
+    return 1;
+}
+
+/* Copy a shared array or object into Lua tables */
+static int json_shared_copy(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_shared_t *proxy;
+    int pos;
+
+    json_verify_arg_count(l, 1);
+
+    proxy = luaL_checkudata(l, 1, JSON_SHARED_MT);
+    pos = proxy->node;
+    cfg->stats.decode_tables += json_tape_push_value(l, cfg,
+                                                     &proxy->doc->tape, &pos);
+
+    return 1;
+}
+
+/* ===== DECODE CACHE ===== */
+
+/* cjson.decode_cached() keeps the documents for recently decoded JSON
+ * text in a small LRU cache for each configuration. Entries are found
+ * by a 64 bit hash of the text, and the text is compared before a
+ * document is reused.
+ *
+ * Documents are unnamed shared documents, so every call returns a
+ * read-only proxy instead of building new tables. The cache holds one
+ * reference to each document. Proxies keep evicted documents alive. */
+
+static void json_decode_cache_free(json_config_t *cfg)
+{
+    int i;
+
+    for (i = 0; i < cfg->decode_cache_count; i++) {
+        json_shared_release(cfg->decode_cache[i].doc);
+        free(cfg->decode_cache[i].text);
+    }
+    free(cfg->decode_cache);
+
+    cfg->decode_cache = NULL;
+    cfg->decode_cache_count = 0;
+}
+
+/* Return the entry to replace with a new document: an unused entry, or
+ * the least recently used. Returns NULL when it cannot be allocated. */
+static json_cache_entry_t *json_decode_cache_slot(json_config_t *cfg)
+{
+    json_cache_entry_t *entry;
+    int i;
+
+    if (!cfg->decode_cache) {
+        cfg->decode_cache = malloc(cfg->decode_cache_size *
+                                   sizeof(*cfg->decode_cache));
+        if (!cfg->decode_cache)
+            return NULL;
+    }
+
+    if (cfg->decode_cache_count < cfg->decode_cache_size)
+        return &cfg->decode_cache[cfg->decode_cache_count++];
+
+    entry = cfg->decode_cache;
+    for (i = 1; i < cfg->decode_cache_count; i++) {
+        if (cfg->decode_cache[i].used < entry->used)
+            entry = &cfg->decode_cache[i];
+    }
+    json_shared_release(entry->doc);
+    free(entry->text);
+
+    return entry;
+}
+
+/* Decode JSON text, reusing the document from an earlier call with the
+ * same text. Arrays and objects are returned as read-only proxies. */
+static int json_decode_cached(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_cache_entry_t *entry;
+    json_shared_doc_t *doc;
+    json_tape_t tape;
+    const char *json_text;
+    size_t json_len;
+    uint64_t hash;
+    char *text;
+    int i;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    json_text = luaL_checklstring(l, 1, &json_len);
+    hash = json_hash64(json_text, json_len, 0);
+
+    for (i = 0; i < cfg->decode_cache_count; i++) {
+        entry = &cfg->decode_cache[i];
+        if (entry->hash == hash && entry->len == json_len &&
+            !memcmp(entry->text, json_text, json_len)) {
+            entry->used = ++cfg->decode_cache_tick;
+            cfg->stats.decode_cache_hits++;
+            json_shared_push_value(l, entry->doc, 0);
+            return 1;
+        }
+    }
+
+    cfg->stats.decode_cache_misses++;
+
+    json_check_encoding(l, json_text, json_len);
+    json_tape_parse_text(l, cfg, &tape, json_text, json_len);
+    doc = json_shared_new_doc(l, &tape);
+    doc->refcount = 1;
+    json_shared_push_value(l, doc, 0);
+
+    /* The reference is kept by the cache when there is room for it */
+    entry = NULL;
+    text = cfg->decode_cache_size ? malloc(json_len + 1) : NULL;
+    if (text)
+        entry = json_decode_cache_slot(cfg);
+    if (!entry) {
+        free(text);
+        json_shared_release(doc);
+        return 1;
+    }
+
+    memcpy(text, json_text, json_len);
+    entry->hash = hash;
+    entry->len = json_len;
+    entry->text = text;
+    entry->doc = doc;
+    entry->used = ++cfg->decode_cache_tick;
+
+    return 1;
+}
+
+/* ===== DECODE TEMPLATES ===== */
+
+/* cjson.template() compiles a Lua table describing the expected shape
+ * of documents. A table with a [1] element describes an array of that
+ * element, and any other table describes an object with those keys.
+ * Other values are placeholders for any value.
+ *
+ * cjson.decode_with() creates the tables matching the template with
+ * their expected size. Known keys are compared bytewise, and pushed from
+ * the template's key table without hashing them again. Other keys and
+ * values are decoded the same as cjson.decode(). */
+
+/* Count the nodes and fields of the shape at the top of the stack.
+ * Cycles are caught by the depth limit. */
+static void json_template_count(lua_State *l, int depth, int max_depth,
+                                int *nodes, int *fields)
+{
+    if (depth > max_depth || !lua_checkstack(l, 3))
+        luaL_error(l, "Template is too deeply nested");
+
+    (*nodes)++;
+
+    lua_rawgeti(l, -1, 1);
+    if (!lua_isnil(l, -1)) {
+        if (lua_istable(l, -1))
+            json_template_count(l, depth + 1, max_depth, nodes, fields);
+        lua_pop(l, 1);
+        return;
+    }
+    lua_pop(l, 1);
+
+    lua_pushnil(l);
+    while (lua_next(l, -2)) {
+        if (lua_type(l, -2) != LUA_TSTRING)
+            luaL_error(l, "Template object keys must be strings");
+        (*fields)++;
+        if (lua_istable(l, -1))
+            json_template_count(l, depth + 1, max_depth, nodes, fields);
+        lua_pop(l, 1);
+    }
+}
+
+/* Fill in the nodes for the shape at the top of the stack, and store
+ * each key in the key table at index "keys". The fields of each object
+ * are contiguous. Returns the node index. */
+static int json_template_fill(lua_State *l, json_template_t *tmpl, int keys)
+{
+    json_template_node_t *node;
+    json_template_field_t *field;
+    int index, i;
+
+    index = tmpl->node_count++;
+    node = &tmpl->nodes[index];
+
+    lua_rawgeti(l, -1, 1);
+    if (!lua_isnil(l, -1)) {
+        node->type = T_ARR_BEGIN;
+        node->size = lua_objlen(l, -2);
+        node->element = -1;
+        if (lua_istable(l, -1))
+            node->element = json_template_fill(l, tmpl, keys);
+        lua_pop(l, 1);
+        return index;
+    }
+    lua_pop(l, 1);
+
+    node->type = T_OBJ_BEGIN;
+    node->element = -1;
+    lua_pushnil(l);
+    while (lua_next(l, -2)) {
+        node->size++;
+        lua_pop(l, 1);
+    }
+    node->fields = tmpl->field_count;
+    tmpl->field_count += node->size;
+
+    i = node->fields;
+    lua_pushnil(l);
+    while (lua_next(l, -2)) {
+        field = &tmpl->fields[i];
+        lua_pushvalue(l, -2);
+        lua_rawseti(l, keys, i + 1);
+        field->key = lua_tolstring(l, -2, &field->key_len);
+        field->node = -1;
+        if (lua_istable(l, -1))
+            field->node = json_template_fill(l, tmpl, keys);
+        lua_pop(l, 1);
+        i++;
+    }
+
+    return index;
+}
+
+/* Push a template compiled from the shape at stack index "index" */
+static json_template_t *json_new_template(lua_State *l, json_config_t *cfg,
+                                          int index)
+{
+    json_template_t *tmpl;
+    int nodes = 0, fields = 0;
+    size_t size;
+
+    lua_pushvalue(l, index);
+    json_template_count(l, 1, cfg->decode_max_depth, &nodes, &fields);
+    lua_pop(l, 1);
+
+    size = sizeof(*tmpl) + fields * sizeof(tmpl->fields[0]) +
+           nodes * sizeof(tmpl->nodes[0]);
+    tmpl = lua_newuserdata(l, size);
+    memset(tmpl, 0, size);
+    tmpl->ref = LUA_NOREF;
+    tmpl->fields = (json_template_field_t *)(tmpl + 1);
+    tmpl->nodes = (json_template_node_t *)(tmpl->fields + fields);
+    luaL_getmetatable(l, JSON_TEMPLATE_MT);
+    lua_setmetatable(l, -2);
+
+    lua_createtable(l, fields, 0);
+    lua_pushvalue(l, index);
+    json_template_fill(l, tmpl, lua_gettop(l) - 1);
+    lua_pop(l, 1);
+    tmpl->ref = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    return tmpl;
+}
+
+static int json_destroy_template(lua_State *l)
+{
+    json_template_t *tmpl;
+
+    tmpl = lua_touserdata(l, 1);
+    if (tmpl) {
+        luaL_unref(l, LUA_REGISTRYINDEX, tmpl->ref);
+        tmpl->ref = LUA_NOREF;
+    }
+
+    return 0;
+}
+
+static int json_template(lua_State *l)
+{
+    json_verify_arg_count(l, 1);
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    json_new_template(l, json_fetch_config(l), 1);
+
+    return 1;
+}
+
+/* Decode JSON text using a template from cjson.template(). A shape
+ * table is compiled for this call only. */
+static int json_decode_with(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_template_t *tmpl;
+    json_parse_t json;
+    json_token_t token;
+    const char *json_text;
+    size_t json_len;
+
+    json_verify_arg_count(l, 2);
+    json_text = luaL_checklstring(l, 1, &json_len);
+    if (lua_istable(l, 2)) {
+        json_new_template(l, cfg, 2);
+        lua_replace(l, 2);
+    }
+    tmpl = luaL_checkudata(l, 2, JSON_TEMPLATE_MT);
+    json_check_encoding(l, json_text, json_len);
+
+    lua_settop(l, 2);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, tmpl->ref);
+
+    json_parse_init(&json, cfg, json_text, json_len);
+    json.tmpl = tmpl;
+    json.tmpl_keys = 3;
+    json.next_node = 0;
+
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    /* Ensure there is no more input left */
+    json_next_token(&json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    json_parse_free(&json);
+    json_decode_stats(cfg, &json, json_len);
+
+    return 1;
+}
+
+/* ===== TIME SLICED CODING ===== */
+
+/* cjson.decoder() and cjson.encoder() return objects which convert a
+ * value in steps. Each call to step() processes roughly "budget" bytes
+ * of JSON text, so a large document can be converted between other
+ * work (Eg, by a coroutine which yields after each step).
+ *
+ * Lua values are kept in a state table referenced from the registry:
+ *   [1] input, [2] configuration, [3] decoded result
+ *   Decoder: [3 + depth] open table
+ *   Encoder: [2 + 2 * depth] open table, [3 + 2 * depth] previous key */
+
+/* Raise the error for JSON_EVENT_ERROR */
+static void json_step_event_error(lua_State *l, json_step_t *step,
+                                  json_token_t *token)
+{
+    json_parse_t json = step->json;
+
+    /* json_throw_event_error() frees the temporary buffer */
+    step->json.tmp = NULL;
+    json_throw_event_error(l, &json, token);
+}
+
+/* Finish decoding when the top level value is complete */
+static void json_decode_step_end(lua_State *l, json_step_t *step)
+{
+    json_token_t token;
+
+    /* Ensure there is no more input left */
+    json_next_token(&step->json, &token);
+    if (token.type != T_END) {
+        step->json.error = "the end";
+        json_step_event_error(l, step, &token);
+    }
+
+    strbuf_free(step->json.tmp);
+    step->json.tmp = NULL;
+    step->status = STEP_DONE;
+    json_decode_stats(step->cfg, &step->json, step->json_len);
+
+    /* Release the JSON text */
+    lua_pushnil(l);
+    lua_rawseti(l, 3, 1);
+}
+
+/* Lua stack: [1] step, [2] budget, [3] state table
+ *
+ * Events are read from json_next_event() until the budget of JSON text
+ * is used. Only the value being stored is kept on the Lua stack, so the
+ * decoder can stop after any value. */
+static void json_decode_step(lua_State *l, json_step_t *step, int budget)
+{
+    json_parse_t *json = &step->json;
+    json_container_t *container;
+    json_event_t event;
+    json_token_t token;
+    int limit, parent;
+
+    if (budget >= step->json_len - json->index)
+        limit = step->json_len + 1;
+    else
+        limit = json->index + budget;
+
+    while (json->index < limit) {
+        /* Keys are stored with their value, so fetch both */
+        event = json_next_event(json, &token);
+        if (event == JSON_EVENT_KEY) {
+            lua_pushlstring(l, token.value.string, token.string_len);
+            event = json_next_event(json, &token);
+        }
+
+        switch (event) {
+        case JSON_EVENT_VALUE:
+            switch (token.type) {
+            case T_STRING:
+                lua_pushlstring(l, token.value.string, token.string_len);
+                break;
+            case T_NUMBER:
+                json_push_number(l, &token);
+                break;
+            case T_BOOLEAN:
+                lua_pushboolean(l, token.value.boolean);
+                break;
+            default:
+                /* In Lua, setting "t[k] = nil" will delete k from the
+                 * table. Hence a NULL pointer lightuserdata object is
+                 * used instead */
+                lua_pushlightuserdata(l, NULL);
+                break;
+            }
+            parent = json->depth;
+            break;
+        case JSON_EVENT_OPEN:
+            lua_newtable(l);
+            json->tables++;
+            lua_pushvalue(l, -1);
+            lua_rawseti(l, 3, 3 + json->depth);
+            parent = json->depth - 1;
+            break;
+        case JSON_EVENT_CLOSE:
+            lua_pushnil(l);
+            lua_rawseti(l, 3, 3 + json->depth + 1);
+            if (!json->depth) {
+                json_decode_step_end(l, step);
+                return;
+            }
+            continue;
+        default:
+            json_step_event_error(l, step, &token);
+            return;     /* never returns */
+        }
+
+        /* Store the value in the enclosing container */
+        if (parent) {
+            container = &json->stack[parent - 1];
+            lua_rawgeti(l, 3, 3 + parent);
+            if (container->type == T_ARR_BEGIN) {
+                lua_insert(l, -2);
+                lua_rawseti(l, -2, ++container->index);
+            } else {
+                lua_insert(l, -3);
+                lua_rawset(l, -3);
+            }
+            lua_pop(l, 1);
+        } else {
+            lua_rawseti(l, 3, 3);
+        }
+
+        if (!json->depth) {
+            json_decode_step_end(l, step);
+            return;
+        }
+    }
+}
+
+/* Lua stack: [1] step, [2] budget, [3] state table */
+static void json_encode_step(lua_State *l, json_step_t *step, int budget)
+{
+    json_config_t *cfg = step->cfg;
+    json_container_t *container;
+    int limit, len, keytype, closed;
+
+    len = strbuf_length(&step->output);
+    if (budget > INT_MAX - len)
+        limit = INT_MAX;
+    else
+        limit = len + budget;
+
+    while (strbuf_length(&step->output) < limit) {
+        if (!step->started) {
+            lua_rawgeti(l, 3, 1);
+            step->started = 1;
+        } else {
+            if (!step->depth)
+                break;
+
+            container = &step->stack[step->depth - 1];
+            lua_rawgeti(l, 3, 2 + 2 * step->depth);
+            closed = 0;
+            if (container->type == T_ARR_BEGIN) {
+                if (container->index < container->length) {
+                    if (container->index)
+                        strbuf_append_char(&step->output, ',');
+                    lua_rawgeti(l, -1, ++container->index);
+                    lua_remove(l, -2);
+                } else {
+                    closed = 1;
+                }
+            } else {
+                lua_rawgeti(l, 3, 3 + 2 * step->depth);
+                if (lua_next(l, -2)) {
+                    /* table, key, value */
+                    lua_pushvalue(l, -2);
+                    lua_rawseti(l, 3, 3 + 2 * step->depth);
+                    if (container->index++)
+                        strbuf_append_char(&step->output, ',');
+
+                    keytype = lua_type(l, -2);
+                    if (keytype == LUA_TNUMBER) {
+                        strbuf_append_char(&step->output, '"');
+                        json_append_number(l, &step->output, -2, cfg);
+                        strbuf_append_mem(&step->output, "\":", 2);
+                    } else if (keytype == LUA_TSTRING) {
+                        json_append_string(l, cfg, &step->output, -2);
+                        strbuf_append_char(&step->output, ':');
+                    } else {
+                        json_encode_exception(l, cfg, -2,
+                            "table key must be a number or string");
+                        /* never returns */
+                    }
+                    lua_insert(l, -3);
+                    lua_pop(l, 2);
+                } else {
+                    closed = 1;
+                }
+            }
+
+            if (closed) {
+                lua_pop(l, 1);
+                strbuf_append_char(&step->output,
+                    container->type == T_ARR_BEGIN ? ']' : '}');
+                lua_pushnil(l);
+                lua_rawseti(l, 3, 2 + 2 * step->depth);
+                lua_pushnil(l);
+                lua_rawseti(l, 3, 3 + 2 * step->depth);
+                step->depth--;
+                continue;
+            }
+        }
+
+        /* Append the value on the top of the stack */
+        if (lua_type(l, -1) != LUA_TTABLE) {
+            json_append_data(l, cfg, &step->output);
+            lua_pop(l, 1);
+            continue;
+        }
+
+        if (step->depth >= step->max_depth) {
+            luaL_error(l, "Cannot serialise, excessive nesting (%d)",
+                       step->depth + 1);
+        }
+
+        len = lua_array_length(l, cfg);
+        container = &step->stack[step->depth++];
+        container->index = 0;
+        if (len > 0) {
+            container->type = T_ARR_BEGIN;
+            container->length = len;
+            strbuf_append_char(&step->output, '[');
+        } else {
+            container->type = T_OBJ_BEGIN;
+            container->length = 0;
+            strbuf_append_char(&step->output, '{');
+        }
+        lua_rawseti(l, 3, 2 + 2 * step->depth);
+    }
+
+    if (step->started && !step->depth) {
+        step->status = STEP_DONE;
+        cfg->stats.encode_documents++;
+        cfg->stats.encode_bytes += strbuf_length(&step->output);
+    }
+}
+
+/* Convert up to "budget" bytes of JSON text.
+ * Returns true and the result when complete. Otherwise returns false. */
+static int json_step(lua_State *l)
+{
+    json_step_t *step;
+    char *json;
+    int budget, len;
+
+    step = luaL_checkudata(l, 1, JSON_STEP_MT);
+    budget = luaL_checkinteger(l, 2);
+    luaL_argcheck(l, budget > 0, 2, "expected positive integer");
+    lua_settop(l, 2);
+
+    if (step->status == STEP_FAILED)
+        luaL_error(l, "Cannot resume after an error");
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, step->ref);
+
+    if (step->status != STEP_DONE) {
+        /* Left failed if an error is raised */
+        step->status = STEP_FAILED;
+        if (step->encoding)
+            json_encode_step(l, step, budget);
+        else
+            json_decode_step(l, step, budget);
+        if (step->status != STEP_DONE)
+            step->status = STEP_RUNNING;
+    }
+
+    if (step->status != STEP_DONE) {
+        lua_pushboolean(l, 0);
+        return 1;
+    }
+
+    lua_pushboolean(l, 1);
+    if (step->encoding) {
+        json = strbuf_string(&step->output, &len);
+        lua_pushlstring(l, json, len);
+    } else {
+        lua_rawgeti(l, 3, 3);
+    }
+
+    return 2;
+}
+
+static int json_destroy_step(lua_State *l)
+{
+    json_step_t *step;
+
+    step = lua_touserdata(l, 1);
+    if (step) {
+        luaL_unref(l, LUA_REGISTRYINDEX, step->ref);
+        step->ref = LUA_NOREF;
+        free(step->stack);
+        step->stack = NULL;
+        if (step->json.tmp) {
+            strbuf_free(step->json.tmp);
+            step->json.tmp = NULL;
+        }
+        strbuf_free(&step->output);
+    }
+
+    return 0;
+}
+
+/* Push a new step object holding "input" (stack index 1) and the
+ * configuration */
+static json_step_t *json_new_step(lua_State *l, json_config_t *cfg,
+                                  int encoding)
+{
+    json_step_t *step;
+
+    step = lua_newuserdata(l, sizeof(*step));
+    memset(step, 0, sizeof(*step));
+    step->ref = LUA_NOREF;
+    luaL_getmetatable(l, JSON_STEP_MT);
+    lua_setmetatable(l, -2);
+
+    step->cfg = cfg;
+    step->encoding = encoding;
+    step->max_depth = encoding ? cfg->encode_max_depth :
+                                 cfg->decode_max_depth;
+    step->stack = malloc(step->max_depth * sizeof(*step->stack));
+    if (!step->stack)
+        luaL_error(l, "Out of memory");
+
+    lua_createtable(l, 3, 0);
+    lua_pushvalue(l, 1);
+    lua_rawseti(l, -2, 1);
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_rawseti(l, -2, 2);
+    step->ref = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    return step;
+}
+
+static int json_decoder(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_step_t *step;
+    const char *json;
+    size_t len;
+
+    json_verify_arg_count(l, 1);
+
+    json = luaL_checklstring(l, 1, &len);
+    json_check_encoding(l, json, len);
+
+    step = json_new_step(l, cfg, 0);
+    json_parse_init_with(&step->json, cfg, json, len, step->stack, NULL);
+    step->json_len = len;
+
+    return 1;
+}
+
+static int json_encoder(lua_State *l)
+{
+    json_config_t *cfg;
+    json_step_t *step;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = json_fetch_config(l);
+    cfg->encode_canonical = 0;
+    step = json_new_step(l, cfg, 1);
+    strbuf_init(&step->output, 0);
+
+    return 1;
+}
+
+/* ===== BINARY TAPE ===== */
+
+/* cjson.to_tape() stores a parsed document as a binary string, which
+ * cjson.from_tape() converts into Lua values without tokenising.
+ *
+ * Format (integers are unsigned little endian):
+ *   "CJSONTP" (7 bytes), version (1 byte)
+ *   node count (4 bytes), string bytes (4 bytes)
+ *   nodes: type (1 byte), followed by
+ *          Number: IEEE 754 double (8 bytes)
+ *          String: length (4 bytes)
+ *          Array/Object: elements or key/value pairs (4 bytes)
+ *   unescaped strings, concatenated in node order */
+
+#define TAPE_MAGIC "CJSONTP"
+#define TAPE_MAGIC_LEN 7
+#define TAPE_VERSION 2            /* Version 2 added TAPE_INTEGER */
+#define TAPE_HEADER_LEN (TAPE_MAGIC_LEN + 1 + 4 + 4)
+
+static void json_append_u32(strbuf_t *s, uint32_t val)
+{
+    char buf[4];
+
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+    strbuf_append_mem(s, buf, 4);
+}
+
+static uint32_t json_get_u32(const unsigned char *buf)
+{
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+           (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static void json_append_double(strbuf_t *s, double num)
+{
+    union { double num; uint64_t bits; } val;
+
+    val.num = num;
+    json_append_u32(s, (uint32_t)val.bits);
+    json_append_u32(s, (uint32_t)(val.bits >> 32));
+}
+
+static double json_get_double(const unsigned char *buf)
+{
+    union { double num; uint64_t bits; } val;
+
+    val.bits = json_get_u32(buf) | (uint64_t)json_get_u32(buf + 4) << 32;
+
+    return val.num;
+}
+
+static int json_to_tape(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_tape_node_t *node;
+    json_tape_t tape;
+    strbuf_t blob;
+    const char *json;
+    char *buf;
+    size_t len;
+    int blob_len, i;
+
+    json_verify_arg_count(l, 1);
+
+    json = luaL_checklstring(l, 1, &len);
+    json_check_encoding(l, json, len);
+
+    json_tape_parse_text(l, cfg, &tape, json, len);
+
+    strbuf_init(&blob, TAPE_HEADER_LEN + tape.count * 5 +
+                       strbuf_length(&tape.strings));
+    strbuf_append_mem(&blob, TAPE_MAGIC, TAPE_MAGIC_LEN);
+    strbuf_append_char(&blob, TAPE_VERSION);
+    json_append_u32(&blob, tape.count);
+    json_append_u32(&blob, strbuf_length(&tape.strings));
+
+    for (i = 0; i < tape.count; i++) {
+        node = &tape.nodes[i];
+        strbuf_append_char(&blob, node->type);
+        switch (node->type) {
+        case TAPE_NUMBER:
+            json_append_double(&blob, node->value.number);
+            break;
+        case TAPE_INTEGER:
+            json_append_u32(&blob, (uint32_t)node->value.integer);
+            json_append_u32(&blob, (uint64_t)node->value.integer >> 32);
+            break;
+        case TAPE_STRING:
+        case TAPE_ARRAY:
+        case TAPE_OBJECT:
+            json_append_u32(&blob, node->length);
+            break;
+        default:
+            break;
+        }
+    }
+    strbuf_append_mem(&blob, tape.strings.buf, strbuf_length(&tape.strings));
+    json_tape_free(&tape);
+
+    buf = strbuf_string(&blob, &blob_len);
+    lua_pushlstring(l, buf, blob_len);
+    strbuf_free(&blob);
+
+    return 1;
+}
+
+/* Returns NULL if the tape holds exactly one value and every object key
+ * is a string. Otherwise returns an error message. */
+static const char *json_tape_validate(json_tape_t *tape,
+                                      json_container_t *stack, int max_depth)
+{
+    json_tape_node_t *node;
+    json_container_t *container;
+    int depth = 0;
+    int pos = 0;
+
+    while (1) {
+        if (pos >= tape->count)
+            return "Invalid JSON tape";
+
+        node = &tape->nodes[pos++];
+        if ((node->type == TAPE_ARRAY || node->type == TAPE_OBJECT) &&
+            node->length) {
+            if (depth >= max_depth)
+                return "Too many nested data structures";
+
+            container = &stack[depth++];
+            container->type = node->type == TAPE_ARRAY ? T_ARR_BEGIN :
+                                                         T_OBJ_BEGIN;
+            container->index = 0;
+            container->length = node->length;
+        } else {
+            /* A complete value. Close any containers which end. */
+            while (1) {
+                if (!depth)
+                    return pos == tape->count ? NULL : "Invalid JSON tape";
+
+                container = &stack[depth - 1];
+                if (++container->index < container->length)
+                    break;
+                depth--;
+            }
+        }
+
+        if (container->type == T_OBJ_BEGIN) {
+            if (pos >= tape->count || tape->nodes[pos].type != TAPE_STRING)
+                return "Invalid JSON tape";
+            pos++;
+        }
+    }
+}
+
+static int json_from_tape(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    const unsigned char *blob, *end;
+    json_container_t *stack;
+    json_tape_node_t *node;
+    json_tape_t tape;
+    const char *error;
+    uint32_t count, strings_len, offset, len;
+    size_t blob_len;
+    int pos, i;
+
+    json_verify_arg_count(l, 1);
+
+    blob = (const unsigned char *)luaL_checklstring(l, 1, &blob_len);
+    end = blob + blob_len;
+
+    if (blob_len < TAPE_HEADER_LEN || memcmp(blob, TAPE_MAGIC, TAPE_MAGIC_LEN))
+        luaL_error(l, "Invalid JSON tape");
+    if (blob[TAPE_MAGIC_LEN] < 1 || blob[TAPE_MAGIC_LEN] > TAPE_VERSION)
+        luaL_error(l, "Unsupported JSON tape version %d", blob[TAPE_MAGIC_LEN]);
+
+    count = json_get_u32(blob + TAPE_MAGIC_LEN + 1);
+    strings_len = json_get_u32(blob + TAPE_MAGIC_LEN + 5);
+    blob += TAPE_HEADER_LEN;
+
+    /* Every node uses at least 1 byte */
+    if (!count || count > blob_len || strings_len > blob_len)
+        luaL_error(l, "Invalid JSON tape");
+
+    /* Nodes are held by a userdata, so they are released by the garbage
+     * collector. Strings are used directly from the blob. */
+    tape.nodes = lua_newuserdata(l, count * sizeof(*tape.nodes));
+    tape.count = tape.size = count;
+    memset(&tape.strings, 0, sizeof(tape.strings));
+    tape.strings.buf = (char *)end - strings_len;
+
+    offset = 0;
+    for (i = 0; i < (int)count; i++) {
+        if (blob >= end)
+            luaL_error(l, "Invalid JSON tape");
+
+        node = &tape.nodes[i];
+        node->type = *blob++;
+        node->length = 0;
+        switch (node->type) {
+        case TAPE_NULL:
+        case TAPE_FALSE:
+        case TAPE_TRUE:
+            break;
+        case TAPE_NUMBER:
+            if (end - blob < 8)
+                luaL_error(l, "Invalid JSON tape");
+            node->value.number = json_get_double(blob);
+            blob += 8;
+            break;
+        case TAPE_INTEGER:
+            if (end - blob < 8)
+                luaL_error(l, "Invalid JSON tape");
+            node->value.integer = (int64_t)(json_get_u32(blob) |
+                                  (uint64_t)json_get_u32(blob + 4) << 32);
+            blob += 8;
+            break;
+        case TAPE_STRING:
+        case TAPE_ARRAY:
+        case TAPE_OBJECT:
+            if (end - blob < 4)
+                luaL_error(l, "Invalid JSON tape");
+            len = json_get_u32(blob);
+            blob += 4;
+            if (node->type == TAPE_STRING) {
+                if (len > strings_len - offset)
+                    luaL_error(l, "Invalid JSON tape");
+                node->value.offset = offset;
+                offset += len;
+            } else if (len >= count) {
+                luaL_error(l, "Invalid JSON tape");
+            }
+            node->length = len;
+            break;
+        default:
+            luaL_error(l, "Invalid JSON tape");
+        }
+    }
+
+    if (offset != strings_len || end - blob != (ptrdiff_t)strings_len)
+        luaL_error(l, "Invalid JSON tape");
+
+    stack = json_take_stack(cfg);
+    if (!stack)
+        luaL_error(l, "Out of memory");
+    error = json_tape_validate(&tape, stack, cfg->decode_max_depth);
+    json_return_stack(cfg, stack, cfg->decode_max_depth);
+    if (error)
+        luaL_error(l, "%s", error);
+
+    pos = 0;
+    cfg->stats.decode_tables += json_tape_push_value(l, cfg, &tape, &pos);
+    cfg->stats.decode_documents++;
+    cfg->stats.decode_bytes += blob_len;
+
+    return 1;
+}
+
+/* ===== MESSAGEPACK ===== */
+
+/* cjson.encode_msgpack() and cjson.decode_msgpack() map Lua values to
+ * MessagePack exactly as cjson.encode() and cjson.decode() map them to
+ * JSON. Tables follow the same sparse array and depth rules, numeric
+ * keys are converted to strings, and nil is decoded as cjson.null.
+ *
+ * Decoding builds a tape and converts it with json_tape_push_value(),
+ * so tables are created with their exact sizes. */
+
+/* Append a type byte followed by a big endian value of "bytes" bytes */
+static void msgpack_append_uint(strbuf_t *s, int tag, uint64_t val, int bytes)
+{
+    char buf[9];
+    int i;
+
+    buf[0] = tag;
+    for (i = bytes; i > 0; i--) {
+        buf[i] = val;
+        val >>= 8;
+    }
+    strbuf_append_mem(s, buf, bytes + 1);
+}
+
+/* Append an array, map or string header. fix_tag is used for counts
+ * below fix_limit, followed by the 8 (str only), 16 and 32 bit tags. */
+static void msgpack_append_header(strbuf_t *s, int fix_tag, uint32_t fix_limit,
+                                  int tag8, int tag16, int tag32, uint32_t n)
 {
-    char utf8[4];       /* Surrogate pairs require 4 UTF-8 bytes */
-    int codepoint;
-    int surrogate_low;
-    int len;
-    int escape_len = 6;
+    if (n < fix_limit)
+        strbuf_append_char(s, fix_tag | n);
+    else if (tag8 && n <= 0xff)
+        msgpack_append_uint(s, tag8, n, 1);
+    else if (n <= 0xffff)
+        msgpack_append_uint(s, tag16, n, 2);
+    else
+        msgpack_append_uint(s, tag32, n, 4);
+}
 
-    /* Fetch UTF-16 code unit */
-    codepoint = decode_hex4(&json->data[json->index + 2]);
-    if (codepoint < 0)
-        return -1;
+static void msgpack_append_str(strbuf_t *s, const char *str, size_t len)
+{
+    msgpack_append_header(s, 0xa0, 32, 0xd9, 0xda, 0xdb, len);
+    strbuf_append_mem(s, str, len);
+}
 
-    /* UTF-16 surrogate pairs take the following 2 byte form:
-     *      11011 x yyyyyyyyyy
-     * When x = 0: y is the high 10 bits of the codepoint
-     *      x = 1: y is the low 10 bits of the codepoint
-     *
-     * Check for a surrogate pair (high or low) */
-    if ((codepoint & 0xF800) == 0xD800) {
-        /* Error if the 1st surrogate is not high */
-        if (codepoint & 0x400)
-            return -1;
+static void msgpack_append_string(lua_State *l, json_config_t *cfg,
+                                  strbuf_t *s, int lindex)
+{
+    const char *str;
+    size_t len;
 
-        /* Ensure the next code is a unicode escape */
-        if (json->data[json->index + escape_len] != '\\' ||
-            json->data[json->index + escape_len + 1] != 'u') {
-            return -1;
-        }
+    str = lua_tolstring(l, lindex, &len);
 
-        /* Fetch the next codepoint */
-        surrogate_low = decode_hex4(&json->data[json->index + 2 + escape_len]);
-        if (surrogate_low < 0)
-            return -1;
+    if (cfg->encode_refuse_badutf8 && !utf8_validate(str, len))
+        json_encode_exception(l, cfg, lindex, "invalid UTF-8 string");
 
-        /* Error if the 2nd code is not a low surrogate */
-        if ((surrogate_low & 0xFC00) != 0xDC00)
-            return -1;
+    msgpack_append_str(s, str, len);
+}
 
-        /* Calculate Unicode codepoint */
-        codepoint = (codepoint & 0x3FF) << 10;
-        surrogate_low &= 0x3FF;
-        codepoint = (codepoint | surrogate_low) + 0x10000;
-        escape_len = 12;
+/* Integers are encoded using the smallest MessagePack type */
+static void msgpack_append_unsigned(strbuf_t *s, uint64_t u)
+{
+    if (u < 128)
+        strbuf_append_char(s, (int)u);
+    else if (u <= 0xff)
+        msgpack_append_uint(s, 0xcc, u, 1);
+    else if (u <= 0xffff)
+        msgpack_append_uint(s, 0xcd, u, 2);
+    else if (u <= 0xffffffffU)
+        msgpack_append_uint(s, 0xce, u, 4);
+    else
+        msgpack_append_uint(s, 0xcf, u, 8);
+}
+
+static void msgpack_append_signed(strbuf_t *s, int64_t i)
+{
+    if (i >= 0)
+        msgpack_append_unsigned(s, i);
+    else if (i >= -32)
+        strbuf_append_char(s, 0xe0 | (i & 0x1f));
+    else if (i >= INT8_MIN)
+        msgpack_append_uint(s, 0xd0, (uint64_t)i, 1);
+    else if (i >= INT16_MIN)
+        msgpack_append_uint(s, 0xd1, (uint64_t)i, 2);
+    else if (i >= INT32_MIN)
+        msgpack_append_uint(s, 0xd2, (uint64_t)i, 4);
+    else
+        msgpack_append_uint(s, 0xd3, (uint64_t)i, 8);
+}
+
+static void msgpack_append_float(lua_State *l, json_config_t *cfg,
+                                 strbuf_t *s, double num, int lindex)
+{
+    union { double num; uint64_t bits; } val;
+
+    if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
+        json_encode_exception(l, cfg, lindex, "must not be NaN or Inf");
+
+    /* -2^63 <= num < 2^64, excluding -0 */
+    if (num >= -9223372036854775808.0 && num < 18446744073709551616.0 &&
+        floor(num) == num && (num || !signbit(num))) {
+        if (num >= 0)
+            msgpack_append_unsigned(s, (uint64_t)num);
+        else
+            msgpack_append_signed(s, (int64_t)num);
+        return;
     }
 
-    /* Convert codepoint to UTF-8 */
-    len = codepoint_to_utf8(utf8, codepoint);
-    if (!len)
-        return -1;
+    val.num = num;
+    msgpack_append_uint(s, 0xcb, val.bits, 8);
+}
 
-    /* Append bytes and advance parse index */
-    strbuf_append_mem_unsafe(json->tmp, utf8, len);
-    json->index += escape_len;
+static void msgpack_append_number(lua_State *l, json_config_t *cfg,
+                                  strbuf_t *s, int lindex)
+{
+#ifdef JSON_INTEGERS
+    if (lua_isinteger(l, lindex)) {
+        msgpack_append_signed(s, lua_tointeger(l, lindex));
+        return;
+    }
+#endif
 
-    return 0;
+    msgpack_append_float(l, cfg, s, lua_tonumber(l, lindex), lindex);
 }
 
-static void json_set_token_error(json_token_t *token, json_parse_t *json,
-                                 const char *errtype)
+static void msgpack_append_data(lua_State *l, json_config_t *cfg, strbuf_t *s);
+
+static void msgpack_append_array(lua_State *l, json_config_t *cfg,
+                                 strbuf_t *s, int array_length)
 {
-    token->type = T_ERROR;
-    token->index = json->index;
-    token->value.string = errtype;
+    int i;
+
+    json_encode_descend(l, cfg);
+
+    msgpack_append_header(s, 0x90, 16, 0, 0xdc, 0xdd, array_length);
+
+    for (i = 1; i <= array_length; i++) {
+        lua_rawgeti(l, -1, i);
+        msgpack_append_data(l, cfg, s);
+        lua_pop(l, 1);
+    }
+
+    cfg->current_depth--;
 }
 
-static void json_next_string_token(json_parse_t *json, json_token_t *token)
+static void msgpack_append_object(lua_State *l, json_config_t *cfg,
+                                  strbuf_t *s)
 {
-    char *escape2char = json->cfg->escape2char;
-    char ch;
+    char key[32];
+    int count, keytype, len;
 
-    /* Caller must ensure a string is next */
-    assert(json->data[json->index] == '"');
+    json_encode_descend(l, cfg);
 
-    /* Skip " */
-    json->index++;
+    /* The map header includes the number of pairs */
+    count = 0;
+    lua_pushnil(l);
+    while (lua_next(l, -2) != 0) {
+        lua_pop(l, 1);
+        count++;
+    }
+    msgpack_append_header(s, 0x80, 16, 0, 0xde, 0xdf, count);
 
-    /* json->tmp is the temporary strbuf used to accumulate the
-     * decoded string value. */
-    strbuf_reset(json->tmp);
-    while ((ch = json->data[json->index]) != '"') {
-        if (!ch) {
-            /* Premature end of the string */
-            json_set_token_error(token, json, "unexpected end of string");
-            return;
+    lua_pushnil(l);
+    /* table, startkey */
+    while (lua_next(l, -2) != 0) {
+        /* table, key, value */
+        keytype = lua_type(l, -2);
+        if (keytype == LUA_TNUMBER) {
+            /* Convert to the same string as cjson.encode() */
+#ifdef JSON_INTEGERS
+            if (lua_isinteger(l, -2)) {
+                len = snprintf(key, sizeof(key), LUA_INTEGER_FMT,
+                               (LUAI_UACINT)lua_tointeger(l, -2));
+            } else
+#endif
+            {
+                if (cfg->encode_refuse_badnum && isinf(lua_tonumber(l, -2)))
+                    json_encode_exception(l, cfg, -2,
+                                          "must not be NaN or Inf");
+                len = snprintf(key, sizeof(key), cfg->number_fmt,
+                               lua_tonumber(l, -2));
+            }
+            msgpack_append_str(s, key, len);
+        } else if (keytype == LUA_TSTRING) {
+            msgpack_append_string(l, cfg, s, -2);
+        } else {
+            json_encode_exception(l, cfg, -2,
+                                  "table key must be a number or string");
+            /* never returns */
         }
 
-        /* Handle escapes */
-        if (ch == '\\') {
-            /* Fetch escape character */
-            ch = json->data[json->index + 1];
+        msgpack_append_data(l, cfg, s);
+        lua_pop(l, 1);
+        /* table, key */
+    }
 
-            /* Translate escape code and append to tmp string */
-            ch = escape2char[(unsigned char)ch];
-            if (ch == 'u') {
-                if (json_append_unicode_escape(json) == 0)
-                    continue;
+    cfg->current_depth--;
+}
 
-                json_set_token_error(token, json,
-                                     "invalid unicode escape code");
-                return;
+/* Serialise Lua data into MessagePack. Follows json_append_data(). */
+static void msgpack_append_data(lua_State *l, json_config_t *cfg, strbuf_t *s)
+{
+    json_packed_t *packed;
+    int len, i;
+
+    switch (json_classify(l, cfg, &len, &packed)) {
+    case JSON_CLASS_STRING:
+        msgpack_append_string(l, cfg, s, -1);
+        break;
+    case JSON_CLASS_NUMBER:
+        msgpack_append_number(l, cfg, s, -1);
+        break;
+    case JSON_CLASS_BOOLEAN:
+        strbuf_append_char(s, lua_toboolean(l, -1) ? '\xc3' : '\xc2');
+        break;
+    case JSON_CLASS_ARRAY:
+        msgpack_append_array(l, cfg, s, len);
+        break;
+    case JSON_CLASS_OBJECT:
+        msgpack_append_object(l, cfg, s);
+        break;
+    case JSON_CLASS_PACKED:
+        msgpack_append_header(s, 0x90, 16, 0, 0xdc, 0xdd, packed->length);
+        for (i = 0; i < packed->length; i++)
+            msgpack_append_float(l, cfg, s, packed->values[i], -1);
+        break;
+    case JSON_CLASS_NULL:
+        strbuf_append_char(s, '\xc0');
+        break;
+    }
+}
+
+static int json_encode_msgpack(lua_State *l)
+{
+    json_config_t *cfg;
+    char *buf;
+    int len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = json_fetch_config(l);
+    json_encode_init(cfg);
+
+    msgpack_append_data(l, cfg, &cfg->encode_buf);
+    buf = strbuf_string(&cfg->encode_buf, &len);
+
+    lua_pushlstring(l, buf, len);
+    json_encode_stats(cfg);
+
+    if (!cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
+
+    return 1;
+}
+
+/* Read a big endian value of "bytes" bytes at *pos.
+ * Returns 0 if the data is truncated. */
+static int msgpack_read_uint(const unsigned char *data, size_t len,
+                             size_t *pos, int bytes, uint64_t *val)
+{
+    int i;
+
+    if (len - *pos < (size_t)bytes)
+        return 0;
+
+    *val = 0;
+    for (i = 0; i < bytes; i++)
+        *val = *val << 8 | data[(*pos)++];
+
+    return 1;
+}
+
+/* Parse a single MessagePack value onto a tape. Does not use the Lua
+ * state.
+ *
+ * Returns NULL on success. Otherwise returns an error message, with *pos
+ * at the offset of the failing type byte. */
+static const char *msgpack_parse_value(const unsigned char *data, size_t len,
+                                       size_t *pos, json_tape_t *tape,
+                                       json_container_t *stack, int max_depth)
+{
+    static const char truncated[] = "Truncated MessagePack data";
+    json_container_t *container;
+    json_tape_type_t type;
+    union { double num; uint64_t bits; } fval;
+    union { float num; uint32_t bits; } f32val;
+    uint64_t val, count;
+    size_t start;
+    int64_t integer = 0;
+    double num = 0;
+    int depth = 0;
+    int tag, n;
+
+    while (1) {
+        start = *pos;
+        if (start >= len)
+            return truncated;
+        tag = data[(*pos)++];
+        count = 0;
+
+        if (tag <= 0x7f) {
+            type = TAPE_INTEGER;
+            integer = tag;
+        } else if (tag <= 0x8f) {
+            type = TAPE_OBJECT;
+            count = tag & 0x0f;
+        } else if (tag <= 0x9f) {
+            type = TAPE_ARRAY;
+            count = tag & 0x0f;
+        } else if (tag <= 0xbf) {
+            type = TAPE_STRING;
+            count = tag & 0x1f;
+        } else if (tag >= 0xe0) {
+            type = TAPE_INTEGER;
+            integer = (signed char)tag;
+        } else {
+            switch (tag) {
+            case 0xc0:
+                type = TAPE_NULL;
+                break;
+            case 0xc2:
+                type = TAPE_FALSE;
+                break;
+            case 0xc3:
+                type = TAPE_TRUE;
+                break;
+            case 0xc4: case 0xc5: case 0xc6:    /* bin 8/16/32 */
+            case 0xd9: case 0xda: case 0xdb:    /* str 8/16/32 */
+                type = TAPE_STRING;
+                n = tag <= 0xc6 ? tag - 0xc4 : tag - 0xd9;
+                if (!msgpack_read_uint(data, len, pos, 1 << n, &count))
+                    return truncated;
+                break;
+            case 0xca:
+                type = TAPE_NUMBER;
+                if (!msgpack_read_uint(data, len, pos, 4, &val))
+                    return truncated;
+                f32val.bits = val;
+                num = f32val.num;
+                break;
+            case 0xcb:
+                type = TAPE_NUMBER;
+                if (!msgpack_read_uint(data, len, pos, 8, &val))
+                    return truncated;
+                fval.bits = val;
+                num = fval.num;
+                break;
+            case 0xcc: case 0xcd: case 0xce: case 0xcf:
+                if (!msgpack_read_uint(data, len, pos, 1 << (tag - 0xcc), &val))
+                    return truncated;
+                if (val <= (uint64_t)JSON_INTEGER_MAX) {
+                    type = TAPE_INTEGER;
+                    integer = val;
+                } else {
+                    type = TAPE_NUMBER;
+                    num = (double)val;
+                }
+                break;
+            case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+                n = 1 << (tag - 0xd0);
+                if (!msgpack_read_uint(data, len, pos, n, &val))
+                    return truncated;
+                /* Sign extend */
+                if (n < 8 && val >> (8 * n - 1))
+                    val |= ~(uint64_t)0 << (8 * n);
+                integer = (int64_t)val;
+                if (JSON_INTEGER_MIN <= integer &&
+                    integer <= JSON_INTEGER_MAX) {
+                    type = TAPE_INTEGER;
+                } else {
+                    type = TAPE_NUMBER;
+                    num = (double)integer;
+                }
+                break;
+            case 0xdc: case 0xdd:
+                type = TAPE_ARRAY;
+                if (!msgpack_read_uint(data, len, pos, tag == 0xdc ? 2 : 4,
+                                       &count))
+                    return truncated;
+                break;
+            case 0xde: case 0xdf:
+                type = TAPE_OBJECT;
+                if (!msgpack_read_uint(data, len, pos, tag == 0xde ? 2 : 4,
+                                       &count))
+                    return truncated;
+                break;
+            default:
+                /* Extension types and reserved bytes */
+                *pos = start;
+                return "Unsupported MessagePack type";
             }
-            if (!ch) {
-                json_set_token_error(token, json, "invalid escape code");
-                return;
+        }
+
+        /* Object keys are at even positions within the remaining items */
+        if (depth && stack[depth - 1].type == T_OBJ_BEGIN &&
+            !(stack[depth - 1].length & 1) && type != TAPE_STRING) {
+            *pos = start;
+            return "MessagePack map key must be a string";
+        }
+
+        /* Every element is at least 1 byte long */
+        if (count > len - *pos ||
+            (type == TAPE_OBJECT && count > (len - *pos) / 2)) {
+            *pos = start;
+            return truncated;
+        }
+
+        n = json_tape_append(tape, type);
+        switch (type) {
+        case TAPE_NUMBER:
+            tape->nodes[n].value.number = num;
+            break;
+        case TAPE_INTEGER:
+            tape->nodes[n].value.integer = integer;
+            break;
+        case TAPE_STRING:
+            tape->nodes[n].length = count;
+            tape->nodes[n].value.offset = strbuf_length(&tape->strings);
+            strbuf_append_mem(&tape->strings, (const char *)data + *pos,
+                              count);
+            *pos += count;
+            break;
+        case TAPE_ARRAY:
+        case TAPE_OBJECT:
+            tape->nodes[n].length = count;
+            tape->nodes[n].value.next = tape->count;
+            if (!count)
+                break;
+
+            if (depth >= max_depth) {
+                *pos = start;
+                return json_nested_error;
             }
+            container = &stack[depth++];
+            container->type = type == TAPE_ARRAY ? T_ARR_BEGIN : T_OBJ_BEGIN;
+            container->index = n;
+            container->length = type == TAPE_ARRAY ? count : 2 * count;
+            continue;
+        default:
+            break;
+        }
 
-            /* Skip '\' */
-            json->index++;
+        /* A complete value has been appended. Close any containers
+         * which end. */
+        while (1) {
+            if (!depth)
+                return NULL;
+
+            container = &stack[depth - 1];
+            if (--container->length)
+                break;
+            tape->nodes[container->index].value.next = tape->count;
+            depth--;
         }
-        /* Append normal character or translated single character
-         * Unicode escapes are handled above */
-        strbuf_append_char_unsafe(json->tmp, ch);
-        json->index++;
     }
-    json->index++;  /* Eat final quote (") */
+}
 
-    strbuf_ensure_null(json->tmp);
+static int msgpack_destroy_tape(lua_State *l)
+{
+    json_tape_t *tape;
 
-    token->type = T_STRING;
-    token->value.string = strbuf_string(json->tmp, &token->string_len);
+    tape = lua_touserdata(l, 1);
+    if (tape)
+        json_tape_free(tape);
+
+    return 0;
 }
 
-/* JSON numbers should take the following form:
- *      -?(0|[1-9]|[1-9][0-9]+)(.[0-9]+)?([eE][-+]?[0-9]+)?
- *
- * json_next_number_token() uses strtod() which allows other forms:
- * - numbers starting with '+'
- * - NaN, -NaN, infinity, -infinity
- * - hexidecimal numbers
- * - numbers with leading zeros
- *
- * json_is_invalid_number() detects "numbers" which may pass strtod()'s
- * error checking, but should not be allowed with strict JSON.
- *
- * json_is_invalid_number() may pass numbers which cause strtod()
- * to generate an error.
- */
-static int json_is_invalid_number(json_parse_t *json)
+static int json_decode_msgpack(lua_State *l)
 {
-    int i = json->index;
+    json_config_t *cfg = json_fetch_config(l);
+    const unsigned char *data;
+    json_container_t *stack;
+    const char *error;
+    json_tape_t *tape;
+    size_t len, pos;
+    int node;
 
-    /* Reject numbers starting with + */
-    if (json->data[i] == '+')
-        return 1;
+    json_verify_arg_count(l, 1);
 
-    /* Skip minus sign if it exists */
-    if (json->data[i] == '-')
-        i++;
+    data = (const unsigned char *)luaL_checklstring(l, 1, &len);
 
-    /* Reject numbers starting with 0x, or leading zeros */
-    if (json->data[i] == '0') {
-        int ch2 = json->data[i + 1];
+    /* The tape is owned by a userdata, so it is released even if an
+     * error is raised */
+    tape = lua_newuserdata(l, sizeof(*tape));
+    json_tape_init(tape, 0);
+    luaL_getmetatable(l, MSGPACK_TAPE_MT);
+    lua_setmetatable(l, -2);
 
-        if ((ch2 | 0x20) == 'x' ||          /* Hex */
-            ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
-            return 1;
+    stack = json_take_stack(cfg);
+    if (!stack)
+        luaL_error(l, "Out of memory");
+    pos = 0;
+    error = msgpack_parse_value(data, len, &pos, tape, stack,
+                                cfg->decode_max_depth);
+    json_return_stack(cfg, stack, cfg->decode_max_depth);
+    if (!error && pos != len)
+        error = "Unexpected data after MessagePack value";
+    if (error == json_nested_error)
+        error = "Too many nested data structures";
+    if (error)
+        luaL_error(l, "%s at byte %d", error, (int)pos + 1);
+
+    node = 0;
+    cfg->stats.decode_tables += json_tape_push_value(l, cfg, tape, &node);
+    cfg->stats.decode_documents++;
+    cfg->stats.decode_bytes += len;
 
-        return 0;
-    } else if (json->data[i] <= '9') {
-        return 0;                           /* Ordinary number */
-    }
+    return 1;
+}
 
+/* ===== FFI ENTRY POINTS ===== */
 
-    /* Reject inf/nan */
-    if (!strncasecmp(&json->data[i], "inf", 3))
-        return 1;
-    if (!strncasecmp(&json->data[i], "nan", 3))
-        return 1;
+/* A plain C interface for the LuaJIT FFI. None of these functions use a
+ * Lua state, so LuaJIT can compile calls to them into traces:
+ * - cjson_ffi_decode() parses a buffer into a document tape which is
+ *   read directly through the FFI.
+ * - cjson_ffi_encode_doc(), cjson_ffi_encode_string() and
+ *   cjson_ffi_encode_number() write JSON into caller owned buffers. They
+ *   return the length required, like snprintf(3), or -1 for a value
+ *   which cannot be encoded.
+ *
+ * "config" is a snapshot returned by cjson.ffi_config(), or NULL for the
+ * default settings. Snapshots are never modified, so calls may be made
+ * from any thread.
+ *
+ * cjson.ffi_cdef must match the declarations below. */
+
+typedef struct {
+    const json_tape_node_t *nodes;
+    int count;
+    const char *strings;
+} cjson_ffi_doc_t;
+
+typedef struct {
+    cjson_ffi_doc_t doc;        /* Must be first */
+    json_tape_t tape;
+} json_ffi_doc_t;
 
-    /* Pass all other numbers which may still be invalid, but
-     * strtod() will catch them. */
-    return 0;
+/* Parser state for cjson_ffi_decode(). It is allocated with the stack
+ * and text so it is still valid after an allocation failure longjmp()s
+ * out of the parser. */
+typedef struct {
+    json_parse_t parse;
+    json_token_t token;
+} json_ffi_work_t;
+
+static const char json_ffi_cdef[] =
+    "typedef struct {\n"
+    "    int type;\n"
+    "    int length;\n"
+    "    union {\n"
+    "        double number; int64_t integer; int offset; int next;\n"
+    "    } value;\n"
+    "} cjson_node_t;\n"
+    "typedef struct {\n"
+    "    const cjson_node_t *nodes;\n"
+    "    int count;\n"
+    "    const char *strings;\n"
+    "} cjson_doc_t;\n"
+    "cjson_doc_t *cjson_ffi_decode(const void *config, const char *json,\n"
+    "                              size_t len, char *error,\n"
+    "                              size_t error_len);\n"
+    "void cjson_ffi_free(cjson_doc_t *doc);\n"
+    "int cjson_ffi_encode_doc(const void *config, const cjson_doc_t *doc,\n"
+    "                         int node, char *buf, size_t size);\n"
+    "int cjson_ffi_encode_string(const void *config, const char *str,\n"
+    "                            size_t len, char *buf, size_t size);\n"
+    "int cjson_ffi_encode_number(const void *config, double num,\n"
+    "                            char *buf, size_t size);\n";
+
+static json_config_t json_ffi_default;
+
+static void json_ffi_init_default(void)
+{
+    json_init_kernels();
+    json_init_config(&json_ffi_default);
 }
 
-static void json_next_number_token(json_parse_t *json, json_token_t *token)
+static const json_config_t *json_ffi_config(const void *config)
 {
-    const char *startptr;
-    char *endptr;
+#ifndef DISABLE_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+#else
+    static int once = 0;
+#endif
 
-    token->type = T_NUMBER;
-    startptr = &json->data[json->index];
-    token->value.number = strtod(&json->data[json->index], &endptr);
-    if (startptr == endptr)
-        json_set_token_error(token, json, "invalid number");
-    else
-        json->index += endptr - startptr;   /* Skip the processed number */
+    if (config)
+        return config;
 
-    return;
+#ifndef DISABLE_THREADS
+    pthread_once(&once, json_ffi_init_default);
+#else
+    if (!once) {
+        json_ffi_init_default();
+        once = 1;
+    }
+#endif
+
+    return &json_ffi_default;
 }
 
-/* Fills in the token struct.
- * T_STRING will return a pointer to the json_parse_t temporary string
- * T_ERROR will leave the json->index pointer at the error.
- */
-static void json_next_token(json_parse_t *json, json_token_t *token)
+static void json_ffi_error(char *error, size_t error_len, const char *fmt, ...)
 {
-    json_token_type_t *ch2token = json->cfg->ch2token;
-    int ch;
+    va_list arg;
 
-    /* Eat whitespace. FIXME: UGLY */
-    token->type = ch2token[(unsigned char)json->data[json->index]];
-    while (token->type == T_WHITESPACE)
-        token->type = ch2token[(unsigned char)json->data[++json->index]];
+    if (!error || !error_len)
+        return;
 
-    token->index = json->index;
+    va_start(arg, fmt);
+    vsnprintf(error, error_len, fmt, arg);
+    va_end(arg);
+}
 
-    /* Don't advance the pointer for an error or the end */
-    if (token->type == T_ERROR) {
-        json_set_token_error(token, json, "invalid token");
-        return;
+/* Parse "len" bytes of JSON text. The text does not need to be NULL
+ * terminated. Returns NULL and stores a message in "error" if the text
+ * is invalid. */
+cjson_ffi_doc_t *cjson_ffi_decode(const void *config, const char *json,
+                                  size_t len, char *error, size_t error_len)
+{
+    const json_config_t *cfg = json_ffi_config(config);
+    json_ffi_doc_t *doc;
+    json_ffi_work_t *work;
+    json_parse_t *parse;
+    json_container_t *stack;
+    const char *expected, *found;
+    char *text;
+    jmp_buf oom;
+
+    if (len >= INT_MAX) {
+        json_ffi_error(error, error_len, "JSON text is too long");
+        return NULL;
     }
-
-    if (token->type == T_END) {
-        return;
+    if (len >= 2 && (!json[0] || !json[1])) {
+        json_ffi_error(error, error_len,
+                       "JSON parser does not support UTF-16 or UTF-32");
+        return NULL;
     }
 
-    /* Found a known single character token, advance index and return */
-    if (token->type != T_UNKNOWN) {
-        json->index++;
-        return;
+    /* The tokeniser relies on a NULL terminator, which the caller's
+     * buffer may not have room for. The copy shares one allocation with
+     * the parser state and stack. */
+    doc = malloc(sizeof(*doc));
+    work = malloc(sizeof(*work) + cfg->decode_max_depth * sizeof(*stack) +
+                  len + 1);
+    if (!doc || !work) {
+        free(doc);
+        free(work);
+        json_ffi_error(error, error_len, "Out of memory");
+        return NULL;
     }
+    stack = (json_container_t *)(work + 1);
+    text = (char *)(stack + cfg->decode_max_depth);
+    memcpy(text, json, len);
+    text[len] = '\0';
+
+    parse = &work->parse;
+    parse->tmp = NULL;
+    memset(&doc->tape, 0, sizeof(doc->tape));
+
+    /* strbuf would exit the process when memory is exhausted */
+    if (setjmp(oom)) {
+        strbuf_set_die_jmp(NULL);
+        if (work->parse.tmp)
+            strbuf_free(work->parse.tmp);
+        json_tape_free(&doc->tape);
+        free(work);
+        free(doc);
+        json_ffi_error(error, error_len, "Out of memory");
+        return NULL;
+    }
+    strbuf_set_die_jmp(&oom);
+
+    /* The parser only reads the configuration */
+    json_tape_init(&doc->tape, len);
+    json_parse_init_with(parse, (json_config_t *)cfg, text, len, stack,
+                         NULL);
+
+    json_next_token(parse, &work->token);
+    expected = json_tape_parse_value(parse, &doc->tape, &work->token);
+    if (!expected) {
+        json_next_token(parse, &work->token);
+        if (work->token.type != T_END)
+            expected = "the end";
+    }
+    strbuf_set_die_jmp(NULL);
 
-    /* Process characters which triggered T_UNKNOWN */
-    ch = json->data[json->index];
+    strbuf_free(parse->tmp);
 
-    /* Must use strncmp() to match the front of the JSON string.
-     * JSON identifier must be lowercase.
-     * When strict_numbers if disabled, either case is allowed for
-     * Infinity/NaN (since we are no longer following the spec..) */
-    if (ch == '"') {
-        json_next_string_token(json, token);
-        return;
-    } else if (ch == '-' || ('0' <= ch && ch <= '9')) {
-        if (json->cfg->decode_refuse_badnum && json_is_invalid_number(json)) {
-            json_set_token_error(token, json, "invalid number");
-            return;
+    if (expected) {
+        if (expected == json_nested_error) {
+            json_ffi_error(error, error_len, "Too many nested data structures");
+        } else {
+            if (work->token.type == T_ERROR)
+                found = work->token.value.string;
+            else
+                found = json_token_type_name[work->token.type];
+            json_ffi_error(error, error_len,
+                           "Expected %s but found %s at character %d",
+                           expected, found, work->token.index + 1);
         }
-        json_next_number_token(json, token);
-        return;
-    } else if (!strncmp(&json->data[json->index], "true", 4)) {
-        token->type = T_BOOLEAN;
-        token->value.boolean = 1;
-        json->index += 4;
-        return;
-    } else if (!strncmp(&json->data[json->index], "false", 5)) {
-        token->type = T_BOOLEAN;
-        token->value.boolean = 0;
-        json->index += 5;
-        return;
-    } else if (!strncmp(&json->data[json->index], "null", 4)) {
-        token->type = T_NULL;
-        json->index += 4;
-        return;
-    } else if (!json->cfg->decode_refuse_badnum &&
-               json_is_invalid_number(json)) {
-        /* When refuse_badnum is disabled, only attempt to process
-         * numbers we know are invalid JSON (Inf, NaN, hex)
-         * This is required to generate an appropriate token error,
-         * otherwise all bad tokens will register as "invalid number"
-         */
-        json_next_number_token(json, token);
-        return;
+        json_tape_free(&doc->tape);
+        free(work);
+        free(doc);
+        return NULL;
     }
+    free(work);
 
-    /* Token starts with t/f/n but isn't recognised above. */
-    json_set_token_error(token, json, "invalid token");
+    doc->doc.nodes = doc->tape.nodes;
+    doc->doc.count = doc->tape.count;
+    doc->doc.strings = doc->tape.strings.buf;
+
+    return &doc->doc;
 }
 
-/* This function does not return.
- * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
- * The only supported exception is the temporary parser string
- * json->tmp struct.
- * json and token should exist on the stack somewhere.
- * luaL_error() will long_jmp and release the stack */
-static void json_throw_parse_error(lua_State *l, json_parse_t *json,
-                                   const char *exp, json_token_t *token)
+void cjson_ffi_free(cjson_ffi_doc_t *doc)
 {
-    const char *found;
-
-    strbuf_free(json->tmp);
+    json_ffi_doc_t *owner = (json_ffi_doc_t *)doc;
 
-    if (token->type == T_ERROR)
-        found = token->value.string;
-    else
-        found = json_token_type_name[token->type];
+    if (!owner)
+        return;
 
-    /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
+    json_tape_free(&owner->tape);
+    free(owner);
 }
 
-static void json_decode_checkstack(lua_State *l, json_parse_t *json, int n)
+/* Copy "len" bytes to buf[pos] when they fit within "size" */
+static void json_ffi_append(char *buf, size_t size, size_t pos,
+                            const char *str, size_t len)
 {
-    if (lua_checkstack(l, n))
-        return;
-
-    strbuf_free(json->tmp);
-    luaL_error(l, "Too many nested data structures");
+    if (pos + len <= size)
+        memcpy(&buf[pos], str, len);
 }
 
-static void json_parse_object_context(lua_State *l, json_parse_t *json)
+/* Encode the value at "node" of a document returned by
+ * cjson_ffi_decode(). Node 0 is the whole document. */
+int cjson_ffi_encode_doc(const void *config, const cjson_ffi_doc_t *doc,
+                         int node, char *buf, size_t size)
 {
-    json_token_t token;
+    const json_config_t *cfg = json_ffi_config(config);
+    json_tape_t *tape;
+    json_tape_node_t *nodes;
+    strbuf_t *json;
+    jmp_buf oom;
+    int end, len, i;
+
+    if (!doc || node < 0 || node >= doc->count)
+        return -1;
 
-    /* 3 slots required:
-     * .., table, key, value */
-    json_decode_checkstack(l, json, 3);
+    tape = &((json_ffi_doc_t *)doc)->tape;
+    nodes = tape->nodes;
 
-    lua_newtable(l);
+    /* Apply the encoding settings before writing anything */
+    end = node + 1;
+    if (nodes[node].type == TAPE_ARRAY || nodes[node].type == TAPE_OBJECT)
+        end = nodes[node].value.next;
+    for (i = node; i < end; i++) {
+        if (nodes[i].type == TAPE_NUMBER && cfg->encode_refuse_badnum &&
+            (isinf(nodes[i].value.number) || isnan(nodes[i].value.number)))
+            return -1;
+        if (nodes[i].type == TAPE_STRING && cfg->encode_refuse_badutf8 &&
+            !utf8_validate(tape->strings.buf + nodes[i].value.offset,
+                           nodes[i].length))
+            return -1;
+    }
 
-    json_next_token(json, &token);
+    json = malloc(sizeof(*json));
+    if (!json)
+        return -1;
+    memset(json, 0, sizeof(*json));
 
-    /* Handle empty objects */
-    if (token.type == T_OBJ_END) {
-        return;
+    if (setjmp(oom)) {
+        strbuf_set_die_jmp(NULL);
+        strbuf_free(json);
+        free(json);
+        return -1;
     }
+    strbuf_set_die_jmp(&oom);
 
-    while (1) {
-        if (token.type != T_STRING)
-            json_throw_parse_error(l, json, "object key string", &token);
-
-        /* Push key */
-        lua_pushlstring(l, token.value.string, token.string_len);
+    strbuf_init(json, 0);
+    json_tape_append_data(json, tape, &node, cfg->number_fmt);
+    strbuf_join_chunks(json);
+    strbuf_set_die_jmp(NULL);
 
-        json_next_token(json, &token);
-        if (token.type != T_COLON)
-            json_throw_parse_error(l, json, "colon", &token);
+    len = strbuf_length(json);
+    json_ffi_append(buf, size, 0, json->buf, len);
+    strbuf_free(json);
+    free(json);
 
-        /* Fetch value */
-        json_next_token(json, &token);
-        json_process_value(l, json, &token);
+    return len;
+}
 
-        /* Set key = value */
-        lua_rawset(l, -3);
+int cjson_ffi_encode_string(const void *config, const char *str, size_t len,
+                            char *buf, size_t size)
+{
+    const json_config_t *cfg = json_ffi_config(config);
+    const json_kernels_t *k = json_get_kernels();
+    const char *escstr;
+    size_t pos, run, i;
 
-        json_next_token(json, &token);
+    if (cfg->encode_refuse_badutf8 && !utf8_validate(str, len))
+        return -1;
 
-        if (token.type == T_OBJ_END)
-            return;
+    pos = 0;
+    json_ffi_append(buf, size, pos++, "\"", 1);
+    for (i = 0; i < len; i++) {
+        run = k->scan_escape(&str[i], len - i);
+        json_ffi_append(buf, size, pos, &str[i], run);
+        pos += run;
+        i += run;
+        if (i == len)
+            break;
+        escstr = char2escape[(unsigned char)str[i]];
+        json_ffi_append(buf, size, pos, escstr, strlen(escstr));
+        pos += strlen(escstr);
+    }
+    json_ffi_append(buf, size, pos++, "\"", 1);
 
-        if (token.type != T_COMMA)
-            json_throw_parse_error(l, json, "comma or object end", &token);
+    if (pos > INT_MAX)
+        return -1;
 
-        json_next_token(json, &token);
-    }
+    return pos;
 }
 
-/* Handle the array context */
-static void json_parse_array_context(lua_State *l, json_parse_t *json)
+int cjson_ffi_encode_number(const void *config, double num, char *buf,
+                            size_t size)
 {
-    json_token_t token;
-    int i;
-
-    /* 2 slots required:
-     * .., table, value */
-    json_decode_checkstack(l, json, 2);
-
-    lua_newtable(l);
+    const json_config_t *cfg = json_ffi_config(config);
+    char text[32];
+    int len;
 
-    json_next_token(json, &token);
+    if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
+        return -1;
 
-    /* Handle empty arrays */
-    if (token.type == T_ARR_END)
-        return;
+    len = snprintf(text, sizeof(text), cfg->number_fmt, num);
+    json_ffi_append(buf, size, 0, text, len);
 
-    for (i = 1; ; i++) {
-        json_process_value(l, json, &token);
-        lua_rawseti(l, -2, i);            /* arr[i] = value */
+    return len;
+}
 
-        json_next_token(json, &token);
+/* Returns a copy of this module's settings for the FFI entry points.
+ * Later changes to the settings do not affect the copy, so other
+ * threads never read a configuration while it is being modified. The
+ * copy is valid while the userdata is referenced. */
+static int json_ffi_config_handle(lua_State *l)
+{
+    json_config_t *cfg, *snapshot;
 
-        if (token.type == T_ARR_END)
-            return;
+    json_verify_arg_count(l, 0);
+    cfg = json_fetch_config(l);
 
-        if (token.type != T_COMMA)
-            json_throw_parse_error(l, json, "comma or array end", &token);
+    snapshot = lua_newuserdata(l, sizeof(*snapshot));
+    memcpy(snapshot, cfg, sizeof(*snapshot));
 
-        json_next_token(json, &token);
-    }
-}
+    /* Buffers are owned by the module configuration */
+    memset(&snapshot->encode_buf, 0, sizeof(snapshot->encode_buf));
+    snapshot->decode_stack = NULL;
+    snapshot->decode_cache = NULL;
+    snapshot->decode_cache_count = 0;
+    snapshot->analyze_keys = NULL;
+    snapshot->analyze_names = NULL;
+    snapshot->analyze_tmp = NULL;
 
-/* Handle the "value" context */
-static void json_process_value(lua_State *l, json_parse_t *json,
-                               json_token_t *token)
-{
-    switch (token->type) {
-    case T_STRING:
-        lua_pushlstring(l, token->value.string, token->string_len);
-        break;;
-    case T_NUMBER:
-        lua_pushnumber(l, token->value.number);
-        break;;
-    case T_BOOLEAN:
-        lua_pushboolean(l, token->value.boolean);
-        break;;
-    case T_OBJ_BEGIN:
-        json_parse_object_context(l, json);
-        break;;
-    case T_ARR_BEGIN:
-        json_parse_array_context(l, json);
-        break;;
-    case T_NULL:
-        /* In Lua, setting "t[k] = nil" will delete k from the table.
-         * Hence a NULL pointer lightuserdata object is used instead */
-        lua_pushlightuserdata(l, NULL);
-        break;;
-    default:
-        json_throw_parse_error(l, json, "value", token);
-    }
+    return 1;
 }
 
-/* json_text must be null terminated string */
-static void lua_json_decode(lua_State *l, const char *json_text, int json_len)
-{
-    json_parse_t json;
-    json_token_t token;
-
-    json.cfg = json_fetch_config(l);
-    json.data = json_text;
-    json.index = 0;
+/* ===== C API ===== */
 
-    /* Ensure the temporary buffer can hold the entire string.
-     * This means we no longer need to do length checks since the decoded
-     * string must be smaller than the entire json string */
-    json.tmp = strbuf_new(json_len);
+/* Functions declared in lua_cjson.h for other C modules. They use the
+ * configuration of the "cjson" module loaded into the Lua state, or a
+ * private default configuration if it has not been loaded. Errors are
+ * raised with lua_error(), the same as cjson.encode()/cjson.decode(). */
 
-    json_next_token(&json, &token);
-    json_process_value(l, &json, &token);
+static json_config_t *json_state_config(lua_State *l)
+{
+    json_config_t *cfg;
 
-    /* Ensure there is no more input left */
-    json_next_token(&json, &token);
+    lua_getfield(l, LUA_REGISTRYINDEX, JSON_CONFIG_KEY);
+    cfg = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+    if (cfg)
+        return cfg;
 
-    if (token.type != T_END)
-        json_throw_parse_error(l, &json, "the end", &token);
+    json_init_kernels();
+    json_create_config(l);
+    cfg = lua_touserdata(l, -1);
+    lua_setfield(l, LUA_REGISTRYINDEX, JSON_CONFIG_KEY);
 
-    strbuf_free(json.tmp);
+    return cfg;
 }
 
-static int json_decode(lua_State *l)
+/* Append the JSON encoding of the value at "idx" to "json". The buffer
+ * may contain partial output if an error is raised. */
+void cjson_encode_to_strbuf(lua_State *l, int idx, strbuf_t *json)
 {
-    const char *json;
-    size_t len;
+    json_config_t *cfg;
+    int start;
 
-    json_verify_arg_count(l, 1);
+    /* Convert relative indices before pushing */
+    if (idx < 0 && idx > LUA_REGISTRYINDEX)
+        idx = lua_gettop(l) + idx + 1;
 
-    json = luaL_checklstring(l, 1, &len);
+    cfg = json_state_config(l);
+    cfg->current_depth = 0;
+    cfg->encode_canonical = 0;
+    start = strbuf_length(json);
 
-    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
-     *
-     * CJSON can support any simple data type, hence only the first
-     * character is guaranteed to be ASCII (at worst: '"'). This is
-     * still enough to detect whether the wrong encoding is in use. */
-    if (len >= 2 && (!json[0] || !json[1]))
-        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+    lua_pushvalue(l, idx);
+    json_append_data(l, cfg, json);
+    lua_pop(l, 1);
 
-    lua_json_decode(l, json, len);
+    cfg->stats.encode_documents++;
+    cfg->stats.encode_bytes += strbuf_length(json) - start;
+}
 
-    return 1;
+/* Decode "len" bytes of JSON text and push the result. The text does not
+ * need to be NULL terminated. */
+void cjson_decode_buffer(lua_State *l, const char *json, size_t len)
+{
+    json_config_t *cfg;
+    char *text;
+
+    cfg = json_state_config(l);
+    json_check_encoding(l, json, len);
+    if (len >= INT_MAX)
+        luaL_error(l, "JSON text is too long");
+
+    /* The tokeniser relies on a NULL terminator, and json[len] cannot
+     * be read to check for one since it may be outside the caller's
+     * buffer. A userdata copy is released by the garbage collector if
+     * decoding fails. */
+    text = lua_newuserdata(l, len + 1);
+    memcpy(text, json, len);
+    text[len] = '\0';
+
+    lua_json_decode(l, cfg, text, len, NULL);
+    lua_remove(l, -2);
 }
 
 /* ===== INITIALISATION ===== */
 
-int luaopen_cjson(lua_State *l)
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+/* Compatibility for Lua 5.1.
+ *
+ * luaL_setfuncs() registers functions into the table below the upvalues,
+ * sharing the upvalues between each function. Borrowed from Lua 5.2. */
+static void luaL_setfuncs(lua_State *l, const luaL_Reg *reg, int nup)
+{
+    int i;
+
+    luaL_checkstack(l, nup, "too many upvalues");
+    for (; reg->name != NULL; reg++) {
+        for (i = 0; i < nup; i++)   /* Copy upvalues to the top */
+            lua_pushvalue(l, -nup);
+        lua_pushcclosure(l, reg->func, nup);
+        lua_setfield(l, -(nup + 2), reg->name);
+    }
+    lua_pop(l, nup);                /* Remove upvalues */
+}
+#endif
+
+/* Return a new CJSON module table with its own configuration */
+static int lua_cjson_new(lua_State *l)
 {
     luaL_Reg reg[] = {
         { "encode", json_encode },
+        { "encode_chunks", json_encode_chunks },
+        { "encode_canonical", json_encode_canonical },
+        { "set", json_set },
+        { "delete", json_delete },
+        { "minify", json_minify },
+        { "reformat", json_reformat },
+        { "analyze", json_analyze },
+        { "encode_file", json_encode_file },
         { "decode", json_decode },
+        { "encode_async", json_encode_async },
+        { "decoder", json_decoder },
+        { "encoder", json_encoder },
+        { "encode_columns", json_encode_columns },
+        { "decode_columns", json_decode_columns },
+        { "encode_msgpack", json_encode_msgpack },
+        { "decode_msgpack", json_decode_msgpack },
+        { "to_tape", json_to_tape },
+        { "from_tape", json_from_tape },
+        { "shared", json_shared },
+        { "shared_copy", json_shared_copy },
+        { "decode_cached", json_decode_cached },
+        { "decode_with", json_decode_with },
+        { "template", json_template },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
         { "encode_max_depth", json_cfg_encode_max_depth },
+        { "decode_max_depth", json_cfg_decode_max_depth },
+        { "decode_threads", json_cfg_decode_threads },
+        { "decode_packed_arrays", json_cfg_decode_packed_arrays },
+        { "decode_cache_size", json_cfg_decode_cache_size },
         { "encode_number_precision", json_cfg_encode_number_precision },
         { "encode_keep_buffer", json_cfg_encode_keep_buffer },
         { "refuse_invalid_numbers", json_cfg_refuse_invalid_numbers },
+        { "refuse_invalid_utf8", json_cfg_refuse_invalid_utf8 },
+        { "stats", json_stats },
+        { "reset_stats", json_reset_stats },
+        { "features", json_features },
+        { "ffi_config", json_ffi_config_handle },
+        { "new", lua_cjson_new },
         { NULL, NULL }
     };
 
-    /* Use json_fetch_config as a pointer.
-     * It's faster than using a config string, and more unique */
-    lua_pushlightuserdata(l, &json_config_key);
-    json_create_config(l);
-    lua_settable(l, LUA_REGISTRYINDEX);
+    /* Metatable for parallel decoding state */
+    if (luaL_newmetatable(l, JSON_RANGES_MT)) {
+        lua_pushcfunction(l, json_destroy_ranges);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
 
-    luaL_register(l, "cjson", reg);
+    /* Metatable for cjson.encode_async() handles */
+    if (luaL_newmetatable(l, JSON_ASYNC_MT)) {
+        luaL_Reg async_reg[] = {
+            { "ready", json_async_ready },
+            { "join", json_async_join },
+            { NULL, NULL }
+        };
+
+        lua_pushcfunction(l, json_destroy_async);
+        lua_setfield(l, -2, "__gc");
+        lua_newtable(l);
+        luaL_setfuncs(l, async_reg, 0);
+        lua_setfield(l, -2, "__index");
+    }
+    lua_pop(l, 1);
+
+    /* Metatable for packed number arrays */
+    if (luaL_newmetatable(l, JSON_PACKED_MT)) {
+        lua_pushcfunction(l, json_packed_index);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, json_packed_len);
+        lua_setfield(l, -2, "__len");
+    }
+    lua_pop(l, 1);
+
+    /* Metatable for shared document proxies */
+    if (luaL_newmetatable(l, JSON_SHARED_MT)) {
+        lua_pushcfunction(l, json_shared_index);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, json_shared_len);
+        lua_setfield(l, -2, "__len");
+        lua_pushcfunction(l, json_destroy_shared);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+
+    /* Metatable for cjson.decoder() and cjson.encoder() objects */
+    if (luaL_newmetatable(l, JSON_STEP_MT)) {
+        lua_pushcfunction(l, json_destroy_step);
+        lua_setfield(l, -2, "__gc");
+        lua_newtable(l);
+        lua_pushcfunction(l, json_step);
+        lua_setfield(l, -2, "step");
+        lua_setfield(l, -2, "__index");
+    }
+    lua_pop(l, 1);
+
+    /* Metatable for cjson.template() objects */
+    if (luaL_newmetatable(l, JSON_TEMPLATE_MT)) {
+        lua_pushcfunction(l, json_destroy_template);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+
+    /* Metatable for tapes used by cjson.decode_msgpack() */
+    if (luaL_newmetatable(l, MSGPACK_TAPE_MT)) {
+        lua_pushcfunction(l, msgpack_destroy_tape);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+
+    /* cjson module table */
+    lua_newtable(l);
+
+    /* Register functions with the configuration as an upvalue */
+    json_create_config(l);
+    luaL_setfuncs(l, reg, 1);
 
     /* Set cjson.null */
     lua_pushlightuserdata(l, NULL);
@@ -1289,6 +8125,29 @@ int luaopen_cjson(lua_State *l)
     lua_pushliteral(l, VERSION);
     lua_setfield(l, -2, "version");
 
+    /* Set cjson.ffi_cdef */
+    lua_pushstring(l, json_ffi_cdef);
+    lua_setfield(l, -2, "ffi_cdef");
+
+    return 1;
+}
+
+int luaopen_cjson(lua_State *l)
+{
+    json_init_kernels();
+
+    lua_cjson_new(l);
+
+    /* Share the configuration of the "cjson" module with the C API */
+    lua_getfield(l, -1, "encode");
+    lua_getupvalue(l, -1, 1);
+    lua_setfield(l, LUA_REGISTRYINDEX, JSON_CONFIG_KEY);
+    lua_pop(l, 1);
+
+    /* Register the global "cjson" table, as luaL_register() would */
+    lua_pushvalue(l, -1);
+    lua_setglobal(l, "cjson");
+
     /* Return cjson table */
     return 1;
 }
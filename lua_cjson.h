@@ -0,0 +1,62 @@
+/* CJSON - JSON support for Lua
+ *
+ * Copyright (c) 2010-2011  Mark Pulford <mark@kyne.com.au>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* C API for other Lua C modules.
+ *
+ * These functions use the settings of the "cjson" module loaded into
+ * the Lua state (cjson.encode_max_depth(), etc), or the default
+ * settings if it has not been loaded. Errors are raised with
+ * lua_error(), so calls should be protected the same way as calls to
+ * cjson.encode() and cjson.decode().
+ *
+ * Modules using this API must be linked with lua_cjson.c and strbuf.c,
+ * or with cjson.so.
+ */
+
+#ifndef LUA_CJSON_H
+#define LUA_CJSON_H
+
+#include <stddef.h>
+#include <lua.h>
+
+#include "strbuf.h"
+
+/* Append the JSON encoding of the Lua value at stack index "idx" to
+ * "json". The buffer may hold partial output if an error is raised. */
+extern void cjson_encode_to_strbuf(lua_State *l, int idx, strbuf_t *json);
+
+/* Decode "len" bytes of JSON text and push the resulting Lua value. The
+ * text does not need to be NULL terminated. The decoder requires a
+ * terminator and json[len] may be outside the caller's buffer, so the
+ * text is copied. Use cjson.decode() for text already in a Lua
+ * string. */
+extern void cjson_decode_buffer(lua_State *l, const char *json, size_t len);
+
+/* Load the "cjson" module and register it as a global */
+extern int luaopen_cjson(lua_State *l);
+
+#endif
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -27,11 +27,59 @@
 #include <stdarg.h>
 #include <string.h>
 
+#ifndef DISABLE_THREADS
+#include <pthread.h>
+#endif
+
 #include "strbuf.h"
 
+#ifndef DISABLE_THREADS
+static pthread_key_t die_jmp_key;
+static pthread_once_t die_jmp_once = PTHREAD_ONCE_INIT;
+static int die_jmp_ready;
+
+static void die_jmp_init(void)
+{
+    die_jmp_ready = !pthread_key_create(&die_jmp_key, NULL);
+}
+
+/* Without a thread key, die() always exits */
+void strbuf_set_die_jmp(jmp_buf *jmp)
+{
+    pthread_once(&die_jmp_once, die_jmp_init);
+    if (die_jmp_ready)
+        pthread_setspecific(die_jmp_key, jmp);
+}
+
+static jmp_buf *die_jmp(void)
+{
+    pthread_once(&die_jmp_once, die_jmp_init);
+    if (!die_jmp_ready)
+        return NULL;
+    return pthread_getspecific(die_jmp_key);
+}
+#else
+static jmp_buf *die_jmp_buf;
+
+void strbuf_set_die_jmp(jmp_buf *jmp)
+{
+    die_jmp_buf = jmp;
+}
+
+static jmp_buf *die_jmp(void)
+{
+    return die_jmp_buf;
+}
+#endif
+
 void die(const char *fmt, ...)
 {
     va_list arg;
+    jmp_buf *jmp;
+
+    jmp = die_jmp();
+    if (jmp)
+        longjmp(*jmp, 1);
 
     va_start(arg, fmt);
     vfprintf(stderr, fmt, arg);
@@ -57,6 +105,11 @@ void strbuf_init(strbuf_t *s, int len)
     s->dynamic = 0;
     s->reallocs = 0;
     s->debug = 0;
+    s->chunk_size = 0;
+    s->chunks = NULL;
+    s->chunk_count = 0;
+    s->chunk_alloc = 0;
+    s->chunked_length = 0;
 
     s->buf = malloc(size);
     if (!s->buf)
@@ -91,6 +144,29 @@ void strbuf_set_increment(strbuf_t *s, int increment)
     s->increment = increment;
 }
 
+/* Size > 0: Grow by appending segments of at least size bytes
+ * Size = 0: Contiguous buffer grown with realloc()
+ * Existing chunks are joined when returning to a contiguous buffer. */
+void strbuf_set_chunk_size(strbuf_t *s, int size)
+{
+    if (size < 0)
+        die("BUG: Invalid chunk size");
+
+    if (!size && s->chunk_count)
+        strbuf_join_chunks(s);
+
+    /* Limit the first segment to the chunk size as well */
+    if (size && !s->length && s->size > size) {
+        free(s->buf);
+        s->size = size;
+        s->buf = malloc(size);
+        if (!s->buf)
+            die("Out of memory");
+    }
+
+    s->chunk_size = size;
+}
+
 static inline void debug_stats(strbuf_t *s)
 {
     if (s->debug) {
@@ -109,16 +185,32 @@ void strbuf_free(strbuf_t *s)
         free(s->buf);
         s->buf = NULL;
     }
+    strbuf_free_chunks(s);
+    free(s->chunks);
+    s->chunks = NULL;
+    s->chunk_alloc = 0;
     if (s->dynamic)
         free(s);
 }
 
+/* Discard the completed chunks of a chunked buffer */
+void strbuf_free_chunks(strbuf_t *s)
+{
+    int i;
+
+    for (i = 0; i < s->chunk_count; i++)
+        free(s->chunks[i].buf);
+    s->chunk_count = 0;
+    s->chunked_length = 0;
+}
+
 char *strbuf_free_to_string(strbuf_t *s, int *len)
 {
     char *buf;
 
     debug_stats(s);
 
+    strbuf_join_chunks(s);
     strbuf_ensure_null(s);
 
     buf = s->buf;
@@ -159,12 +251,83 @@ static int calculate_new_size(strbuf_t *s, int len)
 }
 
 
+/* Move the current segment of a chunked buffer onto the chunks list,
+ * and start a new segment with room for at least len bytes */
+static void strbuf_new_chunk(strbuf_t *s, int len)
+{
+    strbuf_chunk_t *chunks;
+    int alloc;
+
+    if (s->chunk_count == s->chunk_alloc) {
+        alloc = s->chunk_alloc ? s->chunk_alloc * 2 : 16;
+        chunks = realloc(s->chunks, alloc * sizeof(*chunks));
+        if (!chunks)
+            die("Out of memory");
+        s->chunks = chunks;
+        s->chunk_alloc = alloc;
+    }
+
+    s->chunks[s->chunk_count].buf = s->buf;
+    s->chunks[s->chunk_count].length = s->length;
+    s->chunk_count++;
+    s->chunked_length += s->length;
+
+    s->size = len < s->chunk_size ? s->chunk_size : len + 1;
+    s->length = 0;
+    s->buf = malloc(s->size);
+    if (!s->buf)
+        die("Out of memory");
+}
+
+/* Complete the current segment of a chunked buffer, so every byte is
+ * held in the chunks list */
+void strbuf_flush_chunk(strbuf_t *s)
+{
+    if (s->length)
+        strbuf_new_chunk(s, 0);
+}
+
+/* Copy the chunks and current segment into a single contiguous buffer */
+void strbuf_join_chunks(strbuf_t *s)
+{
+    char *buf;
+    int i, pos;
+
+    if (!s->chunk_count)
+        return;
+
+    buf = malloc(strbuf_length(s) + 1);
+    if (!buf)
+        die("Out of memory");
+
+    pos = 0;
+    for (i = 0; i < s->chunk_count; i++) {
+        memcpy(buf + pos, s->chunks[i].buf, s->chunks[i].length);
+        pos += s->chunks[i].length;
+    }
+    memcpy(buf + pos, s->buf, s->length);
+    pos += s->length;
+
+    strbuf_free_chunks(s);
+    free(s->buf);
+    s->buf = buf;
+    s->size = pos + 1;
+    s->length = pos;
+}
+
 /* Ensure strbuf can handle a string length bytes long (ignoring NULL
  * optional termination). */
 void strbuf_resize(strbuf_t *s, int len)
 {
+    char *buf;
     int newsize;
 
+    /* Chunked buffers start a new segment instead of copying */
+    if (s->chunk_size && s->length && len >= s->size) {
+        strbuf_new_chunk(s, len - s->length);
+        return;
+    }
+
     newsize = calculate_new_size(s, len);
 
     if (s->debug > 1) {
@@ -172,10 +335,12 @@ void strbuf_resize(strbuf_t *s, int len)
                 (long)s, s->size, newsize);
     }
 
-    s->size = newsize;
-    s->buf = realloc(s->buf, s->size);
-    if (!s->buf)
+    /* Keep the existing buffer if die() returns to a handler */
+    buf = realloc(s->buf, newsize);
+    if (!buf)
         die("Out of memory");
+    s->buf = buf;
+    s->size = newsize;
     s->reallocs++;
 }
 
@@ -22,15 +22,28 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#ifndef STRBUF_H
+#define STRBUF_H
+
 #include <stdlib.h>
 #include <stdarg.h>
+#include <setjmp.h>
 
 /* Size: Total bytes allocated to *buf
  * Length: String length, excluding optional NULL terminator.
  * Increment: Allocation increments when resizing the string buffer.
  * Dynamic: True if created via strbuf_new()
+ *
+ * Chunked buffers (chunk_size > 0) never copy data when they grow. Once
+ * *buf is full it is moved onto the chunks list, and a new segment is
+ * allocated. *buf only holds the data after the last chunk.
  */
 
+typedef struct {
+    char *buf;
+    int length;
+} strbuf_chunk_t;
+
 typedef struct {
     char *buf;
     int size;
@@ -39,6 +52,12 @@ typedef struct {
     int dynamic;
     int reallocs;
     int debug;
+
+    int chunk_size;             /* Segment size, 0: contiguous */
+    strbuf_chunk_t *chunks;     /* Completed segments, oldest first */
+    int chunk_count;
+    int chunk_alloc;
+    int chunked_length;         /* Bytes held in chunks */
 } strbuf_t;
 
 #ifndef STRBUF_DEFAULT_SIZE
@@ -48,17 +67,28 @@ typedef struct {
 #define STRBUF_DEFAULT_INCREMENT -2
 #endif
 
+/* Report a fatal error and exit */
+extern void die(const char *fmt, ...);
+
+/* Make die() jump to *jmp within the calling thread instead of exiting.
+ * Pass NULL to restore the default. */
+extern void strbuf_set_die_jmp(jmp_buf *jmp);
+
 /* Initialise */
 extern strbuf_t *strbuf_new(int len);
 extern void strbuf_init(strbuf_t *s, int len);
 extern void strbuf_set_increment(strbuf_t *s, int increment);
+extern void strbuf_set_chunk_size(strbuf_t *s, int size);
 
 /* Release */
 extern void strbuf_free(strbuf_t *s);
 extern char *strbuf_free_to_string(strbuf_t *s, int *len);
+extern void strbuf_free_chunks(strbuf_t *s);
 
 /* Management */
 extern void strbuf_resize(strbuf_t *s, int len);
+extern void strbuf_flush_chunk(strbuf_t *s);
+extern void strbuf_join_chunks(strbuf_t *s);
 static int strbuf_empty_length(strbuf_t *s);
 static int strbuf_length(strbuf_t *s);
 static char *strbuf_string(strbuf_t *s, int *len);
@@ -75,9 +105,17 @@ static void strbuf_ensure_null(strbuf_t *s);
 /* Reset string for before use */
 static inline void strbuf_reset(strbuf_t *s)
 {
+    if (s->chunk_count)
+        strbuf_free_chunks(s);
     s->length = 0;
 }
 
+/* Discard data beyond len bytes. Chunks cannot be truncated. */
+static inline void strbuf_truncate(strbuf_t *s, int len)
+{
+    s->length = len - s->chunked_length;
+}
+
 static inline int strbuf_allocated(strbuf_t *s)
 {
     return s->buf != NULL;
@@ -96,9 +134,10 @@ static inline void strbuf_ensure_empty_length(strbuf_t *s, int len)
         strbuf_resize(s, s->length + len);
 }
 
+/* Includes data held in chunks */
 static inline int strbuf_length(strbuf_t *s)
 {
-    return s->length;
+    return s->chunked_length + s->length;
 }
 
 static inline void strbuf_append_char(strbuf_t *s, const char c)
@@ -130,6 +169,7 @@ static inline void strbuf_ensure_null(strbuf_t *s)
     s->buf[s->length] = 0;
 }
 
+/* Chunked buffers must be joined first */
 static inline char *strbuf_string(strbuf_t *s, int *len)
 {
     if (len)
@@ -138,5 +178,7 @@ static inline char *strbuf_string(strbuf_t *s, int *len)
     return s->buf;
 }
 
+#endif
+
 /* vi:ai et sw=4 ts=4:
  */
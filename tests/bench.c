@@ -0,0 +1,315 @@
+/* CJSON benchmark
+ *
+ * Embeds Lua, generates a corpus of JSON documents and reports
+ * throughput, latency percentiles and Lua allocations for
+ * cjson.decode() and cjson.encode().
+ *
+ * Usage: bench [max_size_mb [seconds]]
+ *   max_size_mb: largest document to generate (default: 100)
+ *   seconds:     minimum time spent on each measurement (default: 1)
+ *
+ * Lua allocations are counted with a lua_Alloc wrapper. Memory
+ * allocated by CJSON's own buffers is not included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "../strbuf.h"
+
+#define MIN_ITERATIONS 5
+#define MAX_ITERATIONS 10000
+
+extern int luaopen_cjson(lua_State *l);
+
+/* Lua allocations since the last reset */
+typedef struct {
+    long allocs;
+    size_t bytes;
+} alloc_stats_t;
+
+typedef void (*generator_t)(strbuf_t *json, size_t size);
+
+static unsigned long rand_state = 1;
+
+/* Deterministic generator, so runs are comparable */
+static unsigned long bench_rand(void)
+{
+    rand_state = rand_state * 6364136223846793005UL + 1442695040888963407UL;
+
+    return rand_state >> 33;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    alloc_stats_t *stats = ud;
+
+    if (!nsize) {
+        free(ptr);
+        return NULL;
+    }
+
+    if (nsize > osize) {
+        stats->allocs++;
+        stats->bytes += nsize - osize;
+    }
+
+    return realloc(ptr, nsize);
+}
+
+/* ===== CORPUS ===== */
+
+static void gen_string(strbuf_t *json, int len)
+{
+    static const char *chars[] = {
+        "a", "b", "c", "d", "e", " ", "\\\"", "\\n", "\\u00e9", "\xe2\x82\xac"
+    };
+    int i;
+
+    strbuf_append_char(json, '"');
+    for (i = 0; i < len; i++) {
+        /* Mostly ASCII, with occasional escapes and UTF-8 */
+        if (bench_rand() % 16)
+            strbuf_append_char(json, 'a' + bench_rand() % 26);
+        else
+            strbuf_append_string(json, chars[bench_rand() % 10]);
+    }
+    strbuf_append_char(json, '"');
+}
+
+static void gen_numbers(strbuf_t *json, size_t size)
+{
+    int comma = 0;
+
+    strbuf_append_char(json, '[');
+    while (strbuf_length(json) < size) {
+        if (comma)
+            strbuf_append_char(json, ',');
+        comma = 1;
+
+        switch (bench_rand() % 3) {
+        case 0:
+            strbuf_append_fmt(json, 32, "%lu", bench_rand() % 100000);
+            break;
+        case 1:
+            strbuf_append_fmt(json, 32, "%.6f",
+                              (double)bench_rand() / 1000 - 1e6);
+            break;
+        default:
+            strbuf_append_fmt(json, 32, "%.14g", (double)bench_rand() * 1e10);
+            break;
+        }
+    }
+    strbuf_append_char(json, ']');
+}
+
+static void gen_strings(strbuf_t *json, size_t size)
+{
+    int comma = 0;
+
+    strbuf_append_char(json, '[');
+    while (strbuf_length(json) < size) {
+        if (comma)
+            strbuf_append_char(json, ',');
+        comma = 1;
+        gen_string(json, 8 + bench_rand() % 120);
+    }
+    strbuf_append_char(json, ']');
+}
+
+/* Objects and arrays nested up to 100 deep */
+static void gen_nested(strbuf_t *json, size_t size)
+{
+    int depth, i;
+    int comma = 0;
+
+    strbuf_append_char(json, '[');
+    while (strbuf_length(json) < size) {
+        if (comma)
+            strbuf_append_char(json, ',');
+        comma = 1;
+
+        depth = 1 + bench_rand() % 100;
+        for (i = 0; i < depth; i++) {
+            if (i % 2)
+                strbuf_append_string(json, "[1,");
+            else
+                strbuf_append_string(json, "{\"k\":");
+        }
+        strbuf_append_string(json, "true");
+        for (i = depth - 1; i >= 0; i--)
+            strbuf_append_char(json, i % 2 ? ']' : '}');
+    }
+    strbuf_append_char(json, ']');
+}
+
+/* An array of records, similar to an API response or database rows */
+static void gen_records(strbuf_t *json, size_t size)
+{
+    unsigned long id = 0;
+    int comma = 0;
+
+    strbuf_append_char(json, '[');
+    while (strbuf_length(json) < size) {
+        if (comma)
+            strbuf_append_char(json, ',');
+        comma = 1;
+
+        strbuf_append_fmt(json, 64, "{\"id\":%lu,\"name\":", ++id);
+        gen_string(json, 5 + bench_rand() % 20);
+        strbuf_append_string(json, ",\"email\":");
+        gen_string(json, 10 + bench_rand() % 20);
+        strbuf_append_fmt(json, 64, ",\"active\":%s,\"score\":%.3f,",
+                          bench_rand() % 2 ? "true" : "false",
+                          bench_rand() % 100000 / 7.0);
+        strbuf_append_string(json, "\"tags\":[\"a\",\"b\"],\"parent\":null}");
+    }
+    strbuf_append_char(json, ']');
+}
+
+/* ===== MEASUREMENT ===== */
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Call cjson.<func> with the value in the registry slot "arg" as many
+ * times as required, and print the results */
+static void bench_call(lua_State *l, alloc_stats_t *stats, const char *func,
+                       int arg, size_t bytes, double seconds)
+{
+    static double latency[MAX_ITERATIONS];
+    double start, total;
+    int iter;
+
+    lua_gc(l, LUA_GCCOLLECT, 0);
+    stats->allocs = 0;
+    stats->bytes = 0;
+
+    total = 0;
+    for (iter = 0; iter < MAX_ITERATIONS; iter++) {
+        if (iter >= MIN_ITERATIONS && total >= seconds)
+            break;
+
+        lua_getglobal(l, "cjson");
+        lua_getfield(l, -1, func);
+        lua_rawgeti(l, LUA_REGISTRYINDEX, arg);
+
+        start = now();
+        if (lua_pcall(l, 1, 1, 0))
+            die("cjson.%s: %s", func, lua_tostring(l, -1));
+        latency[iter] = now() - start;
+        total += latency[iter];
+
+        lua_pop(l, 2);
+    }
+
+    qsort(latency, iter, sizeof(latency[0]), compare_double);
+
+    printf("  %-7s %9.1f MB/s  p50 %9.3f ms  p99 %9.3f ms  "
+           "%9ld allocs  %11.0f bytes\n",
+           func, bytes * iter / total / 1e6, latency[iter / 2] * 1e3,
+           latency[iter * 99 / 100] * 1e3,
+           stats->allocs / iter, (double)stats->bytes / iter);
+}
+
+static void bench_document(lua_State *l, alloc_stats_t *stats,
+                           const char *name, generator_t gen, size_t size,
+                           double seconds)
+{
+    strbuf_t json;
+    char *text;
+    int len, text_ref, value_ref;
+
+    strbuf_init(&json, size + 1024);
+    gen(&json, size);
+    text = strbuf_string(&json, &len);
+
+    lua_pushlstring(l, text, len);
+    text_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+    strbuf_free(&json);
+
+    lua_getglobal(l, "cjson");
+    lua_getfield(l, -1, "decode");
+    lua_rawgeti(l, LUA_REGISTRYINDEX, text_ref);
+    if (lua_pcall(l, 1, 1, 0))
+        die("cjson.decode: %s", lua_tostring(l, -1));
+    value_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+    lua_pop(l, 1);
+
+    printf("%s %d bytes\n", name, len);
+    bench_call(l, stats, "decode", text_ref, len, seconds);
+    bench_call(l, stats, "encode", value_ref, len, seconds);
+
+    luaL_unref(l, LUA_REGISTRYINDEX, text_ref);
+    luaL_unref(l, LUA_REGISTRYINDEX, value_ref);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        generator_t gen;
+    } corpus[] = {
+        { "numbers", gen_numbers },
+        { "strings", gen_strings },
+        { "nested", gen_nested },
+        { "records", gen_records },
+        { NULL, NULL }
+    };
+    static const size_t sizes[] = {
+        1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 100 * 1024 * 1024, 0
+    };
+    alloc_stats_t stats;
+    lua_State *l;
+    double max_size, seconds;
+    int i, j;
+
+    max_size = argc > 1 ? atof(argv[1]) * 1024 * 1024 : 100 * 1024 * 1024;
+    seconds = argc > 2 ? atof(argv[2]) : 1;
+
+    l = lua_newstate(bench_alloc, &stats);
+    if (!l)
+        die("Unable to create Lua state");
+    luaL_openlibs(l);
+    luaopen_cjson(l);
+    lua_pop(l, 1);
+
+    /* Allow the nested corpus to be encoded */
+    if (luaL_dostring(l, "cjson.encode_max_depth(1000)"))
+        die("%s", lua_tostring(l, -1));
+
+    for (i = 0; corpus[i].name; i++) {
+        for (j = 0; sizes[j] && sizes[j] <= max_size; j++) {
+            rand_state = 1;
+            bench_document(l, &stats, corpus[i].name, corpus[i].gen,
+                           sizes[j], seconds);
+        }
+    }
+
+    lua_close(l);
+
+    return 0;
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -0,0 +1,294 @@
+/* CJSON C API tests
+ *
+ * Embeds Lua and calls the functions declared in lua_cjson.h, and the
+ * FFI entry points declared by cjson.ffi_cdef, including their error
+ * paths. Results are reported in the same format as test.lua.
+ *
+ * Usage: capi
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "../lua_cjson.h"
+
+/* FFI entry points, see cjson.ffi_cdef */
+typedef struct {
+    int type;
+    int length;
+    union { double number; int64_t integer; int offset; int next; } value;
+} cjson_node_t;
+
+typedef struct {
+    const cjson_node_t *nodes;
+    int count;
+    const char *strings;
+} cjson_doc_t;
+
+extern cjson_doc_t *cjson_ffi_decode(const void *config, const char *json,
+                                     size_t len, char *error,
+                                     size_t error_len);
+extern void cjson_ffi_free(cjson_doc_t *doc);
+extern int cjson_ffi_encode_doc(const void *config, const cjson_doc_t *doc,
+                                int node, char *buf, size_t size);
+extern int cjson_ffi_encode_string(const void *config, const char *str,
+                                   size_t len, char *buf, size_t size);
+extern int cjson_ffi_encode_number(const void *config, double num,
+                                   char *buf, size_t size);
+
+static int failures;
+static char result[256];
+
+static void check(const char *name, const char *received,
+                  const char *expected)
+{
+    if (!strcmp(received, expected)) {
+        printf("==> Test %s: PASS\n", name);
+        return;
+    }
+
+    printf("==> Test %s: FAIL\n", name);
+    printf("[Expected] %s\n[Received] %s\n\n", expected, received);
+    failures++;
+}
+
+static void run(lua_State *l, const char *code)
+{
+    if (luaL_dostring(l, code))
+        die("%s", lua_tostring(l, -1));
+}
+
+/* ===== C API ===== */
+
+/* Arguments: strbuf_t lightuserdata, value */
+static int encode_value(lua_State *l)
+{
+    cjson_encode_to_strbuf(l, 2, lua_touserdata(l, 1));
+
+    return 0;
+}
+
+/* Arguments: strbuf_t lightuserdata, text lightuserdata, length.
+ * The decoded value is encoded again to compare it. */
+static int decode_value(lua_State *l)
+{
+    cjson_decode_buffer(l, lua_touserdata(l, 2), lua_tonumber(l, 3));
+    cjson_encode_to_strbuf(l, -1, lua_touserdata(l, 1));
+
+    return 0;
+}
+
+/* Call "func" with a buffer holding "prefix" and return the output, or
+ * the error raised */
+static const char *call(lua_State *l, lua_CFunction func, int nargs)
+{
+    strbuf_t json;
+    char *text;
+    int len;
+
+    strbuf_init(&json, 0);
+    strbuf_append_string(&json, "prefix ");
+
+    lua_pushcfunction(l, func);
+    lua_insert(l, -nargs - 1);
+    lua_pushlightuserdata(l, &json);
+    lua_insert(l, -nargs - 1);
+
+    if (lua_pcall(l, nargs + 1, 0, 0)) {
+        snprintf(result, sizeof(result), "error: %s", lua_tostring(l, -1));
+        lua_pop(l, 1);
+    } else {
+        text = strbuf_string(&json, &len);
+        snprintf(result, sizeof(result), "%.*s", len, text);
+    }
+    strbuf_free(&json);
+
+    return result;
+}
+
+static const char *encode(lua_State *l, const char *expr)
+{
+    char code[256];
+
+    snprintf(code, sizeof(code), "return %s", expr);
+    run(l, code);
+
+    return call(l, encode_value, 1);
+}
+
+static const char *decode(lua_State *l, const char *text, size_t len)
+{
+    lua_pushlightuserdata(l, (void *)text);
+    lua_pushnumber(l, len);
+
+    return call(l, decode_value, 2);
+}
+
+static void test_c_api(lua_State *l)
+{
+    /* Only the first 13 bytes are JSON, and there is no NULL
+     * terminator after them */
+    static const char partial[] = { '[', '1', ',', '2', ',', '{', '"', 'x',
+                                    '"', ':', '3', '}', ']', '4' };
+
+    /* Default settings before the module is loaded */
+    check("encode default", encode(l, "{ 1, 'a\\n', { b = true } }"),
+          "prefix [1,\"a\\n\",{\"b\":true}]");
+    check("encode error", encode(l, "{ print }"),
+          "error: Cannot serialise function: type not supported");
+    check("decode default", decode(l, partial, 13),
+          "prefix [1,2,{\"x\":3}]");
+    check("decode error", decode(l, "[1,", 3),
+          "error: Expected value but found T_END at character 4");
+    check("decode utf16", decode(l, "\0[\0]", 4),
+          "error: JSON parser does not support UTF-16 or UTF-32");
+
+    /* Settings of the loaded module */
+    luaopen_cjson(l);
+    lua_pop(l, 1);
+    run(l, "cjson.encode_max_depth(2) cjson.decode_max_depth(2)");
+    check("encode depth", encode(l, "{ { 1 } }"), "prefix [[1]]");
+    check("encode depth error", encode(l, "{ { { 1 } } }"),
+          "error: Cannot serialise, excessive nesting (3)");
+    check("decode depth error", decode(l, "[[[1]]]", 7),
+          "error: Too many nested data structures");
+    run(l, "return cjson.stats().encode_documents");
+    snprintf(result, sizeof(result), "%d", (int)lua_tonumber(l, -1));
+    lua_pop(l, 1);
+    check("stats", result, "1");
+}
+
+/* ===== FFI ===== */
+
+/* Decode "json" and encode "node" of the document again */
+static const char *ffi_cycle(const void *config, const char *json, int node,
+                             size_t size)
+{
+    cjson_doc_t *doc;
+    char error[128];
+    int len;
+
+    doc = cjson_ffi_decode(config, json, strlen(json), error, sizeof(error));
+    if (!doc) {
+        snprintf(result, sizeof(result), "error: %s", error);
+        return result;
+    }
+
+    memset(result, 0, sizeof(result));
+    len = cjson_ffi_encode_doc(config, doc, node, result, size);
+    if (len < 0 || len > (int)size)
+        snprintf(result, sizeof(result), "%d", len);
+    cjson_ffi_free(doc);
+
+    return result;
+}
+
+static const char *ffi_string(const void *config, const char *str)
+{
+    int len;
+
+    memset(result, 0, sizeof(result));
+    len = cjson_ffi_encode_string(config, str, strlen(str), result,
+                                  sizeof(result));
+    if (len < 0)
+        snprintf(result, sizeof(result), "%d", len);
+
+    return result;
+}
+
+static const char *ffi_number(const void *config, double num)
+{
+    int len;
+
+    memset(result, 0, sizeof(result));
+    len = cjson_ffi_encode_number(config, num, result, sizeof(result));
+    if (len < 0)
+        snprintf(result, sizeof(result), "%d", len);
+
+    return result;
+}
+
+static void test_ffi(lua_State *l)
+{
+    static const char *json = "{\"a\":[1,2.5,\"x\\n\"],\"b\":null}";
+    cjson_doc_t *doc;
+    const void *config, *changed;
+    char error[128];
+
+    doc = cjson_ffi_decode(NULL, json, strlen(json), error, sizeof(error));
+    snprintf(result, sizeof(result), "%d %d %d %d", doc->count,
+             doc->nodes[0].type, doc->nodes[0].length,
+             doc->nodes[0].value.next);
+    check("ffi decode", result, "8 6 2 8");
+    snprintf(result, sizeof(result), "%.*s", doc->nodes[1].length,
+             doc->strings + doc->nodes[1].value.offset);
+    check("ffi decode key", result, "a");
+    cjson_ffi_free(doc);
+    cjson_ffi_free(NULL);
+
+    /* The text does not need to be NULL terminated */
+    doc = cjson_ffi_decode(NULL, "[1,2] garbage", 5, error, sizeof(error));
+    snprintf(result, sizeof(result), "%d", doc->count);
+    check("ffi partial", result, "3");
+    cjson_ffi_free(doc);
+    check("ffi decode error", ffi_cycle(NULL, "[1,", 0, 64),
+          "error: Expected value but found T_END at character 4");
+
+    check("ffi encode doc", ffi_cycle(NULL, json, 0, 64), json);
+    check("ffi encode node", ffi_cycle(NULL, json, 2, 64),
+          "[1,2.5,\"x\\n\"]");
+    check("ffi encode size", ffi_cycle(NULL, json, 2, 4), "13");
+    check("ffi encode node error", ffi_cycle(NULL, json, 8, 64), "-1");
+    check("ffi encode badnum", ffi_cycle(NULL, "[nan]", 0, 64), "-1");
+
+    check("ffi encode string", ffi_string(NULL, "a\"b"), "\"a\\\"b\"");
+    check("ffi encode number", ffi_number(NULL, 0.5), "0.5");
+    check("ffi encode inf", ffi_number(NULL, 1.0 / 0.0), "-1");
+
+    /* Snapshots are not affected by later setting changes */
+    run(l, "return cjson.ffi_config()");
+    config = lua_touserdata(l, -1);
+    run(l, "cjson.encode_number_precision(3) cjson.refuse_invalid_utf8('encode')"
+           " return cjson.ffi_config()");
+    changed = lua_touserdata(l, -1);
+
+    check("ffi config", ffi_number(config, 1.0 / 3), "0.33333333333333");
+    check("ffi config changed", ffi_number(changed, 1.0 / 3), "0.333");
+    check("ffi config utf8", ffi_string(config, "\xff"), "\"\xff\"");
+    check("ffi config changed utf8", ffi_string(changed, "\xff"), "-1");
+    check("ffi config depth", ffi_cycle(config, "[[[1]]]", 0, 64),
+          "error: Too many nested data structures");
+    lua_pop(l, 2);
+}
+
+int main(void)
+{
+    lua_State *l;
+
+    l = luaL_newstate();
+    if (!l)
+        die("Unable to create Lua state");
+    luaL_openlibs(l);
+
+    test_c_api(l);
+    test_ffi(l);
+
+    lua_close(l);
+
+    if (failures) {
+        printf("==> %d test(s) failed\n", failures);
+        return 1;
+    }
+    printf("==> All tests passed\n");
+
+    return 0;
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -4,6 +4,9 @@ require "cjson"
 --
 -- Mark Pulford <mark@kyne.com.au>
 
+-- Lua 5.2+ moved unpack() into the table library
+local unpack = unpack or table.unpack
+
 -- Determine with a Lua table can be treated as an array.
 -- Explicitly returns "not an array" for very sparse arrays.
 -- Returns:
@@ -164,6 +164,15 @@ local encode_error_tests = {
 
 local json_nested = string.rep("[", 100000) .. string.rep("]", 100000)
 
+-- Build depth nested empty arrays without going through the decoder
+local function nested_arrays(depth)
+    local value = {}
+    for i = 2, depth do
+        value = { value }
+    end
+    return value
+end
+
 local decode_error_tests = {
     { json.decode, { '\0"\0"' },
       false, { "JSON parser does not support UTF-16 or UTF-32" } },
@@ -186,7 +195,55 @@ local decode_error_tests = {
     { json.decode, { '[ 0.4eg10 ]' },
       false, { "Expected comma or array end but found invalid token at character 6" } },
     { json.decode, { json_nested },
-      false, { "Too many nested data structures" } }
+      false, { "Too many nested data structures" } },
+    { json.decode, { string.rep("[", 1000) .. string.rep("]", 1000) },
+      true, { nested_arrays(1000) } },
+    function ()
+        json.decode_max_depth(5)
+        return "Setting decode_max_depth(5)"
+    end,
+    { json.decode, { '[[{ "a": [[[ 5 ]]] }]]' },
+      false, { "Too many nested data structures" } },
+    { json.decode, { '[{ "a": [[ 5 ]], "b": [[], {}] }]' },
+      true, { { { a = { { 5 } }, b = { {}, {} } } } } },
+    function ()
+        json.decode_max_depth(1000)
+        return "Setting decode_max_depth(1000)"
+    end,
+    -- Finalizers may decode, or change the depth limit, during a decode
+    { function ()
+          local text = "[" .. string.rep('{"a":[1,[2,{"b":[3]}]]},', 5000) ..
+                       "0]"
+          local nested = 0
+          local function finalizer()
+              json.decode('[[1,[2]],{"c":[[3]]}]')
+              json.decode_max_depth(500 + nested)
+              nested = nested + 1
+          end
+          -- Start a new collection cycle after each one, and finish
+          -- cycles quickly, so the finalizers run during the decode
+          local pause = collectgarbage("setpause", 0)
+          local stepmul = collectgarbage("setstepmul", 10000)
+          collectgarbage()
+          for i = 1, 100 do
+              if newproxy then
+                  getmetatable(newproxy(true)).__gc = finalizer
+              else
+                  setmetatable({}, { __gc = finalizer })
+              end
+          end
+          local value = json.decode(text)
+          local called = nested > 0
+          collectgarbage("setpause", pause)
+          collectgarbage("setstepmul", stepmul)
+          json.decode_max_depth(1000)
+          for i = 1, 5000 do
+              if value[i].a[1] ~= 1 or value[i].a[2][2].b[1] ~= 3 then
+                  return called, i
+              end
+          end
+          return called, #value
+      end, {}, true, { true, 5001 } },
 }
 
 local escape_tests = {
@@ -210,6 +267,890 @@ local escape_tests = {
     { json.decode, { utf16_escaped }, true, { utf8_raw } }
 }
 
+local utf8_tests = {
+    -- Invalid UTF-8 is passed through by default
+    { json.decode, { '"\255"' }, true, { "\255" } },
+    { json.encode, { "\255" }, true, { '"\255"' } },
+    function ()
+        json.refuse_invalid_utf8(true)
+        return 'Setting refuse_invalid_utf8(true)'
+    end,
+    { json.decode, { '[ "caf\195\169", "\240\159\152\128" ]' },
+      true, { { "caf\195\169", "\240\159\152\128" } } },
+    { json.encode, { "caf\195\169 long enough to skip whole words" },
+      true, { '"caf\195\169 long enough to skip whole words"' } },
+    -- Truncated sequence
+    { json.decode, { '"\195"' },
+      false, { "Expected value but found invalid UTF-8 string at character 2" } },
+    -- Overlong encoding of "/"
+    { json.decode, { '[ "ab\192\175" ]' },
+      false, { "Expected value but found invalid UTF-8 string at character 6" } },
+    -- UTF-16 surrogate encoded directly
+    { json.decode, { '"\237\160\128"' },
+      false, { "Expected value but found invalid UTF-8 string at character 2" } },
+    { json.encode, { "0123456789\255" },
+      false, { "Cannot serialise string: invalid UTF-8 string" } },
+    { json.encode, { { ["\244\144\128\128"] = true } },
+      false, { "Cannot serialise string: invalid UTF-8 string" } },
+    function ()
+        json.refuse_invalid_utf8(false)
+        return 'Setting refuse_invalid_utf8(false)'
+    end,
+}
+
+local column_tests = {
+    { json.decode_columns, { '[]' }, true, { {}, 0 } },
+    { json.decode_columns,
+      { '[ { "id": 1, "name": "one" }, { "id": 2, "name": "two" } ]' },
+      true, { { id = { 1, 2 }, name = { "one", "two" } }, 2 } },
+    -- Keys may be reordered or missing between records
+    { json.decode_columns,
+      { '[ { "a": 1, "b": [ true ] }, { "b": null, "a": 2 }, { "a": 3 } ]' },
+      true, { { a = { 1, 2, 3 }, b = { { true }, json.null } }, 3 } },
+    { json.decode_columns, { '{ "a": 1 }' },
+      false, { "Expected array but found T_OBJ_BEGIN at character 1" } },
+    { json.decode_columns, { '[ { "a": 1 }, 2 ]' },
+      false, { "Expected object but found T_NUMBER at character 15" } },
+    { json.encode_columns, { {} }, true, { '[]' } },
+    { json.encode_columns, { { id = { 1, 2 } } },
+      true, { '[{"id":1},{"id":2}]' } },
+    { json.encode_columns, { { ["a\"b"] = { "x", nil, json.null } }, 4 },
+      true, { '[{"a\\"b":"x"},{},{"a\\"b":null},{}]' } },
+    { json.encode_columns, { { id = 5 } },
+      false, { "Cannot serialise number: column must be a table" } },
+}
+
+-- Large enough (~1MB) to be split between several threads
+local big_array = "[" .. string.rep(
+    '{ "id": 12, "tags": [ "a\\"b,[", true, null, {} ], "n": -1.5e3 }, ',
+    16000) .. '"end" ]'
+local big_array_serial = json.decode(big_array)
+
+local parallel_tests = {
+    function ()
+        json.decode_threads(4, 0)
+        return "Setting decode_threads(4, 0)"
+    end,
+    { function () return compare_values(json.decode(big_array),
+                                        big_array_serial) end,
+      {}, true, { true } },
+    { function () return #json.decode(big_array) end, {}, true, { 16001 } },
+    { json.decode, { big_array .. " ]" },
+      false, { "Expected the end but found T_ARR_END at character " ..
+               #big_array + 2 } },
+    { json.decode, { "[" .. string.rep("[ 1 ],", 100000) .. "{ 2 } ]" },
+      false, { "Expected object key string but found T_NUMBER at character 600004" } },
+    function ()
+        json.decode_max_depth(3)
+        return "Setting decode_max_depth(3)"
+    end,
+    { json.decode, { big_array }, false, { "Too many nested data structures" } },
+    function ()
+        json.decode_max_depth(1000)
+        return "Setting decode_max_depth(1000)"
+    end,
+    function ()
+        json.decode_threads(1)
+        return "Setting decode_threads(1)"
+    end,
+}
+
+local json2 = json.new()
+
+local instance_tests = {
+    function ()
+        json2.encode_max_depth(1)
+        json2.refuse_invalid_numbers(false)
+        return "Setting instance encode_max_depth(1) / refuse_invalid_numbers(false)"
+    end,
+    { json2.encode, { { { 1 } } },
+      false, { "Cannot serialise, excessive nesting (2)" } },
+    { json.encode, { { { 1 } } }, true, { '[[1]]' } },
+    { json2.encode, { { Inf } }, true, { '[inf]' } },
+    { json.encode, { { Inf } },
+      false, { "Cannot serialise number: must not be NaN or Inf" } },
+    { json2.encode_max_depth, {}, true, { 1 } },
+    { json2.decode, { '[ "instance" ]' }, true, { { "instance" } } },
+    { function () return json2.null == json.null end, {}, true, { true } },
+}
+
+local async_value = { 1, "a\n\"", { b = true }, { [2] = false }, json.null }
+
+local function encode_async(value)
+    return json.encode_async(value):join()
+end
+
+local async_tests = {
+    { encode_async, { async_value }, true, { json.encode(async_value) } },
+    { encode_async, { { [5] = 0.5 } }, true, { '{"5":0.5}' } },
+    { encode_async, { "string" }, true, { '"string"' } },
+    { function ()
+          local value = { "before" }
+          local handle = json.encode_async(value)
+          value[1] = "after"
+          return handle:join(), handle:join()
+      end, {}, true, { '["before"]', '["before"]' } },
+    { function ()
+          local handle = json.encode_async({ 1 })
+          handle:join()
+          return handle:ready()
+      end, {}, true, { true } },
+    { json.encode_async, { { NaN } },
+      false, { "Cannot serialise number: must not be NaN or Inf" } },
+    { json.encode_async, { { function () end } },
+      false, { "Cannot serialise function: type not supported" } },
+}
+
+local shared_json = '{ "routes": [ 1, "two", { "three": null } ], "name": "x" }'
+
+local shared_tests = {
+    { function ()
+          local doc = json.shared("test", shared_json)
+          return doc.name, #doc.routes, doc.routes[2], doc.routes[3].three
+      end, {}, true, { "x", 3, "two", json.null } },
+    { function ()
+          local doc = json.shared("test", shared_json)
+          return json2.shared("test") ~= nil, json2.shared("test").name
+      end, {}, true, { true, "x" } },
+    { function ()
+          local doc = json.shared("test", shared_json)
+          return doc.missing, doc.routes[0], doc.routes[4], doc.routes.x
+      end, {}, true, { nil, nil, nil, nil } },
+    { function ()
+          local doc = json.shared("test", shared_json)
+          return json.shared_copy(doc.routes)
+      end, {}, true, { { 1, "two", { three = json.null } } } },
+    { function ()
+          local doc = json.shared("duplicate", '{ "a": 1, "b": 2, "a": 3 }')
+          return doc.a, doc.b, json.decode('{ "a": 1, "b": 2, "a": 3 }').a
+      end, {}, true, { 3, 2, 3 } },
+    { function ()
+          local fields = {}
+          for i = 1, 100 do
+              fields[i] = string.format('"k%d": %d', i, i)
+          end
+          local doc = json.shared("keys", "{" .. table.concat(fields, ",") .. "}")
+          for i = 1, 100 do
+              if doc["k" .. i] ~= i then return false end
+          end
+          return true, doc.k0, doc.k101, doc[""]
+      end, {}, true, { true, nil, nil, nil } },
+    { json.shared, { "missing" }, true, { nil } },
+    { json.shared, { "invalid", '[ 1, 2 ' },
+      false, { "Expected comma or array end but found T_END at character 8" } },
+    { json.shared, { "scalar", '"text"' },
+      false, { "Shared JSON must be an array or object" } },
+}
+
+-- Run a cjson.decoder() or cjson.encoder() in a coroutine which yields
+-- after each step
+local function run_steps(stepper, budget)
+    local co = coroutine.wrap(function ()
+        while true do
+            local done, result = stepper:step(budget)
+            if done then return result end
+            coroutine.yield()
+        end
+    end)
+    local result
+    repeat result = co() until result ~= nil
+    return result
+end
+
+local step_decoder = json.decoder('[ 1, 2, ]')
+local step_end = json.decoder('{ "a": 1 } 2')
+local step_colon = json.decoder('{ "a" 1 }')
+local step_comma = json.decoder('{ "a": 1, }')
+local step_deep = json.decoder(string.rep("[", 1001) .. string.rep("]", 1001))
+local step_nested = json.encoder(json.decode(string.rep("[", 21) ..
+                                             string.rep("]", 21)))
+local step_nan = json.encoder({ { NaN } })
+local step_json = '[ 1, "two", { "three": [ null, true, {} ] }, [ [ ] ], -5e3 ]'
+
+local step_tests = {
+    { function () return run_steps(json.decoder(step_json), 1) end,
+      {}, true, { json.decode(step_json) } },
+    { function () return run_steps(json.decoder(step_json), 1000) end,
+      {}, true, { json.decode(step_json) } },
+    { function () return run_steps(json.decoder(' "string" '), 1) end,
+      {}, true, { "string" } },
+    { function ()
+          local decoder = json.decoder('[ 1, 2, 3 ]')
+          return decoder:step(3), (decoder:step(100))
+      end, {}, true, { false, true } },
+    { step_decoder.step, { step_decoder, 100 },
+      false, { "Expected value but found T_ARR_END at character 9" } },
+    { step_decoder.step, { step_decoder, 100 },
+      false, { "Cannot resume after an error" } },
+    { step_end.step, { step_end, 100 },
+      false, { "Expected the end but found T_NUMBER at character 12" } },
+    { step_colon.step, { step_colon, 100 },
+      false, { "Expected colon but found T_NUMBER at character 7" } },
+    { step_comma.step, { step_comma, 100 },
+      false, { "Expected object key string but found T_OBJ_END at character 11" } },
+    { step_deep.step, { step_deep, 10000 },
+      false, { "Too many nested data structures" } },
+    { function () return run_steps(json.encoder(json.decode(step_json)), 1) end,
+      {}, true, { json.encode(json.decode(step_json)) } },
+    { function () return run_steps(json.encoder({ [3] = { a = "b" } }), 2) end,
+      {}, true, { '[null,null,{"a":"b"}]' } },
+    { function () return run_steps(json.encoder("string"), 1) end,
+      {}, true, { '"string"' } },
+    { step_nested.step, { step_nested, 100 },
+      false, { "Cannot serialise, excessive nesting (21)" } },
+    { step_nan.step, { step_nan, 100 },
+      false, { "Cannot serialise number: must not be NaN or Inf" } },
+}
+
+local tape_json = '[ 1.5, -0, "a\\u00e9\\"", null, true, false, { "k": [ {} ], "": [] } ]'
+local tape_blob = json.to_tape(tape_json)
+
+local tape_tests = {
+    { json.from_tape, { tape_blob }, true, { json.decode(tape_json) } },
+    { function () return json.from_tape(json.to_tape('"text"')) end,
+      {}, true, { "text" } },
+    { function () return json.from_tape(json.to_tape('1e300')) end,
+      {}, true, { 1e300 } },
+    { json.to_tape, { '[ 1, 2 ' },
+      false, { "Expected comma or array end but found T_END at character 8" } },
+    { json.from_tape, { '[ 1 ]' }, false, { "Invalid JSON tape" } },
+    { json.from_tape, { tape_blob:sub(1, -2) }, false, { "Invalid JSON tape" } },
+    { json.from_tape, { tape_blob:sub(1, 7) .. "\3" .. tape_blob:sub(9) },
+      false, { "Unsupported JSON tape version 3" } },
+    { json.from_tape, { tape_blob .. "x" }, false, { "Invalid JSON tape" } },
+    -- Array claiming 2 elements, followed by a single number
+    { json.from_tape, { "CJSONTP\1\2\0\0\0\0\0\0\0\5\2\0\0\0\0" },
+      false, { "Invalid JSON tape" } },
+}
+
+local msgpack_value = { 1, -1, -33, 200, 70000, -70000, 2^40, -2^40, 0.5,
+                        "str", string.rep("x", 40), true, false, json.null,
+                        { a = { 1 }, [5] = "five" }, {} }
+
+local msgpack_tests = {
+    { function () return json.decode_msgpack(json.encode_msgpack(msgpack_value)) end,
+      {}, true, { json.decode(json.encode(msgpack_value)) } },
+    { json.encode_msgpack, { { 1, "a", true, json.null } },
+      true, { "\148\1\161a\195\192" } },
+    { json.encode_msgpack, { -1.5 }, true, { "\203\191\248\0\0\0\0\0\0" } },
+    { json.encode_msgpack, { 255 }, true, { "\204\255" } },
+    { json.encode_msgpack, { -128 }, true, { "\208\128" } },
+    { json.encode_msgpack, { { [2] = 1 } }, true, { "\146\192\1" } },
+    { json.decode_msgpack, { "\129\161k\147\1\255\192" },
+      true, { { k = { 1, -1, json.null } } } },
+    { json.decode_msgpack, { "\202\63\128\0\0" }, true, { 1 } },
+    { json.decode_msgpack, { "\209\255\0" }, true, { -256 } },
+    { json.decode_msgpack, { "\196\2hi" }, true, { "hi" } },
+    { json.decode_msgpack, { "\147\1\2" },
+      false, { "Truncated MessagePack data at byte 1" } },
+    { json.decode_msgpack, { "\129\1\2" },
+      false, { "MessagePack map key must be a string at byte 2" } },
+    { json.decode_msgpack, { "\1\2" },
+      false, { "Unexpected data after MessagePack value at byte 2" } },
+    { json.decode_msgpack, { "\145\199\0\0" },
+      false, { "Unsupported MessagePack type at byte 2" } },
+    { json.encode_msgpack, { { NaN } },
+      false, { "Cannot serialise number: must not be NaN or Inf" } },
+    { json.encode_msgpack, { { { { { { { 1 } } } } } } },
+      false, { "Cannot serialise, excessive nesting (6)" } },
+}
+
+-- Counters are cumulative, so each test resets them first
+local function stats_after(func, ...)
+    json.reset_stats()
+    func(...)
+    local stats = json.stats()
+    return stats.decode_documents, stats.decode_tables,
+           stats.decode_escapes, stats.decode_numbers,
+           stats.encode_documents, stats.encode_escaped_strings,
+           stats.encode_numbers
+end
+
+local stats_tests = {
+    { stats_after, { json.decode, '[1,"a\\n",{"b":2.5}]' },
+      true, { 1, 2, 1, 1, 0, 0, 0 } },
+    { stats_after, { json.encode, { "a\n", "b", 1, 0.5 } },
+      true, { 0, 0, 0, 0, 1, 1, 1 } },
+    { function ()
+          json.reset_stats()
+          json.encode("abc")
+          local stats = json.stats()
+          return stats.encode_bytes, stats.encode_buffer_peak >= 5
+      end, {}, true, { 5, true } },
+    { function ()
+          json.reset_stats()
+          pcall(json.decode, "[1,")
+          return json.stats().decode_documents
+      end, {}, true, { 0 } },
+    { function ()
+          local other = json.new()
+          json.reset_stats()
+          other.decode("[]")
+          return json.stats().decode_documents, other.stats().decode_documents
+      end, {}, true, { 0, 1 } },
+}
+
+-- Kernel inputs are long enough for every vector width, with special
+-- characters beyond the first 64 bytes
+local kernel_padding = string.rep(" \t\r\n", 20)
+local kernel_string = string.rep("abcdefgh", 9) .. "\\\"/\0\1\127\195\169" ..
+                      string.rep("z", 70)
+local kernel_encoded = '"' .. string.rep("abcdefgh", 9) ..
+                       '\\\\\\"\\/\\u0000\\u0001\\u007f\195\169' ..
+                       string.rep("z", 70) .. '"'
+local kernel_json = "[" .. kernel_padding .. kernel_encoded .. "," ..
+                    kernel_padding .. "12345678,123456789012345," ..
+                    "1234567890123456,-12,0,1.5,2e3,0x10," .. kernel_padding ..
+                    '"\\u00e9' .. string.rep("x", 100) .. '"' ..
+                    kernel_padding .. "]"
+local kernel_value = { kernel_string, 12345678, 123456789012345,
+                       1234567890123456, -12, 0, 1.5, 2000, 16,
+                       "\195\169" .. string.rep("x", 100) }
+
+-- Run func with the kernels restricted to "level", if supported
+local function kernel_run(level, func, ...)
+    if json.features().cpu[level] then
+        json.features(level)
+    end
+    local ok, result = pcall(func, ...)
+    json.features("auto")
+    if not ok then
+        error(result, 0)
+    end
+    return result
+end
+
+local function kernel_invalid_utf8()
+    json.refuse_invalid_utf8("decode")
+    local ok, err = pcall(json.decode, '"' .. string.rep("a", 80) .. '\255"')
+    json.refuse_invalid_utf8(false)
+    return ok, err
+end
+
+-- Long runs, so each vector width is used
+local kernel_minified = '{"' .. string.rep("key ", 20) .. '":[' ..
+                        string.rep("123456789,", 20) .. '"' ..
+                        string.rep(" \\\"", 20) .. '",{}]}'
+local kernel_pretty = '{\n   "' .. string.rep("key ", 20) .. '": [\n' ..
+                      string.rep("      123456789,\n", 20) .. '      "' ..
+                      string.rep(" \\\"", 20) .. '",\n      {}\n   ]\n}'
+
+local kernel_tests = {
+    { function ()
+          local features = json.features("scalar")
+          json.features("auto")
+          return features.cpu.scalar, features.level, features.whitespace,
+                 features.string, features.escape, features.digits,
+                 features.text
+      end, {}, true, { true, "scalar", "scalar", "scalar", "scalar",
+                       "scalar", "scalar" } },
+    { function ()
+          local ok, err = pcall(json.features, "mmx")
+          return ok, err:find("invalid option 'mmx'", 1, true) ~= nil
+      end, {}, true, { false, true } },
+}
+
+for _, level in ipairs({ "scalar", "sse2", "sse4.2", "avx2", "avx512" }) do
+    table.insert(kernel_tests, { kernel_run, { level, json.decode, kernel_json },
+                                 true, { kernel_value } })
+    table.insert(kernel_tests, { kernel_run, { level, json.encode, kernel_string },
+                                 true, { kernel_encoded } })
+    table.insert(kernel_tests, { kernel_run, { level, kernel_invalid_utf8 },
+                                 true, { false } })
+    table.insert(kernel_tests, { kernel_run, { level, json.minify, kernel_pretty },
+                                 true, { kernel_minified } })
+    table.insert(kernel_tests, { kernel_run,
+                                 { level, json.reformat, kernel_minified, 3 },
+                                 true, { kernel_pretty } })
+end
+
+local ffi_tests = {
+    { function () return type(json.ffi_config()) end, {}, true, { "userdata" } },
+    { function () return json.ffi_config() == json.new().ffi_config() end,
+      {}, true, { false } },
+    { function ()
+          return json.ffi_cdef:find("cjson_ffi_decode", 1, true) ~= nil,
+                 json.ffi_cdef:find("cjson_ffi_encode_doc", 1, true) ~= nil,
+                 json.ffi_cdef:find("cjson_ffi_encode_string", 1, true) ~= nil
+      end, {}, true, { true, true, true } },
+}
+
+-- Call the FFI entry points when running under LuaJIT
+local ffi_ok, ffi = pcall(require, "ffi")
+if ffi_ok and package.searchpath then
+    ffi.cdef(json.ffi_cdef)
+    local C = ffi.load(package.searchpath("cjson", package.cpath))
+    local buf = ffi.new("char[64]")
+    local err = ffi.new("char[128]")
+
+    local function ffi_decode(config, text)
+        local doc = C.cjson_ffi_decode(config, text, #text, err, 128)
+        if doc == nil then
+            return ffi.string(err)
+        end
+        return doc
+    end
+    local function ffi_encode_doc(config, text, node, size)
+        local doc = ffi_decode(config, text)
+        local len = C.cjson_ffi_encode_doc(config, doc, node, buf, size or 64)
+        C.cjson_ffi_free(doc)
+        if len < 0 or len > (size or 64) then
+            return len
+        end
+        return len, ffi.string(buf, len)
+    end
+    local function ffi_encode(func, config, ...)
+        local len = C[func](config, ...)
+        if len < 0 then
+            return len
+        end
+        return len, ffi.string(buf, len)
+    end
+
+    local config_json = json.new()
+    local config = config_json.ffi_config()
+    config_json.encode_number_precision(3)
+    config_json.refuse_invalid_numbers("none")
+    config_json.refuse_invalid_utf8("encode")
+    config_json.decode_max_depth(3)
+    local config_new = config_json.ffi_config()
+
+    local doc_text = '{"a":[1,2.5,"x\\n"],"b":null}'
+    for _, test in ipairs({
+        { function ()
+              local doc = ffi_decode(nil, doc_text)
+              local result = { doc.count, doc.nodes[0].type,
+                               doc.nodes[0].length, doc.nodes[0].value.next }
+              C.cjson_ffi_free(doc)
+              return unpack(result)
+          end, {}, true, { 8, 6, 2, 8 } },
+        { function () C.cjson_ffi_free(nil) return true end, {}, true,
+          { true } },
+        { ffi_decode, { nil, '[1,' }, true,
+          { "Expected value but found T_END at character 4" } },
+        { ffi_decode, { nil, '[1] x' }, true,
+          { "Expected the end but found invalid token at character 5" } },
+        { ffi_decode, { config_new, '[[[[[[]]]]]]' }, true,
+          { "Too many nested data structures" } },
+        { ffi_encode_doc, { nil, doc_text, 0 }, true, { 28, doc_text } },
+        { ffi_encode_doc, { nil, doc_text, 2 }, true, { 13, '[1,2.5,"x\\n"]' } },
+        { ffi_encode_doc, { nil, doc_text, 7 }, true, { 4, 'null' } },
+        { ffi_encode_doc, { nil, doc_text, 0, 4 }, true, { 28 } },
+        { ffi_encode_doc, { nil, doc_text, 8 }, true, { -1 } },
+        { ffi_encode_doc, { nil, doc_text, -1 }, true, { -1 } },
+        { ffi_encode_doc, { nil, '[1,nan]', 0 }, true, { -1 } },
+        { ffi_encode, { "cjson_ffi_encode_string", nil, 'a"b', 3, buf, 64 },
+          true, { 6, '"a\\"b"' } },
+        { ffi_encode, { "cjson_ffi_encode_string", nil, '\255', 1, buf, 64 },
+          true, { 3, '"\255"' } },
+        { ffi_encode, { "cjson_ffi_encode_string", config_new, '\255', 1,
+                        buf, 64 }, true, { -1 } },
+        { ffi_encode, { "cjson_ffi_encode_number", nil, 1/3, buf, 64 },
+          true, { 16, "0.33333333333333" } },
+        -- Later setting changes do not affect an earlier snapshot
+        { ffi_encode, { "cjson_ffi_encode_number", config, 1/3, buf, 64 },
+          true, { 16, "0.33333333333333" } },
+        { ffi_encode, { "cjson_ffi_encode_number", config, 1/0, buf, 64 },
+          true, { -1 } },
+        { ffi_encode, { "cjson_ffi_encode_number", config_new, 1/3, buf, 64 },
+          true, { 5, "0.333" } },
+        { ffi_encode, { "cjson_ffi_encode_number", config_new, 1/0, buf, 64 },
+          true, { 3, "inf" } },
+    }) do
+        table.insert(ffi_tests, test)
+    end
+end
+
+-- Lua 5.3+ decodes integers exactly, earlier versions use doubles
+local lua_integers = math.type ~= nil
+local function integer_encode_cycle(text)
+    return json.encode(json.decode(text))
+end
+
+local integer_tests = {
+    { json.encode, { { 1, -20, 12345678901234, 1e14, 2^53, 0.5 } },
+      true, { '[1,-20,12345678901234,1e+14,9.007199254741e+15,0.5]' } },
+    { json.decode, { '[ 0, -0, 9007199254740993, 12345678901234567890 ]' },
+      true, { { 0, -0, 9007199254740993, 1.2345678901234567e19 } } },
+    { integer_encode_cycle, { '[9223372036854775807,-9223372036854775808]' },
+      true, { lua_integers and '[9223372036854775807,-9223372036854775808]' or
+              '[9.2233720368548e+18,-9.2233720368548e+18]' } },
+    { integer_encode_cycle, { '{"1234567890123456789":1234567890123456789}' },
+      true, { lua_integers and '{"1234567890123456789":1234567890123456789}' or
+              '{"1234567890123456789":1.2345678901235e+18}' } },
+    { function ()
+          return json.from_tape(json.to_tape('[ 1, -5, 123456789012 ]'))
+      end, {}, true, { { 1, -5, 123456789012 } } },
+    -- Version 1 tapes do not contain integers, and are still supported
+    { json.from_tape, { tape_blob:sub(1, 7) .. "\1" .. tape_blob:sub(9) },
+      true, { json.decode(tape_json) } },
+    { function ()
+          return json.decode_msgpack(json.encode_msgpack({ 1, -1, 2^40, -2^40 }))
+      end, {}, true, { { 1, -1, 2^40, -2^40 } } },
+}
+
+-- Argument errors name the function on Lua 5.2+, so only compare the
+-- reason
+local function arg_error(func, ...)
+    local ok, err = pcall(func, ...)
+    return ok, err:match("^bad argument #(%d+) to '.*' %((.*)%)$")
+end
+
+local limit_tests = {
+    { json.decode, { '[1,"ab",{"c":[]}]', { max_bytes = 17, max_depth = 3,
+                                             max_elements = 5,
+                                             max_string_bytes = 3 } },
+      true, { { 1, "ab", { c = {} } } } },
+    { json.decode, { '[1,"ab",{"c":[]}]', { max_bytes = 16 } },
+      false, { "Decode limit max_bytes exceeded" } },
+    { json.decode, { '[1,"ab",{"c":[]}]', { max_depth = 2 } },
+      false, { "Too many nested data structures" } },
+    { json.decode, { '[1,"ab",{"c":[]}]', { max_elements = 4 } },
+      false, { "Decode limit max_elements exceeded at character 14" } },
+    { json.decode, { '[1,"ab",{"c":[]}]', { max_string_bytes = 2 } },
+      false, { "Decode limit max_string_bytes exceeded at character 12" } },
+    { function ()
+          local text = "[" .. string.rep("{},", 100000) .. "{}]"
+          return pcall(json.decode, text, { max_elements = 1000 })
+      end, {}, true,
+      { false, "Decode limit max_elements exceeded at character 2999" } },
+    { arg_error, { json.decode, '[]', { max_depth = -1 } },
+      true, { false, "2", "max_depth must be a non-negative number" } },
+}
+
+local packed_json = json.new()
+local packed_text = '[[1,2,3],[1,"a",3],[1,2],{"k":[0.5,-1,1e3]}]'
+local packed_numbers = "[" .. string.rep("1.5,", 199999) .. "2]"
+
+local function packed_types(text)
+    local value = packed_json.decode(text)
+    return type(value[1]), #value[1], value[1][2], value[1][4],
+           type(value[2]), type(value[3]), type(value[4].k), value[4].k[3]
+end
+
+local packed_tests = {
+    { packed_json.decode_packed_arrays, { true, 3 }, true, { true, 3 } },
+    { packed_types, { packed_text },
+      true, { "userdata", 3, 2, nil, "table", "table", "userdata", 1000 } },
+    { function ()
+          return packed_json.encode(packed_json.decode(packed_text))
+      end, {}, true, { '[[1,2,3],[1,"a",3],[1,2],{"k":[0.5,-1,1000]}]' } },
+    { function ()
+          return packed_json.encode_async(packed_json.decode(packed_text)):join()
+      end, {}, true, { '[[1,2,3],[1,"a",3],[1,2],{"k":[0.5,-1,1000]}]' } },
+    { function ()
+          return packed_json.decode_msgpack(
+              packed_json.encode_msgpack(packed_json.decode(packed_text)))
+      end, {}, true, { { { 1, 2, 3 }, { 1, "a", 3 }, { 1, 2 },
+                         { k = { 0.5, -1, 1000 } } } } },
+    { packed_json.decode, { '[1,2,3,]' },
+      false, { "Expected value but found T_ARR_END at character 8" } },
+    { packed_json.decode, { '[1,2,[3,4,5]]', { max_elements = 6 } },
+      false, { "Decode limit max_elements exceeded at character 12" } },
+    { packed_json.decode, { '[1,2,[3,4,5]]', { max_depth = 1 } },
+      false, { "Too many nested data structures" } },
+    -- Large top level arrays are not split between threads
+    { function ()
+          packed_json.decode_threads(4, 0)
+          local value = packed_json.decode(packed_numbers)
+          packed_json.decode_threads(1)
+          return type(value), #value, value[1], value[200000]
+      end, {}, true, { "userdata", 200000, 1.5, 2 } },
+    -- Integral elements are integers, the same as decoded tables
+    { function ()
+          local value = packed_json.decode('[1,2.5,-3]')
+          if not lua_integers then
+              return value[1], value[2], value[3]
+          end
+          return math.type(value[1]), math.type(value[2]), math.type(value[3])
+      end, {}, true, lua_integers and { "integer", "float", "integer" } or
+                                      { 1, 2.5, -3 } },
+    { function ()
+          local value = packed_json.decode('[1,2,3]')
+          return value[0] == nil, value[1.5] == nil, value[4] == nil,
+                 value[2^40] == nil, value[math.huge] == nil,
+                 value[-math.huge] == nil, value[0/0] == nil
+      end, {}, true, { true, true, true, true, true, true, true } },
+}
+
+local cache_json = json.new()
+local cache_text = '{ "flags": [ "a", "b" ], "limit": 10 }'
+
+-- Decode each text in order, and return the cache hits and misses
+local function cache_run(...)
+    cache_json.reset_stats()
+    for i = 1, select("#", ...) do
+        cache_json.decode_cached((select(i, ...)))
+    end
+    local stats = cache_json.stats()
+    return stats.decode_cache_hits, stats.decode_cache_misses
+end
+
+local cache_tests = {
+    { function ()
+          local doc = cache_json.decode_cached(cache_text)
+          return type(doc), doc.limit, #doc.flags, doc.flags[2]
+      end, {}, true, { "userdata", 10, 2, "b" } },
+    { function ()
+          local doc = cache_json.decode_cached(cache_text)
+          return cache_json.shared_copy(doc)
+      end, {}, true, { { flags = { "a", "b" }, limit = 10 } } },
+    { cache_json.decode_cache_size, { 2 }, true, { 2 } },
+    { cache_run, { "[1]", "[2]", "[1]", "[2]" }, true, { 2, 2 } },
+    -- "[1]" is evicted by "[3]", as "[2]" was used more recently
+    { cache_run, { "[2]", "[3]", "[2]", "[1]" }, true, { 2, 2 } },
+    { cache_json.decode_cached, { '"text"' }, true, { "text" } },
+    { cache_json.decode_cached, { '[1,' },
+      false, { "Expected value but found T_END at character 4" } },
+    { cache_json.decode_cache_size, { 0 }, true, { 0 } },
+    { function ()
+          local hits, misses = cache_run("[1]", "[1]")
+          return hits, misses, cache_json.decode_cached("[1]")[1]
+      end, {}, true, { 0, 2, 1 } },
+    { arg_error, { cache_json.decode_cache_size, -1 },
+      true, { false, "1", "expected non-negative integer" } },
+}
+
+local function canonical_large()
+    local value = {}
+    for i = 1, 500 do
+        value["key" .. i] = { i, "value " .. i, { nested = i % 3 == 0, b = 1.5 } }
+    end
+    local text, digest = json.encode_canonical(value)
+    return #text, text:sub(1, 47), digest
+end
+
+local canonical_tests = {
+    { json.encode_canonical, { { b = 1, a = { d = 2, c = 3 }, [1.5] = "x",
+                                 ["a b"] = 0 } },
+      true, { '{"1.5":"x","a":{"c":3,"d":2},"a b":0,"b":1}',
+              "a733f18a2e4127d8" } },
+    { json.encode_canonical, { "abc" }, true, { '"abc"', "b1eecd3f6492c244" } },
+    { json.encode_canonical, { { 3, 1, { z = 1, y = 2 } } },
+      true, { '[3,1,{"y":2,"z":1}]', "1a4bae03c2460639" } },
+    -- Output is hashed in blocks while it is written
+    { canonical_large, {},
+      true, { 25511, '{"key1":[1,"value 1",{"b":1.5,"nested":false}],',
+              "aef9bb644db02e52" } },
+    { json.encode_canonical, { { [true] = 1 } },
+      false, { "Cannot serialise boolean: table key must be a number or string" } },
+    { json.encode, { { a = 1 } }, true, { '{"a":1}' } },
+}
+
+local edit_text = '{ "a": [ 1, 2, 3 ], "b": { "c": "x" }, "d~/": true }'
+
+local edit_tests = {
+    { json.set, { edit_text, "/b/c", { 5 } },
+      true, { '{ "a": [ 1, 2, 3 ], "b": { "c": [5] }, "d~/": true }' } },
+    { json.set, { edit_text, "/a/1", "two" },
+      true, { '{ "a": [ 1, "two", 3 ], "b": { "c": "x" }, "d~/": true }' } },
+    { json.set, { edit_text, "/d~0~1", false },
+      true, { '{ "a": [ 1, 2, 3 ], "b": { "c": "x" }, "d~/": false }' } },
+    { json.set, { edit_text, "/b/new", json.null },
+      true, { '{ "a": [ 1, 2, 3 ], "b": { "c": "x","new":null }, "d~/": true }' } },
+    { json.set, { edit_text, "/a/-", 4 },
+      true, { '{ "a": [ 1, 2, 3,4 ], "b": { "c": "x" }, "d~/": true }' } },
+    { json.set, { '{"a":[],"b":{}}', "/b/k\"", 1 },
+      true, { '{"a":[],"b":{"k\\"":1}}' } },
+    { json.set, { '{"a":[],"b":{}}', "/a/0", 1 },
+      true, { '{"a":[1],"b":{}}' } },
+    { json.set, { ' [1] ', "", "x" }, true, { ' "x" ' } },
+    { json.delete, { edit_text, "/a/0" },
+      true, { '{ "a": [ 2, 3 ], "b": { "c": "x" }, "d~/": true }' } },
+    { json.delete, { edit_text, "/a/2" },
+      true, { '{ "a": [ 1, 2 ], "b": { "c": "x" }, "d~/": true }' } },
+    { json.delete, { edit_text, "/b/c" },
+      true, { '{ "a": [ 1, 2, 3 ], "b": {  }, "d~/": true }' } },
+    { json.delete, { edit_text, "/d~0~1" },
+      true, { '{ "a": [ 1, 2, 3 ], "b": { "c": "x" } }' } },
+    { json.delete, { edit_text, "/b/x" },
+      false, { 'JSON pointer "/b/x" does not exist' } },
+    { json.set, { edit_text, "/a/5", 1 },
+      false, { 'JSON pointer "/a/5" does not exist' } },
+    { json.set, { edit_text, "/x/y", 1 },
+      false, { 'JSON pointer "/x/y" does not exist' } },
+    { json.set, { edit_text, "/a/01", 1 },
+      false, { 'JSON pointer "/a/01" has an invalid array index' } },
+    { arg_error, { json.set, edit_text, "a", 1 },
+      true, { false, "2", "invalid JSON pointer" } },
+    { json.set, { '{ "a": [ 1, 2 ', "/b", 1 },
+      false, { "Expected comma or array end but found T_END at character 15" } },
+    -- Text after the target is checked too
+    { json.set, { '[ 1, 2 ', "/0", 3 },
+      false, { "Expected comma or array end but found T_END at character 8" } },
+    { json.set, { '[1,]', "/1", 2 },
+      false, { "Expected value but found T_ARR_END at character 4" } },
+    { json.set, { '{"a":1} junk', "/a", 2 },
+      false, { "Expected the end but found invalid token at character 9" } },
+    { json.delete, { '{"a":1,"b":[2,}', "/a" },
+      false, { "Expected value but found T_OBJ_END at character 15" } },
+    { json.set, { '[[1],[2]]', "/0/0", 3 }, true, { '[[3],[2]]' } },
+    -- The last duplicate key is edited, since it is the one decoded
+    { json.set, { '{"a":1,"a":2}', "/a", 5 }, true, { '{"a":1,"a":5}' } },
+    { json.delete, { '{"a":1,"b":2,"a":3}', "/a" },
+      true, { '{"a":1,"b":2}' } },
+    { json.set, { '{"a":{"x":1},"a":{"y":2},"b":0}', "/a/y", 3 },
+      true, { '{"a":{"x":1},"a":{"y":3},"b":0}' } },
+    { json.set, { '{"a":{"x":1},"a":{"y":2}}', "/a/x", 3 },
+      true, { '{"a":{"x":1},"a":{"y":2,"x":3}}' } },
+    { json.set, { '{"a":1,"a":2,}', "/a", 5 },
+      false, { "Expected object key string but found T_OBJ_END at character 14" } },
+}
+
+local format_tests = {
+    -- Whitespace between bare tokens is kept
+    { json.minify, { '[1 2]' }, true, { '[1 2]' } },
+    { json.minify, { '{"a": tr\n ue }' }, true, { '{"a":tr ue}' } },
+    { json.reformat, { '[1 2]' }, true, { '[\n  1 2\n]' } },
+    { json.reformat, { '{"a": tr ue}' }, true, { '{\n  "a": tr ue\n}' } },
+    { json.minify, { ' { "a b" : [ 1 , 2 ],\n\t"c\\" ": null }\r\n' },
+      true, { '{"a b":[1,2],"c\\" ":null}' } },
+    { json.minify, { ' "x" ' }, true, { '"x"' } },
+    { json.minify, { '' }, true, { '' } },
+    { json.reformat, { '{"a":[1,2],"b":{},"c":[ ],"d":"{[,:"}' },
+      true, { '{\n  "a": [\n    1,\n    2\n  ],\n  "b": {},\n  "c": [],\n' ..
+              '  "d": "{[,:"\n}' } },
+    { json.reformat, { ' [ { "a" : true } ] ', "\t" },
+      true, { '[\n\t{\n\t\t"a": true\n\t}\n]' } },
+    { json.reformat, { '[1,2]', 0 }, true, { '[\n1,\n2\n]' } },
+    { json.reformat, { '-1.5e3' }, true, { '-1.5e3' } },
+    { json.minify, { '["abc\\"]' },
+      false, { "Unterminated string at character 2" } },
+    { json.reformat, { '[1]]' }, false, { "Unbalanced bracket at character 4" } },
+    { json.reformat, { '[[1]' }, false, { "Unbalanced bracket at character 5" } },
+    { arg_error, { json.reformat, "[]", 17 },
+      true, { false, "2", "expected integer between 0 and 16" } },
+    { function ()
+          local text = file_load("example2.json")
+          return compare_values(json.decode(json.reformat(text)),
+                                json.decode(text)),
+                 json.minify(json.reformat(json.minify(text))) == json.minify(text)
+      end, {}, true, { true, true } },
+}
+
+local analyze_text = '{"a":[1,2,"x\\ny"],"b":{"a":null,"c":[]},' ..
+                     '"c":true,"a\\u0062":"hello"}'
+
+local function analyze_shape(text, top)
+    local a = json.analyze(text, top)
+    local keys = {}
+    for i, key in ipairs(a.keys.top) do
+        keys[i] = key.key .. "=" .. key.count
+    end
+    return a.values, a.max_depth, a.average_depth, a.numbers, a.booleans,
+           a.nulls, a.strings.escaped, table.concat(keys, " ")
+end
+
+local analyze_tests = {
+    { analyze_shape, { analyze_text },
+      true, { 10, 3, 1.8, 2, 1, 1, 1, "a=2 c=2 b=1 ab=1" } },
+    { analyze_shape, { analyze_text, 1 },
+      true, { 10, 3, 1.8, 2, 1, 1, 1, "a=2" } },
+    { analyze_shape, { '"text"' }, true, { 1, 0, 0, 0, 0, 0, 0, "" } },
+    { function ()
+          local a = json.analyze(analyze_text)
+          return a.bytes, a.objects, a.arrays, a.strings, a.keys.count,
+                 a.keys.distinct
+      end, {}, true, {
+          #analyze_text,
+          { count = 2, max = 4, average = 3, histogram = { 0, 0, 1, 1 } },
+          { count = 2, max = 3, average = 1.5, histogram = { 1, 0, 1 } },
+          { count = 2, max = 5, average = 4, histogram = { 0, 0, 1, 1 },
+            escaped = 1 },
+          6, 4 } },
+    { function ()
+          local keys = {}
+          for i = 1, 5000 do keys["k" .. i] = i end
+          local a = json.analyze(json.encode(keys), 0)
+          return a.keys.count, a.keys.distinct, #a.keys.top
+      end, {}, true, { 5000, 3072, 0 } },
+    { function ()
+          -- Keys are compared once unescaped, and the buffers reused by
+          -- later calls are not affected by errors
+          pcall(json.analyze, '["' .. string.rep("x", 100) .. '",')
+          local a = json.analyze('[{"a":1},{"\\u0061":2,"b":3},{"a\\n":4}]')
+          return a.keys.distinct, a.keys.top[1].key, a.keys.top[1].count,
+                 a.keys.top[3].key
+      end, {}, true, { 3, "a", 2, "a\n" } },
+    { json.analyze, { '[1,2' },
+      false, { "Expected comma or array end but found T_END at character 5" } },
+    { json.analyze, { '{"a":1}x' },
+      false, { "Expected the end but found invalid token at character 8" } },
+    { json.analyze, { string.rep("[", 1001) .. string.rep("]", 1001) },
+      false, { "Too many nested data structures" } },
+    { arg_error, { json.analyze, "[]", -1 },
+      true, { false, "2", "expected non-negative integer" } },
+}
+
+local template_shape = {
+    id = 0, user = { id = 0, name = "" }, tags = { "" },
+    items = { { sku = "", qty = 0 } }
+}
+local template = json.template(template_shape)
+local template_text = '{"items":[{"qty":2,"sku":"a"},{"sku":"b","qty":1,' ..
+                      '"note":"x"}],"id":1,"tags":["t"],"other":{"id":2},' ..
+                      '"user":[1,2]}'
+
+local cyclic_shape = {}
+cyclic_shape.next = cyclic_shape
+
+local template_tests = {
+    { json.decode_with, { template_text, template },
+      true, { json.decode(template_text) } },
+    { json.decode_with, { template_text, template_shape },
+      true, { json.decode(template_text) } },
+    { json.decode_with, { '{"id":1,"user":{"name":"kim","id":7}}', template },
+      true, { { id = 1, user = { name = "kim", id = 7 } } } },
+    { json.decode_with, { '[{"a":[1]},{"a":[2],"b":null}]', { { a = { 0 } } } },
+      true, { { { a = { 1 } }, { a = { 2 }, b = json.null } } } },
+    { json.decode_with, { '"text"', template }, true, { "text" } },
+    { json.template, { { id = 0, [2] = 0 } },
+      false, { "Template object keys must be strings" } },
+    { json.template, { cyclic_shape },
+      false, { "Template is too deeply nested" } },
+    { json.decode_with, { '{"id":1', template },
+      false, { "Expected comma or object end but found T_END at character 8" } },
+    { arg_error, { json.decode_with, "{}", "template" },
+      true, { false, "2", "cjson.template expected, got string" } },
+}
+
+local chunk_value = {}
+for i = 1, 1000 do
+    chunk_value[i] = { "item " .. i, i, i % 2 == 0 }
+end
+
+local function chunk_cycle(chunk_size)
+    local chunks = json.encode_chunks(chunk_value, chunk_size)
+    return table.concat(chunks) == json.encode(chunk_value), #chunks > 1
+end
+
+local function chunk_file()
+    local file = io.tmpfile()
+    file:write("data=")
+    local len = json.encode_file(chunk_value, file)
+    file:seek("set")
+    local text = file:read("*a")
+    file:close()
+    return len, text == "data=" .. json.encode(chunk_value)
+end
+
+local chunk_tests = {
+    { chunk_cycle, { 256 }, true, { true, true } },
+    { chunk_cycle, {}, true, { true, false } },
+    { json.encode_chunks, { "text" }, true, { { '"text"' } } },
+    { arg_error, { json.encode_chunks, {}, 0 },
+      true, { false, "2", "expected positive integer" } },
+    { json.encode_chunks, { { 1, function () end }, 4 },
+      false, { "Cannot serialise function: type not supported" } },
+    { json.encode, { { 1, 2 } }, true, { "[1,2]" } },
+    { chunk_file, {}, true, { #json.encode(chunk_value), true } },
+    { function ()
+          local file = io.tmpfile()
+          file:close()
+          return arg_error(json.encode_file, 1, file)
+      end, {}, true, { false, "2", "attempt to use a closed file" } },
+}
+
 print(string.format("Testing CJSON v%s\n", cjson.version))
 
 run_test_group("decode simple value", decode_simple_tests)
@@ -225,6 +1166,28 @@ run_test_group("encode table", encode_table_tests)
 run_test_group("decode error", decode_error_tests)
 run_test_group("encode error", encode_error_tests)
 run_test_group("escape", escape_tests)
+run_test_group("utf8", utf8_tests)
+run_test_group("columns", column_tests)
+run_test_group("instance", instance_tests)
+run_test_group("parallel", parallel_tests)
+run_test_group("async", async_tests)
+run_test_group("shared", shared_tests)
+run_test_group("step", step_tests)
+run_test_group("tape", tape_tests)
+run_test_group("msgpack", msgpack_tests)
+run_test_group("stats", stats_tests)
+run_test_group("kernel", kernel_tests)
+run_test_group("ffi", ffi_tests)
+run_test_group("integer", integer_tests)
+run_test_group("limits", limit_tests)
+run_test_group("packed", packed_tests)
+run_test_group("chunks", chunk_tests)
+run_test_group("cache", cache_tests)
+run_test_group("canonical", canonical_tests)
+run_test_group("edit", edit_tests)
+run_test_group("format", format_tests)
+run_test_group("analyze", analyze_tests)
+run_test_group("template", template_tests)
 
 cjson.refuse_invalid_numbers(false)
 cjson.encode_max_depth(20)